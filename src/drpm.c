@@ -19,6 +19,9 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* O_DIRECT */
+#define _GNU_SOURCE
+
 #include "drpm.h"
 #include "drpm_private.h"
 
@@ -30,6 +33,59 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+#define COPY_RANGE_MIN_LEN (1 << 16)
+
+/* DeltaRPM matched against old RPM (or installed package),
+ * with sequence expanded and ready to be applied (once) */
+struct drpm_prepared {
+    struct deltarpm delta;
+    bool from_rpm;
+    bool applied;
+    struct rpm *old_rpm;
+    struct file_info *files;
+    size_t file_count;
+    struct cpio_file *cpio_files;
+    size_t cpio_files_len;
+};
+
+/* batch job with its estimated cost (size of DeltaRPM) */
+struct batch_job {
+    drpm_apply_job *job;
+    off_t cost;
+};
+
+/* jobs of a batch apply in order of execution */
+struct batch {
+    struct batch_job *jobs;
+    const drpm_apply_options *opts;
+    struct rpm_db *db;
+};
+
+/* parsed sequence ID of a batch check */
+struct batch_sequence {
+    size_t index;
+    char *nevr;
+    unsigned char *seq;
+    size_t seq_len;
+};
+
+static int apply(struct drpm_prepared *, struct sink *, const drpm_apply_options *);
+static void apply_batch_job(void *, size_t);
+static int apply_file(struct drpm_prepared *, const char *, const drpm_apply_options *);
+static void check_sequence_group(struct rpm_db *, const struct batch_sequence *, size_t, int, int *);
+static int compare_batch_jobs(const void *, const void *);
+static int compare_batch_sequences(const void *, const void *);
+static int copy_file_data(struct blocks *, uint64_t, size_t, struct pipeline *, unsigned char *, bool *,
+                          struct sink *, struct digest *, size_t *);
+static int parse_sequence_id(const char *, char **, unsigned char **, size_t *);
+static bool file_unchanged(const struct stat *, const struct stat *);
+static int read_copies(struct drpm *);
+static int prepare(struct drpm_prepared *, const char *, const char *, int, struct rpm_db *);
+static void prepared_free(struct drpm_prepared *);
+static int write_payload(struct pipeline *, struct pipeline *, struct digest *, const unsigned char *, size_t);
 
 const char *drpm_strerror(int error)
 {
@@ -66,12 +122,17 @@ const char *drpm_strerror(int error)
 int drpm_read(struct drpm **delta_ret, const char *filename)
 {
     struct deltarpm delta = {0};
+    struct stat stats;
     int error = DRPM_ERR_OK;
 
     if (filename == NULL || delta_ret == NULL)
         return DRPM_ERR_ARGS;
 
-    if ((error = read_deltarpm(&delta, filename)) != DRPM_ERR_OK)
+    if (stat(filename, &stats) != 0)
+        return DRPM_ERR_IO;
+
+    /* copies are only decompressed once requested */
+    if ((error = read_deltarpm(&delta, filename, DELTARPM_PREFIX_ONLY)) != DRPM_ERR_OK)
         goto cleanup;
 
     if ((*delta_ret = malloc(sizeof(struct drpm))) == NULL) {
@@ -79,8 +140,13 @@ int drpm_read(struct drpm **delta_ret, const char *filename)
         goto cleanup;
     }
 
-    if ((error = deltarpm_to_drpm(&delta, *delta_ret)) != DRPM_ERR_OK)
+    if ((error = deltarpm_to_drpm(&delta, *delta_ret)) != DRPM_ERR_OK) {
+        free(*delta_ret);
         goto cleanup;
+    }
+
+    (*delta_ret)->copies_read = false;
+    (*delta_ret)->stats = stats;
 
 cleanup:
     free_deltarpm(&delta);
@@ -91,6 +157,70 @@ cleanup:
     return error;
 }
 
+/* checks if file described by <stats> is still the same as at <orig> */
+bool file_unchanged(const struct stat *orig, const struct stat *stats)
+{
+    return stats->st_dev == orig->st_dev && stats->st_ino == orig->st_ino &&
+           stats->st_size == orig->st_size &&
+           stats->st_mtim.tv_sec == orig->st_mtim.tv_sec &&
+           stats->st_mtim.tv_nsec == orig->st_mtim.tv_nsec &&
+           stats->st_ctim.tv_sec == orig->st_ctim.tv_sec &&
+           stats->st_ctim.tv_nsec == orig->st_ctim.tv_nsec;
+}
+
+/* Reads copies and data lengths skipped by drpm_read().
+ * Neither the file nor what has been read from it may have changed. */
+int read_copies(struct drpm *delta)
+{
+    struct deltarpm full = {0};
+    struct drpm rest;
+    struct stat stats;
+    int error;
+
+    if (delta->copies_read)
+        return DRPM_ERR_OK;
+
+    if (stat(delta->filename, &stats) != 0)
+        return DRPM_ERR_IO;
+
+    if (!file_unchanged(&delta->stats, &stats))
+        return DRPM_ERR_MISMATCH;
+
+    if ((error = read_deltarpm(&full, delta->filename, DELTARPM_INT_DATA_SKIP)) != DRPM_ERR_OK)
+        return error;
+
+    if ((error = deltarpm_to_drpm(&full, &rest)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    /* file may have been replaced while being read */
+    if (rest.version != delta->version || rest.type != delta->type ||
+        rest.comp != delta->comp || rest.tgt_size != delta->tgt_size ||
+        rest.tgt_comp != delta->tgt_comp || rest.tgt_header_len != delta->tgt_header_len ||
+        rest.payload_fmt_off != delta->payload_fmt_off ||
+        strcmp(rest.sequence, delta->sequence) != 0 ||
+        strcmp(rest.tgt_md5, delta->tgt_md5) != 0 ||
+        strcmp(rest.tgt_leadsig, delta->tgt_leadsig) != 0) {
+        error = DRPM_ERR_MISMATCH;
+    } else {
+        delta->int_copies = rest.int_copies;
+        delta->ext_copies = rest.ext_copies;
+        delta->int_copies_size = rest.int_copies_size;
+        delta->ext_copies_size = rest.ext_copies_size;
+        delta->ext_data_len = rest.ext_data_len;
+        delta->int_data_len = rest.int_data_len;
+        delta->copies_read = true;
+        rest.int_copies = NULL;
+        rest.ext_copies = NULL;
+    }
+
+    drpm_free(&rest);
+
+cleanup:
+    free_deltarpm(&full);
+
+    return error;
+}
+
 int drpm_destroy(struct drpm **delta)
 {
     if (delta == NULL || *delta == NULL)
@@ -168,9 +298,15 @@ int drpm_get_ulong(struct drpm *delta, int tag, unsigned long *ret)
 
 int drpm_get_ullong(struct drpm *delta, int tag, unsigned long long *ret)
 {
+    int error;
+
     if (delta == NULL || ret == NULL)
         return DRPM_ERR_ARGS;
 
+    if ((tag == DRPM_TAG_EXTDATALEN || tag == DRPM_TAG_INTDATALEN) &&
+        (error = read_copies(delta)) != DRPM_ERR_OK)
+        return error;
+
     switch (tag) {
     case DRPM_TAG_VERSION:
         *ret = (unsigned long long)delta->version;
@@ -253,10 +389,15 @@ int drpm_get_string(struct drpm *delta, int tag, char **ret)
 int drpm_get_ulong_array(struct drpm *delta, int tag, unsigned long **ret_array, unsigned long *ret_size)
 {
     uint32_t *array;
+    int error;
 
     if (delta == NULL || ret_array == NULL || ret_size == NULL)
         return DRPM_ERR_ARGS;
 
+    if ((tag == DRPM_TAG_INTCOPIES || tag == DRPM_TAG_EXTCOPIES) &&
+        (error = read_copies(delta)) != DRPM_ERR_OK)
+        return error;
+
     switch (tag) {
     case DRPM_TAG_ADJELEMS:
         array = delta->offadj_elems;
@@ -496,39 +637,419 @@ cleanup:
 /***************************** drpm apply *****************************/
 
 int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *new_rpm_name)
+{
+    return drpm_apply_with_options(old_rpm_name, deltarpm_name, new_rpm_name, NULL);
+}
+
+int drpm_apply_with_options(const char *old_rpm_name, const char *deltarpm_name,
+                            const char *new_rpm_name, const drpm_apply_options *opts)
+{
+    int error;
+    struct drpm_prepared prep = {0};
+
+    if (deltarpm_name == NULL || new_rpm_name == NULL)
+        return DRPM_ERR_ARGS;
+
+    if ((error = prepare(&prep, old_rpm_name, deltarpm_name, DRPM_CHECK_NONE, NULL)) == DRPM_ERR_OK)
+        error = apply_file(&prep, new_rpm_name, opts);
+
+    prepared_free(&prep);
+
+    return error;
+}
+
+/* Re-creates new RPM from <prep>ared DeltaRPM as file <new_rpm_name>. */
+int apply_file(struct drpm_prepared *prep, const char *new_rpm_name,
+               const drpm_apply_options *opts)
+{
+    int error;
+    int filedesc = -1;
+    bool direct = (opts != NULL && opts->direct_io);
+    struct sink *sink = NULL;
+
+    /* not all filesystems support O_DIRECT */
+    if (direct &&
+        (filedesc = open(new_rpm_name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, CREAT_MODE)) < 0)
+        direct = false;
+
+    /* opened for reading as well, so that data copied from installed
+     * files can be hashed as it was written (see sink_copy_range()) */
+    if (!direct && (filedesc = open(new_rpm_name, O_RDWR | O_CREAT | O_TRUNC, CREAT_MODE)) < 0)
+        return DRPM_ERR_IO;
+
+    if ((error = sink_init_fd(&sink, filedesc, direct)) == DRPM_ERR_OK)
+        error = apply(prep, sink, opts);
+
+    sink_destroy(&sink);
+    close(filedesc);
+
+    return error;
+}
+
+int drpm_apply_fd(const char *old_rpm_name, const char *deltarpm_name,
+                  int filedesc, const drpm_apply_options *opts)
+{
+    int error;
+    int flags;
+    struct drpm_prepared prep = {0};
+    struct sink *sink = NULL;
+
+    if (deltarpm_name == NULL || filedesc < 0)
+        return DRPM_ERR_ARGS;
+
+    if ((flags = fcntl(filedesc, F_GETFL)) == -1)
+        return DRPM_ERR_ARGS;
+
+    if ((error = prepare(&prep, old_rpm_name, deltarpm_name, DRPM_CHECK_NONE, NULL)) == DRPM_ERR_OK &&
+        (error = sink_init_fd(&sink, filedesc, (flags & O_DIRECT) != 0)) == DRPM_ERR_OK)
+        error = apply(&prep, sink, opts);
+
+    sink_destroy(&sink);
+    prepared_free(&prep);
+
+    return error;
+}
+
+int drpm_apply_cb(const char *old_rpm_name, const char *deltarpm_name,
+                  drpm_write_func write_func, void *write_arg,
+                  const drpm_apply_options *opts)
+{
+    int error;
+    struct drpm_prepared prep = {0};
+    struct sink *sink = NULL;
+
+    if (deltarpm_name == NULL || write_func == NULL)
+        return DRPM_ERR_ARGS;
+
+    if ((error = prepare(&prep, old_rpm_name, deltarpm_name, DRPM_CHECK_NONE, NULL)) == DRPM_ERR_OK &&
+        (error = sink_init_func(&sink, write_func, write_arg)) == DRPM_ERR_OK)
+        error = apply(&prep, sink, opts);
+
+    sink_destroy(&sink);
+    prepared_free(&prep);
+
+    return error;
+}
+
+int drpm_prepare(drpm_prepared **prep_ret, const char *deltarpm_name, int check_mode)
+{
+    int error;
+    struct drpm_prepared *prep;
+
+    if (prep_ret == NULL || deltarpm_name == NULL ||
+        (check_mode != DRPM_CHECK_NONE &&
+         check_mode != DRPM_CHECK_FILESIZES &&
+         check_mode != DRPM_CHECK_FULL))
+        return DRPM_ERR_ARGS;
+
+    if ((prep = calloc(1, sizeof(struct drpm_prepared))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    error = prepare(prep, NULL, deltarpm_name, check_mode, NULL);
+
+    /* cache is optional, failing to save it is not an error */
+    if (check_mode == DRPM_CHECK_FULL)
+        digest_cache_flush();
+
+    if (error != DRPM_ERR_OK) {
+        prepared_free(prep);
+        free(prep);
+        return error;
+    }
+
+    *prep_ret = prep;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_prepared(drpm_prepared *prep, const char *new_rpm_name, const drpm_apply_options *opts)
+{
+    if (prep == NULL || new_rpm_name == NULL || prep->applied)
+        return DRPM_ERR_ARGS;
+
+    /* internal data is streamed and old header is patched */
+    prep->applied = true;
+
+    return apply_file(prep, new_rpm_name, opts);
+}
+
+int drpm_prepared_destroy(drpm_prepared **prep)
+{
+    if (prep == NULL || *prep == NULL)
+        return DRPM_ERR_ARGS;
+
+    prepared_free(*prep);
+
+    free(*prep);
+    *prep = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+/* orders batch jobs by decreasing cost */
+int compare_batch_jobs(const void *a, const void *b)
+{
+    const off_t cost_a = ((const struct batch_job *)a)->cost;
+    const off_t cost_b = ((const struct batch_job *)b)->cost;
+
+    return (cost_a < cost_b) - (cost_a > cost_b);
+}
+
+void apply_batch_job(void *arg, size_t index)
+{
+    struct batch *batch = arg;
+    drpm_apply_job *job = batch->jobs[index].job;
+    struct drpm_prepared prep = {0};
+
+    if (job->deltarpm == NULL || job->new_rpm == NULL)
+        job->error = DRPM_ERR_ARGS;
+    else if ((job->error = prepare(&prep, job->old_rpm, job->deltarpm, DRPM_CHECK_NONE, batch->db)) == DRPM_ERR_OK)
+        job->error = apply_file(&prep, job->new_rpm, batch->opts);
+
+    prepared_free(&prep);
+}
+
+int drpm_apply_batch(drpm_apply_job *jobs, size_t count, unsigned workers,
+                     const drpm_apply_options *opts)
 {
     int error = DRPM_ERR_OK;
-    struct deltarpm delta = {0};
-    const bool from_rpm = (old_rpm_name != NULL);
-    bool rpm_only;
-    struct rpm *old_rpm = NULL;
-    struct rpm *patched_rpm = NULL;
+    struct batch batch = {.opts = opts, .db = NULL};
+    struct stat stats;
+    bool need_db = false;
+
+    if (jobs == NULL && count > 0)
+        return DRPM_ERR_ARGS;
+
+    if (count == 0)
+        return DRPM_ERR_OK;
+
+    if ((batch.jobs = malloc(count * sizeof(struct batch_job))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    /* starting with the largest DeltaRPMs keeps all workers
+     * busy until the end instead of leaving one straggler */
+    for (size_t i = 0; i < count; i++) {
+        jobs[i].error = DRPM_ERR_OK;
+        batch.jobs[i].job = jobs + i;
+        batch.jobs[i].cost = (jobs[i].deltarpm != NULL && stat(jobs[i].deltarpm, &stats) == 0) ?
+                             stats.st_size : 0;
+        need_db |= (jobs[i].old_rpm == NULL);
+    }
+
+    qsort(batch.jobs, count, sizeof(struct batch_job), compare_batch_jobs);
+
+    /* one database handle serves all jobs using filesystem data,
+     * if it cannot be opened, each job opens the database itself */
+    if (need_db)
+        rpm_db_open(&batch.db);
+
+    pool_run(count, workers, apply_batch_job, &batch);
+
+    for (size_t i = 0; i < count; i++) {
+        if (jobs[i].error != DRPM_ERR_OK) {
+            error = jobs[i].error;
+            break;
+        }
+    }
+
+    rpm_db_close(&batch.db);
+    free(batch.jobs);
+
+    return error;
+}
+
+/* Writes reconstructed payload data to <out>. Data is also fed to
+ * <verify> and/or <sha256> (if not NULL) for verification. */
+int write_payload(struct pipeline *out, struct pipeline *verify, struct digest *sha256,
+                  const unsigned char *data, size_t len)
+{
+    int error;
+
+    if ((error = pipeline_write(out, data, len)) != DRPM_ERR_OK ||
+        (verify != NULL && (error = pipeline_write(verify, data, len)) != DRPM_ERR_OK))
+        return error;
+
+    if (sha256 != NULL)
+        return digest_update(sha256, data, len);
+
+    return DRPM_ERR_OK;
+}
+
+/* Copies external data at <offset> straight from an installed file to
+ * <sink> for as long as the add block leaves it unchanged (up to <len>).
+ * A chunk of add block data read past the copied range is left in
+ * <addblk_buf> (<*addblk_pending>). Data written to <sink> is hashed
+ * with <dgst> (if not NULL). */
+int copy_file_data(struct blocks *blks, uint64_t offset, size_t len,
+                   struct pipeline *addblk, unsigned char *addblk_buf, bool *addblk_pending,
+                   struct sink *sink, struct digest *dgst, size_t *copied_ret)
+{
+    int error;
+    int filedesc;
+    off_t file_off;
+    size_t range_len;
+    size_t chunk_len;
+    size_t copy_len = 0;
+
+    *copied_ret = 0;
+
+    if ((error = blocks_file_range(blks, offset, len, &filedesc, &file_off, &range_len)) != DRPM_ERR_OK)
+        return error;
+
+    if (range_len < COPY_RANGE_MIN_LEN)
+        return DRPM_ERR_OK;
+
+    if (addblk == NULL) {
+        copy_len = range_len;
+    } else {
+        /* add block is read in the same chunks as it would be for blocks */
+        while (copy_len < range_len) {
+            chunk_len = MIN(len - copy_len, block_size() - (offset + copy_len) % block_size());
+            if ((error = pipeline_read(addblk, chunk_len, addblk_buf)) != DRPM_ERR_OK)
+                return error;
+            if (copy_len + chunk_len > range_len || !bytes_zero(addblk_buf, chunk_len)) {
+                *addblk_pending = true;
+                break;
+            }
+            copy_len += chunk_len;
+        }
+        if (copy_len == 0)
+            return DRPM_ERR_OK;
+    }
+
+    if ((error = sink_copy_range(sink, filedesc, file_off, copy_len, dgst)) != DRPM_ERR_OK)
+        return error;
+
+    *copied_ret = copy_len;
+
+    return DRPM_ERR_OK;
+}
+
+/* Reads <deltarpm_name> and old RPM (or its header from <db> if not NULL,
+ * or from the rpm database), matching them and expanding the sequence
+ * into <prep>. Installed files are checked according to <check_mode>. */
+int prepare(struct drpm_prepared *prep, const char *old_rpm_name, const char *deltarpm_name,
+            int check_mode, struct rpm_db *db)
+{
+    int error;
+    struct deltarpm *delta = &prep->delta;
     unsigned char oldsig_md5[MD5_DIGEST_LENGTH];
-    unsigned char newsig_md5[MD5_DIGEST_LENGTH];
+    bool has_md5;
     char *old_rpm_nevr = NULL;
-    struct file_info *files = NULL;
-    size_t file_count = 0;
     unsigned short digest_algo;
-    struct cpio_file *cpio_files = NULL;
-    size_t cpio_files_len = 0;
+
+    prep->from_rpm = (old_rpm_name != NULL);
+
+    /* reading DeltaRPM */
+    if ((error = read_deltarpm(delta, deltarpm_name, DELTARPM_INT_DATA_STREAM)) != DRPM_ERR_OK)
+        return error;
+
+    if (prep->from_rpm) {
+        /* reading old RPM (archive is decompressed as blocks are filled) */
+        if ((error = rpm_read(&prep->old_rpm, old_rpm_name, RPM_ARCHIVE_STREAM_DECOMP, NULL, NULL, NULL)) != DRPM_ERR_OK)
+            return error;
+        if (delta->type == DRPM_TYPE_RPMONLY) {
+            /* comparing signature MD5 with DeltaRPM sequence */
+            if ((error = rpm_signature_get_md5(prep->old_rpm, oldsig_md5, &has_md5)) != DRPM_ERR_OK)
+                return error;
+            if (!has_md5)
+                return DRPM_ERR_FORMAT;
+            if (memcmp(delta->sequence, oldsig_md5, MD5_DIGEST_LENGTH) != 0)
+                return DRPM_ERR_MISMATCH;
+        }
+    } else {
+        // rpm-only deltarpms do not work from filesystem
+        // cannot reconstruct source RPMs from filesystem
+        if (delta->type == DRPM_TYPE_RPMONLY || rpm_is_sourcerpm(delta->head.tgt_rpm))
+            return DRPM_ERR_ARGS;
+        /* reading old RPM header from database */
+        if ((error = rpm_read_header(&prep->old_rpm, db, delta->src_nevr, NULL)) != DRPM_ERR_OK)
+            return error;
+    }
+
+    /* comparing source NEVRs */
+    if ((error = rpm_get_nevr(prep->old_rpm, &old_rpm_nevr)) != DRPM_ERR_OK)
+        return error;
+    if (strcmp(delta->src_nevr, old_rpm_nevr) != 0)
+        error = DRPM_ERR_MISMATCH;
+    free(old_rpm_nevr);
+    if (error != DRPM_ERR_OK)
+        return error;
+
+    if (delta->type != DRPM_TYPE_RPMONLY) {
+        /* expanding sequence (checking files if reading from filesystem) */
+        if ((error = rpm_get_file_info(prep->old_rpm, &prep->files, &prep->file_count, NULL)) != DRPM_ERR_OK ||
+            (error = rpm_get_digest_algo(prep->old_rpm, &digest_algo)) != DRPM_ERR_OK ||
+            (error = expand_sequence(&prep->cpio_files, &prep->cpio_files_len,
+                                     delta->sequence, delta->sequence_len,
+                                     prep->files, prep->file_count, digest_algo,
+                                     check_mode, NULL)) != DRPM_ERR_OK)
+            return error;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* frees data of <prep>ared DeltaRPM */
+void prepared_free(struct drpm_prepared *prep)
+{
+    for (size_t i = 0; i < prep->file_count; i++) {
+        free(prep->files[i].name);
+        free(prep->files[i].md5);
+        free(prep->files[i].linkto);
+    }
+    free(prep->files);
+    free(prep->cpio_files);
+    free_deltarpm(&prep->delta);
+    rpm_destroy(&prep->old_rpm);
+}
+
+/* Re-creates new RPM from <prep>ared DeltaRPM, writing it to <out_sink>. */
+int apply(struct drpm_prepared *prep, struct sink *out_sink, const drpm_apply_options *user_opts)
+{
+    int error = DRPM_ERR_OK;
+    drpm_apply_options opts = {0};
+    struct deltarpm *delta = &prep->delta;
+    const bool from_rpm = prep->from_rpm;
+    const bool rpm_only = (delta->type == DRPM_TYPE_RPMONLY);
+    bool uncompressed;
+    struct rpm *patched_rpm = NULL;
+    unsigned char newsig_md5[MD5_DIGEST_LENGTH];
     struct blocks *blks = NULL;
-    int filedesc;
-    MD5_CTX md5;
+    struct digest dgst = {0};
     unsigned char md5_digest[MD5_DIGEST_LENGTH];
     bool no_full_md5;
     bool has_md5;
     const unsigned char empty_md5[MD5_DIGEST_LENGTH] = {0};
     struct decompstrm *addblk_strm = NULL;
+    struct pipeline *addblk = NULL;
+    uint64_t addblk_len = 0;
     unsigned char *addblk_buf = NULL;
+    bool addblk_pending = false;
+    bool copy_files;
+    size_t copied;
     unsigned char *buffer = NULL;
     size_t buffer_len;
     unsigned char *header = NULL;
     uint32_t header_size;
     struct compstrm_wrapper *csw = NULL;
+    struct pipeline *out = NULL;
+    unsigned char *leadsig = NULL;
+    uint32_t leadsig_len;
+    uint64_t payload_len = 0;
+    struct compstrm_wrapper *verify_csw = NULL;
+    struct pipeline *verify = NULL;
+    bool has_payload_digest = false;
+    unsigned char payload_digest[SHA256_DIGEST_LENGTH];
+    bool has_comp_digest = false;
+    unsigned char comp_digest[SHA256_DIGEST_LENGTH];
+    struct digest sha256 = {0};
+    unsigned char sha256_digest[SHA256_DIGEST_LENGTH];
     const uint32_t *int_copies;
     uint32_t int_copies_count;
     size_t int_copy_len;
-    const unsigned char *int_data;
+    size_t int_chunk_len;
+    struct pipeline *int_data = NULL;
     const uint32_t *ext_copies;
     uint32_t ext_copies_count;
     size_t ext_copy_len;
@@ -536,93 +1057,58 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
     uint32_t ext_copies_todo;
     size_t ext_copies_done = 0;
     size_t blk_id;
-    unsigned char *comp_data;
-    size_t comp_data_len;
 
-    if (deltarpm_name == NULL || new_rpm_name == NULL)
-        return DRPM_ERR_ARGS;
+    if (user_opts == NULL)
+        drpm_apply_options_defaults(&opts);
+    else if ((error = drpm_apply_options_copy(&opts, user_opts)) != DRPM_ERR_OK)
+        goto cleanup_opts;
 
-    if ((filedesc = creat(new_rpm_name, CREAT_MODE)) < 0)
-        return DRPM_ERR_IO;
+    no_full_md5 = (memcmp(empty_md5, delta->tgt_md5, MD5_DIGEST_LENGTH) == 0);
 
-    /* reading DeltaRPM */
-    if ((error = read_deltarpm(&delta, deltarpm_name)) != DRPM_ERR_OK)
+    /* rpm-only deltarpms include the (compressed) header in the diff */
+    if (opts.uncompressed && rpm_only) {
+        error = DRPM_ERR_ARGS;
         goto cleanup;
-    rpm_only = (delta.type == DRPM_TYPE_RPMONLY);
-    no_full_md5 = (memcmp(empty_md5, delta.tgt_md5, MD5_DIGEST_LENGTH) == 0);
-
-    if (from_rpm) {
-        /* reading old RPM */
-        if ((error = rpm_read(&old_rpm, old_rpm_name, RPM_ARCHIVE_READ_DECOMP, NULL, NULL, NULL)) != DRPM_ERR_OK)
-            goto cleanup;
-        if (rpm_only) {
-            /* comparing signature MD5 with DeltaRPM sequence */
-            if ((error = rpm_signature_get_md5(old_rpm, oldsig_md5, &has_md5)) != DRPM_ERR_OK)
-                goto cleanup;
-            if (!has_md5) {
-                error = DRPM_ERR_FORMAT;
-                goto cleanup;
-            }
-            if (memcmp(delta.sequence, oldsig_md5, MD5_DIGEST_LENGTH) != 0) {
-                error = DRPM_ERR_MISMATCH;
-                goto cleanup;
-            }
-        }
-    } else {
-        // rpm-only deltarpms do not work from filesystem
-        if (rpm_only)
-            return DRPM_ERR_ARGS;
-        // cannot reconstruct source RPMs from filesystem
-        if (rpm_is_sourcerpm(delta.head.tgt_rpm))
-            return DRPM_ERR_ARGS;
-        /* reading old RPM header from database */
-        if ((error = rpm_read_header(&old_rpm, delta.src_nevr, NULL)) != DRPM_ERR_OK)
-            goto cleanup;
     }
+    uncompressed = (opts.uncompressed && delta->tgt_comp != DRPM_COMP_NONE);
 
-    /* comparing source NEVRs */
-    if ((error = rpm_get_nevr(old_rpm, &old_rpm_nevr)) != DRPM_ERR_OK)
-        goto cleanup;
-    if (strcmp(delta.src_nevr, old_rpm_nevr) != 0) {
-        error = DRPM_ERR_MISMATCH;
+    /* size of new RPM is known unless payload is left uncompressed */
+    if (!uncompressed && (error = sink_allocate(out_sink, delta->tgt_size)) != DRPM_ERR_OK)
         goto cleanup;
-    }
-
-    if (!rpm_only) {
-        /* expanding sequence */
-        if ((error = rpm_get_file_info(old_rpm, &files, &file_count, NULL)) != DRPM_ERR_OK ||
-            (error = rpm_get_digest_algo(old_rpm, &digest_algo)) != DRPM_ERR_OK ||
-            (error = expand_sequence(&cpio_files, &cpio_files_len,
-                                     delta.sequence, delta.sequence_len,
-                                     files, file_count, digest_algo,
-                                     DRPM_CHECK_NONE)) != DRPM_ERR_OK)
-            goto cleanup;
-    }
 
     /* overwriting old RPM's lead and signature with new RPM's */
-    patched_rpm = old_rpm;
-    if ((error = rpm_replace_lead_and_signature(patched_rpm, delta.tgt_leadsig, delta.tgt_leadsig_len)) != DRPM_ERR_OK)
+    patched_rpm = prep->old_rpm;
+    if ((error = rpm_replace_lead_and_signature(patched_rpm, delta->tgt_leadsig, delta->tgt_leadsig_len)) != DRPM_ERR_OK)
         goto cleanup;
 
-    if (rpm_only && delta.tgt_comp == DRPM_COMP_NONE &&
-        delta.int_copies_count == 0 && delta.ext_copies_count == 0) {
+    if (rpm_only && delta->tgt_comp == DRPM_COMP_NONE &&
+        delta->int_copies_count == 0 && delta->ext_copies_count == 0) {
     /* no-diff DeltaRPM, no need for reconstruction */
-        if ((error = rpm_write(patched_rpm, new_rpm_name, true, md5_digest, !no_full_md5)) != DRPM_ERR_OK)
+        if ((error = rpm_write_sink(patched_rpm, out_sink, true, md5_digest, !no_full_md5)) != DRPM_ERR_OK)
             goto cleanup;
 
         goto final_check;
     }
 
     /* creating blocks for reading external data */
-    if ((error = blocks_create(&blks, delta.ext_data_len, files,
-                               cpio_files, cpio_files_len,
-                               delta.ext_copies, delta.ext_copies_count,
-                               from_rpm ? old_rpm : NULL, rpm_only)) != DRPM_ERR_OK)
+    if ((error = blocks_create(&blks, delta->ext_data_len, prep->files,
+                               prep->cpio_files, prep->cpio_files_len,
+                               delta->ext_copies, delta->ext_copies_count,
+                               from_rpm ? prep->old_rpm : NULL, rpm_only,
+                               &opts)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    /* reading old data needed more than once up front (old RPM is read sequentially anyway) */
+    if (opts.planned && !from_rpm &&
+        (error = blocks_prefetch(blks, ext_copies_done)) != DRPM_ERR_OK)
         goto cleanup;
 
     /* setting up add block */
-    if (delta.add_data_len > 0) {
-        if ((error = decompstrm_init(&addblk_strm, -1, NULL, NULL, delta.add_data, delta.add_data_len)) != DRPM_ERR_OK)
+    if (delta->add_data_len > 0) {
+        for (uint32_t i = 0; i < delta->ext_copies_count; i++)
+            addblk_len += delta->ext_copies[2 * i + 1];
+        if ((error = decompstrm_init(&addblk_strm, -1, NULL, NULL, delta->add_data, delta->add_data_len)) != DRPM_ERR_OK ||
+            (error = pipeline_reader_init(&addblk, addblk_strm, addblk_len, opts.pipelined)) != DRPM_ERR_OK)
             goto cleanup;
         if ((addblk_buf = malloc(block_size())) == NULL) {
             error = DRPM_ERR_MEMORY;
@@ -630,53 +1116,108 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
         }
     }
 
+    /* internal data is decompressed from DeltaRPM as it is needed */
+    if ((error = pipeline_reader_init(&int_data, delta->int_data_strm, delta->int_data_len, opts.pipelined)) != DRPM_ERR_OK)
+        goto cleanup;
+
     if ((buffer = malloc(block_size())) == NULL) {
         error = DRPM_ERR_MEMORY;
         goto cleanup;
     }
 
-    if (MD5_Init(&md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    if ((error = digest_init(&dgst, DIGEST_MASK(DIGESTALGO_MD5))) != DRPM_ERR_OK)
         goto cleanup;
-    }
 
-    /* writing lead and signature of new RPM */
-    if (write(filedesc, delta.tgt_leadsig, delta.tgt_leadsig_len) != (ssize_t)delta.tgt_leadsig_len) {
-        error = DRPM_ERR_IO;
+    /* hashing lead and signature of new RPM */
+    if (!no_full_md5 &&
+        (error = digest_update(&dgst, delta->tgt_leadsig, delta->tgt_leadsig_len)) != DRPM_ERR_OK)
         goto cleanup;
+
+    if (!rpm_only) {
+        /* standard delta -> hash header (rpm-only includes it in diff) */
+        if ((error = rpm_patch_payload_format(delta->head.tgt_rpm, "cpio")) != DRPM_ERR_OK ||
+            (error = rpm_fetch_header(delta->head.tgt_rpm, &header, &header_size)) != DRPM_ERR_OK)
+            goto cleanup;
+        if ((error = digest_update(&dgst, header, header_size)) != DRPM_ERR_OK ||
+            (error = rpm_get_payload_digest(delta->head.tgt_rpm, comp_digest, &has_comp_digest)) != DRPM_ERR_OK)
+            goto cleanup;
     }
-    if (!no_full_md5 && MD5_Update(&md5, delta.tgt_leadsig, delta.tgt_leadsig_len) != 1) {
-        error = DRPM_ERR_OTHER;
-        goto cleanup;
+
+    if (uncompressed) {
+        /* header and signature are changed to describe uncompressed payload */
+        for (uint32_t i = 0; i < delta->ext_copies_count; i++)
+            payload_len += delta->ext_copies[2 * i + 1];
+        for (uint32_t i = 0; i < delta->int_copies_count; i++)
+            payload_len += delta->int_copies[2 * i + 1];
+        free(header);
+        header = NULL;
+        if ((error = rpm_get_payload_digest_alt(delta->head.tgt_rpm, payload_digest, &has_payload_digest)) != DRPM_ERR_OK ||
+            (error = rpm_patch_payload_uncompressed(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
+            (error = rpm_fetch_header(delta->head.tgt_rpm, &header, &header_size)) != DRPM_ERR_OK ||
+            (error = rpm_replace_lead_and_signature(delta->head.tgt_rpm, delta->tgt_leadsig, delta->tgt_leadsig_len)) != DRPM_ERR_OK ||
+            (error = rpm_signature_empty(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
+            (error = rpm_signature_set_size(delta->head.tgt_rpm, header_size + payload_len)) != DRPM_ERR_OK ||
+            (error = rpm_signature_set_header_sha256(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
+            (error = rpm_signature_reload(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
+            (error = rpm_fetch_lead_and_signature(delta->head.tgt_rpm, &leadsig, &leadsig_len)) != DRPM_ERR_OK)
+            goto cleanup;
     }
 
-    if (!rpm_only) {
-        /* standard delta -> write out header (rpm-only includes it in diff) */
-        if ((error = rpm_patch_payload_format(delta.head.tgt_rpm, "cpio")) != DRPM_ERR_OK ||
-            (error = rpm_fetch_header(delta.head.tgt_rpm, &header, &header_size)) != DRPM_ERR_OK)
+    /* writing lead, signature and header of new RPM */
+    if ((error = sink_write(out_sink, uncompressed ? leadsig : delta->tgt_leadsig,
+                            uncompressed ? leadsig_len : delta->tgt_leadsig_len)) != DRPM_ERR_OK ||
+        (!rpm_only && (error = sink_write(out_sink, header, header_size)) != DRPM_ERR_OK))
+        goto cleanup;
+
+    /* the compressed payload is hashed with SHA-256 in the same pass
+     * as the MD5 sum, to be matched with the digest in the header */
+    if (has_comp_digest && !has_payload_digest &&
+        (error = digest_init(&dgst, DIGEST_MASK(DIGESTALGO_SHA256))) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (uncompressed) {
+        /* payload is written as is; the original MD5 only matches the
+         * compressed payload, so that is reproduced (and just hashed)
+         * unless header has a digest of the uncompressed payload */
+        if ((error = compstrm_wrapper_init(&csw, delta->tgt_header_len,
+                                           out_sink, DRPM_COMP_NONE, DRPM_COMP_LEVEL_DEFAULT,
+                                           NULL)) != DRPM_ERR_OK ||
+            (error = pipeline_writer_init(&out, csw, false)) != DRPM_ERR_OK)
             goto cleanup;
-        if (write(filedesc, header, header_size) != (ssize_t)header_size) {
-            error = DRPM_ERR_IO;
+        if (has_payload_digest) {
+            if ((error = digest_init(&sha256, DIGEST_MASK(DIGESTALGO_SHA256))) != DRPM_ERR_OK)
+                goto cleanup;
+        } else if ((error = compstrm_wrapper_init(&verify_csw, delta->tgt_header_len,
+                                                  NULL, delta->tgt_comp, delta->tgt_comp_level,
+                                                  &dgst)) != DRPM_ERR_OK ||
+                   (error = pipeline_writer_init(&verify, verify_csw, opts.pipelined)) != DRPM_ERR_OK) {
             goto cleanup;
         }
-        if (MD5_Update(&md5, header, header_size) != 1) {
-            error = DRPM_ERR_OTHER;
+    } else {
+        /* compression stream wrapper, makes sure header is uncompressed if included;
+         * written data is hashed along the way */
+        if ((error = compstrm_wrapper_init(&csw, delta->tgt_header_len,
+                                           out_sink, delta->tgt_comp, delta->tgt_comp_level,
+                                           &dgst)) != DRPM_ERR_OK)
+            goto cleanup;
+
+        /* recompression runs in its own thread if pipelined */
+        if ((error = pipeline_writer_init(&out, csw, opts.pipelined && delta->tgt_comp != DRPM_COMP_NONE)) != DRPM_ERR_OK)
             goto cleanup;
-        }
     }
 
-    /* compression stream wrapper, makes sure header is uncompressed if included */
-    if ((error = compstrm_wrapper_init(&csw, delta.tgt_header_len,
-                                       filedesc, delta.tgt_comp, delta.tgt_comp_level)) != DRPM_ERR_OK)
-        goto cleanup;
+    /* Unchanged data of installed files can be copied directly if it is
+     * written out as is. Verification must not need the data itself,
+     * which is the case when compressing on the side. */
+    copy_files = (!from_rpm && verify == NULL &&
+                  (uncompressed || delta->tgt_comp == DRPM_COMP_NONE));
 
     /* reconstructing from diff data */
 
-    int_copies = delta.int_copies;
-    int_copies_count = delta.int_copies_count;
-    ext_copies = delta.ext_copies;
-    ext_copies_count = delta.ext_copies_count;
-    int_data = delta.int_data.bytes;
+    int_copies = delta->int_copies;
+    int_copies_count = delta->int_copies_count;
+    ext_copies = delta->ext_copies;
+    ext_copies_count = delta->ext_copies_count;
 
     while (int_copies_count--) {
         ext_copies_todo = *int_copies++;
@@ -694,20 +1235,38 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
 
             /* performing external copy */
             while (ext_copy_len > 0) {
+                if (copy_files && !addblk_pending && ext_copy_len >= COPY_RANGE_MIN_LEN) {
+                    if ((error = copy_file_data(blks, ext_offset, ext_copy_len,
+                                                addblk, addblk_buf, &addblk_pending, out_sink,
+                                                uncompressed ? (has_payload_digest ? &sha256 : NULL) : &dgst,
+                                                &copied)) != DRPM_ERR_OK)
+                        goto cleanup;
+                    if (copied > 0) {
+                        ext_copy_len -= copied;
+                        ext_offset += copied;
+                        blk_id = block_id(ext_offset);
+                        continue;
+                    }
+                }
+
                 if ((error = blocks_next(blks, buffer, &buffer_len,
                                          ext_offset, ext_copy_len,
                                          ext_copies_done, blk_id)) != DRPM_ERR_OK)
                     goto cleanup;
 
                 /* applying add block */
-                if (delta.add_data_len > 0) {
-                    if ((error = decompstrm_read(addblk_strm, buffer_len, addblk_buf)) != DRPM_ERR_OK)
+                if (delta->add_data_len > 0) {
+                    if (!addblk_pending &&
+                        (error = pipeline_read(addblk, buffer_len, addblk_buf)) != DRPM_ERR_OK)
                         goto cleanup;
-                    for (size_t i = 0; i < buffer_len; i++)
-                        buffer[i] += (signed char)addblk_buf[i];
+                    addblk_pending = false;
+                    /* most fragments are unchanged */
+                    if (!bytes_zero(addblk_buf, buffer_len))
+                        bytes_add(buffer, addblk_buf, buffer_len);
                 }
 
-                if ((error = compstrm_wrapper_write(csw, buffer, buffer_len)) != DRPM_ERR_OK)
+                if ((error = write_payload(out, verify, has_payload_digest ? &sha256 : NULL,
+                                           buffer, buffer_len)) != DRPM_ERR_OK)
                     goto cleanup;
 
                 ext_copy_len -= buffer_len;
@@ -721,24 +1280,51 @@ int drpm_apply(const char *old_rpm_name, const char *deltarpm_name, const char *
         int_copy_len = *int_copies++;
 
         /* performing internal copy */
-        if ((error = compstrm_wrapper_write(csw, int_data, int_copy_len)) != DRPM_ERR_OK)
-            goto cleanup;
-        int_data += int_copy_len;
+        while (int_copy_len > 0) {
+            int_chunk_len = MIN(int_copy_len, block_size());
+            if ((error = pipeline_read(int_data, int_chunk_len, buffer)) != DRPM_ERR_OK ||
+                (error = write_payload(out, verify, has_payload_digest ? &sha256 : NULL,
+                                       buffer, int_chunk_len)) != DRPM_ERR_OK)
+                goto cleanup;
+            int_copy_len -= int_chunk_len;
+        }
     }
 
-    if ((error = compstrm_wrapper_finish(csw, &comp_data, &comp_data_len)) != DRPM_ERR_OK)
+    if ((error = pipeline_finish(out)) != DRPM_ERR_OK ||
+        (error = compstrm_wrapper_finish(csw)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (verify != NULL &&
+        ((error = pipeline_finish(verify)) != DRPM_ERR_OK ||
+         (error = compstrm_wrapper_finish(verify_csw)) != DRPM_ERR_OK))
+        goto cleanup;
+
+    /* finalizing digest of uncompressed payload or MD5 of written data
+     * (only one is matched) and digest of compressed payload */
+    if ((error = has_payload_digest ? digest_final(&sha256, DIGESTALGO_SHA256, sha256_digest) :
+                                      digest_final(&dgst, DIGESTALGO_MD5, md5_digest)) != DRPM_ERR_OK ||
+        (has_comp_digest && !has_payload_digest &&
+         (error = digest_final(&dgst, DIGESTALGO_SHA256, sha256_digest)) != DRPM_ERR_OK))
         goto cleanup;
 
-    /* finalizing MD5 of written data */
-    if (MD5_Update(&md5, comp_data, comp_data_len) != 1 ||
-        MD5_Final(md5_digest, &md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    if (has_comp_digest && !has_payload_digest &&
+        memcmp(sha256_digest, comp_digest, SHA256_DIGEST_LENGTH) != 0) {
+        error = DRPM_ERR_MISMATCH;
         goto cleanup;
     }
 
 final_check:
 
-    if (no_full_md5) {
+    if ((error = sink_flush(out_sink)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (has_payload_digest) {
+    /* uncompressed payload -> match its digest */
+        if (memcmp(sha256_digest, payload_digest, SHA256_DIGEST_LENGTH) != 0) {
+            error = DRPM_ERR_MISMATCH;
+            goto cleanup;
+        }
+    } else if (no_full_md5) {
     /* no target MD5 -> only match checksums of header and archive */
         if ((error = rpm_signature_get_md5(patched_rpm, newsig_md5, &has_md5)) != DRPM_ERR_OK)
             goto cleanup;
@@ -748,7 +1334,7 @@ final_check:
         }
     } else {
     /* match full MD5 */
-        if (memcmp(md5_digest, delta.tgt_md5, MD5_DIGEST_LENGTH) != 0) {
+        if (memcmp(md5_digest, delta->tgt_md5, MD5_DIGEST_LENGTH) != 0) {
             error = DRPM_ERR_MISMATCH;
             goto cleanup;
         }
@@ -756,26 +1342,26 @@ final_check:
 
 cleanup:
 
-    close(filedesc);
-
-    for (size_t i = 0; i < file_count; i++) {
-        free(files[i].name);
-        free(files[i].md5);
-        free(files[i].linkto);
-    }
-    free(files);
-    free_deltarpm(&delta);
-    rpm_destroy(&old_rpm);
-    free(old_rpm_nevr);
+    /* stopping threads before returning control of the sink */
+    pipeline_destroy(&addblk);
+    pipeline_destroy(&int_data);
+    pipeline_destroy(&out);
+    pipeline_destroy(&verify);
 
     blocks_destroy(&blks);
     decompstrm_destroy(&addblk_strm);
     compstrm_wrapper_destroy(&csw);
-    free(cpio_files);
+    compstrm_wrapper_destroy(&verify_csw);
+    digest_destroy(&dgst);
+    digest_destroy(&sha256);
+    free(leadsig);
     free(addblk_buf);
     free(buffer);
     free(header);
-    free(comp_data);
+
+cleanup_opts:
+
+    free(opts.spill_dir);
 
     return error;
 }
@@ -794,12 +1380,12 @@ int drpm_check(const char *deltarpm_name, int check_mode)
         (check_mode != DRPM_CHECK_FILESIZES && check_mode != DRPM_CHECK_FULL))
         return DRPM_ERR_ARGS;
 
-    /* reading DeltaRPM */
-    if ((error = read_deltarpm(&delta, deltarpm_name)) != DRPM_ERR_OK)
+    /* reading DeltaRPM (only source NEVR and sequence are needed) */
+    if ((error = read_deltarpm(&delta, deltarpm_name, DELTARPM_PREFIX_ONLY)) != DRPM_ERR_OK)
         goto cleanup;
 
     /* reading old RPM header from database */
-    if ((error = rpm_read_header(&old_rpm, delta.src_nevr, NULL)) != DRPM_ERR_OK)
+    if ((error = rpm_read_header(&old_rpm, NULL, delta.src_nevr, NULL)) != DRPM_ERR_OK)
         goto cleanup;
 
     /* checking NEVRs */
@@ -815,7 +1401,7 @@ int drpm_check(const char *deltarpm_name, int check_mode)
         if ((error = rpm_get_file_info(old_rpm, &files, &file_count, NULL)) != DRPM_ERR_OK ||
             (error = rpm_get_digest_algo(old_rpm, &digest_algo)) != DRPM_ERR_OK ||
             (error = expand_sequence(NULL, NULL, delta.sequence, delta.sequence_len,
-                                     files, file_count, digest_algo, check_mode)) != DRPM_ERR_OK)
+                                     files, file_count, digest_algo, check_mode, NULL)) != DRPM_ERR_OK)
             goto cleanup;
     }
 
@@ -831,6 +1417,10 @@ cleanup:
     rpm_destroy(&old_rpm);
     free(old_rpm_nevr);
 
+    /* cache is optional, failing to save it is not an error */
+    if (check_mode == DRPM_CHECK_FULL)
+        digest_cache_flush();
+
     return error;
 }
 
@@ -840,8 +1430,6 @@ int drpm_check_sequence(const char *old_rpm_name, const char *sequence, int chec
     char *nevr = NULL;
     unsigned char *seq = NULL;
     size_t seq_len;
-    char *ptr;
-    ptrdiff_t nevr_len;
     struct rpm *old_rpm = NULL;
     unsigned char sigmd5[MD5_DIGEST_LENGTH];
     bool has_md5;
@@ -859,31 +1447,12 @@ int drpm_check_sequence(const char *old_rpm_name, const char *sequence, int chec
         return DRPM_ERR_ARGS;
 
     /* parsing sequence ID into source NEVR and sequence */
-
-    ptr = strrchr(sequence, '-');
-    if (ptr == NULL || ptr == sequence)
-        return DRPM_ERR_FORMAT;
-    nevr_len = ptr - sequence;
-    seq_len = (strlen(++ptr)) / 2;
-    if (seq_len < MD5_DIGEST_LENGTH) {
-        error = DRPM_ERR_FORMAT;
-        goto cleanup;
-    }
-    if ((nevr = malloc(nevr_len + 1)) == NULL ||
-        (seq = malloc(seq_len)) == NULL) {
-        error = DRPM_ERR_MEMORY;
+    if ((error = parse_sequence_id(sequence, &nevr, &seq, &seq_len)) != DRPM_ERR_OK)
         goto cleanup;
-    }
-    strncpy(nevr, sequence, nevr_len);
-    nevr[nevr_len] = '\0';
-    if (parse_hex(seq, ptr) != (ssize_t)seq_len) {
-        error = DRPM_ERR_FORMAT;
-        goto cleanup;
-    }
 
     if (old_rpm_name == NULL) {
         /* reading header from database */
-        if ((error = rpm_read_header(&old_rpm, nevr, NULL)) != DRPM_ERR_OK)
+        if ((error = rpm_read_header(&old_rpm, NULL, nevr, NULL)) != DRPM_ERR_OK)
             goto cleanup;
         rpm_only = false;
     } else {
@@ -907,7 +1476,7 @@ int drpm_check_sequence(const char *old_rpm_name, const char *sequence, int chec
         /* expanding sequence, checking files */
         if ((error = rpm_get_file_info(old_rpm, &files, &file_count, NULL)) != DRPM_ERR_OK ||
             (error = rpm_get_digest_algo(old_rpm, &digest_algo)) != DRPM_ERR_OK ||
-            (error = expand_sequence(NULL, NULL, seq, seq_len, files, file_count, digest_algo, check_mode)) != DRPM_ERR_OK)
+            (error = expand_sequence(NULL, NULL, seq, seq_len, files, file_count, digest_algo, check_mode, NULL)) != DRPM_ERR_OK)
             goto cleanup;
     }
 
@@ -924,5 +1493,180 @@ cleanup:
     free(old_rpm_nevr);
     rpm_destroy(&old_rpm);
 
+    if (check_mode == DRPM_CHECK_FULL)
+        digest_cache_flush();
+
+    return error;
+}
+
+/* Splits <sequence> ID into source NEVR and (binary) sequence. */
+int parse_sequence_id(const char *sequence, char **nevr_ret,
+                      unsigned char **seq_ret, size_t *seq_len_ret)
+{
+    char *nevr;
+    unsigned char *seq;
+    char *ptr;
+    ptrdiff_t nevr_len;
+    size_t seq_len;
+
+    ptr = strrchr(sequence, '-');
+    if (ptr == NULL || ptr == sequence)
+        return DRPM_ERR_FORMAT;
+    nevr_len = ptr - sequence;
+    seq_len = (strlen(++ptr)) / 2;
+    if (seq_len < MD5_DIGEST_LENGTH)
+        return DRPM_ERR_FORMAT;
+
+    if ((nevr = malloc(nevr_len + 1)) == NULL)
+        return DRPM_ERR_MEMORY;
+    if ((seq = malloc(seq_len)) == NULL) {
+        free(nevr);
+        return DRPM_ERR_MEMORY;
+    }
+    strncpy(nevr, sequence, nevr_len);
+    nevr[nevr_len] = '\0';
+    if (parse_hex(seq, ptr) != (ssize_t)seq_len) {
+        free(nevr);
+        free(seq);
+        return DRPM_ERR_FORMAT;
+    }
+
+    *nevr_ret = nevr;
+    *seq_ret = seq;
+    *seq_len_ret = seq_len;
+
+    return DRPM_ERR_OK;
+}
+
+/* groups sequences by source NEVR, keeping their original order */
+int compare_batch_sequences(const void *a, const void *b)
+{
+    const struct batch_sequence *seq_a = a;
+    const struct batch_sequence *seq_b = b;
+    int cmp;
+
+    if ((cmp = strcmp(seq_a->nevr, seq_b->nevr)) != 0)
+        return cmp;
+
+    return (seq_a->index > seq_b->index) - (seq_a->index < seq_b->index);
+}
+
+/* Checks <count> sequences sharing the same installed source package,
+ * storing the result of each into <errors>. The package header, its file
+ * info and the results of checks of individual files are shared. */
+void check_sequence_group(struct rpm_db *db, const struct batch_sequence *seqs, size_t count,
+                          int check_mode, int *errors)
+{
+    int error = DRPM_ERR_OK;
+    struct rpm *old_rpm = NULL;
+    char *old_rpm_nevr = NULL;
+    struct file_info *files = NULL;
+    size_t file_count = 0;
+    unsigned short digest_algo;
+    int *checked = NULL;
+
+    if ((error = rpm_read_header(&old_rpm, db, seqs[0].nevr, NULL)) != DRPM_ERR_OK ||
+        (error = rpm_get_nevr(old_rpm, &old_rpm_nevr)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (strcmp(seqs[0].nevr, old_rpm_nevr) != 0) {
+        error = DRPM_ERR_MISMATCH;
+        goto cleanup;
+    }
+
+    if ((error = rpm_get_file_info(old_rpm, &files, &file_count, NULL)) != DRPM_ERR_OK ||
+        (error = rpm_get_digest_algo(old_rpm, &digest_algo)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (file_count > 0) {
+        if ((checked = malloc(file_count * sizeof(int))) == NULL) {
+            error = DRPM_ERR_MEMORY;
+            goto cleanup;
+        }
+        for (size_t i = 0; i < file_count; i++)
+            checked[i] = -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        errors[seqs[i].index] = expand_sequence(NULL, NULL, seqs[i].seq, seqs[i].seq_len,
+                                                files, file_count, digest_algo, check_mode, checked);
+
+cleanup:
+    if (error != DRPM_ERR_OK)
+        for (size_t i = 0; i < count; i++)
+            errors[seqs[i].index] = error;
+
+    for (size_t i = 0; i < file_count; i++) {
+        free(files[i].name);
+        free(files[i].md5);
+        free(files[i].linkto);
+    }
+    free(files);
+    free(checked);
+    free(old_rpm_nevr);
+    rpm_destroy(&old_rpm);
+}
+
+int drpm_check_sequence_batch(const char **sequences, size_t count, int check_mode, int *errors)
+{
+    int error = DRPM_ERR_OK;
+    struct batch_sequence *seqs;
+    size_t seqs_len = 0;
+    struct rpm_db *db = NULL;
+    size_t group_len;
+
+    if ((count > 0 && (sequences == NULL || errors == NULL)) ||
+        (check_mode != DRPM_CHECK_NONE &&
+         check_mode != DRPM_CHECK_FILESIZES &&
+         check_mode != DRPM_CHECK_FULL))
+        return DRPM_ERR_ARGS;
+
+    if (count == 0)
+        return DRPM_ERR_OK;
+
+    if ((seqs = malloc(count * sizeof(struct batch_sequence))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    /* parsing sequence IDs */
+    for (size_t i = 0; i < count; i++) {
+        if (sequences[i] == NULL) {
+            errors[i] = DRPM_ERR_ARGS;
+            continue;
+        }
+        seqs[seqs_len].index = i;
+        if ((errors[i] = parse_sequence_id(sequences[i], &seqs[seqs_len].nevr, &seqs[seqs_len].seq,
+                                           &seqs[seqs_len].seq_len)) == DRPM_ERR_OK)
+            seqs_len++;
+    }
+
+    qsort(seqs, seqs_len, sizeof(struct batch_sequence), compare_batch_sequences);
+
+    /* if the database cannot be opened here, each lookup opens it itself */
+    rpm_db_open(&db);
+
+    for (size_t i = 0; i < seqs_len; i += group_len) {
+        for (group_len = 1; i + group_len < seqs_len &&
+             strcmp(seqs[i].nevr, seqs[i + group_len].nevr) == 0; group_len++);
+        check_sequence_group(db, seqs + i, group_len, check_mode, errors);
+    }
+
+    rpm_db_close(&db);
+
+    if (check_mode == DRPM_CHECK_FULL)
+        digest_cache_flush();
+
+    for (size_t i = 0; i < count; i++) {
+        if (errors[i] != DRPM_ERR_OK) {
+            error = errors[i];
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < seqs_len; i++) {
+        free(seqs[i].nevr);
+        free(seqs[i].seq);
+    }
+    free(seqs);
+
     return error;
 }
@@ -35,6 +35,8 @@
 #include <config.h>
 #endif
 
+#include <stddef.h>
+
 #if __GNUC__ >= 4
 #define DRPM_VISIBLE __attribute__((visibility("default")))
 #else
@@ -57,6 +59,9 @@
  * providing the same functionality as
  * [applydeltarpm(8)](http://linux.die.net/man/8/applydeltarpm).
  * @{
+ * @defgroup drpmApplyOptions DRPM Apply Options
+ * Tools for customizing DeltaRPM application.
+ *
  * @defgroup drpmCheck DRPM Check
  * Tools for checking if the reconstruction is possible
  * (like <tt>applydeltarpm { -c | -C }</tt>).
@@ -66,6 +71,27 @@
  * Tools for extracting information from DeltaRPM files.
  */
 
+/**
+ * @page drpmThreads Thread safety
+ * The only process-wide state the library keeps is the cache of
+ * restored prelinked files and the installed file digest cache,
+ * both of which are protected by mutexes. Its functions may thus be
+ * called concurrently from multiple threads, as long as each call works
+ * with its own objects (e.g. a ::drpm_make_options or ::drpm_apply_options
+ * structure is not modified while another thread uses it) and no two
+ * calls write the same output file.
+ * Reading the rpm configuration happens only once per process and
+ * lookups of installed packages in the rpm database are serialized,
+ * since rpmlib itself does not support concurrent use of the database.
+ * The digest cache enabled by drpm_set_digest_cache() is process-wide
+ * and may be used (and replaced) by concurrent checks.
+ * Likewise, original content of prelinked files restored during checks
+ * and applies is kept (within limits) for the whole process,
+ * until drpm_clear_prelink_cache() is called.
+ * Other rpmlib state of the process (e.g. macros) must not be changed
+ * while DeltaRPMs are being made or applied.
+ */
+
 /**
  * @name Errors / Return values
  * @{
@@ -169,6 +195,39 @@ typedef struct drpm drpm;
  */
 typedef struct drpm_make_options drpm_make_options;
 
+/**
+ * @brief Options for drpm_apply_with_options()
+ * @ingroup drpmApplyOptions
+ */
+typedef struct drpm_apply_options drpm_apply_options;
+
+/**
+ * @brief Callback receiving output of drpm_apply_cb()
+ * @ingroup drpmApply
+ * Called with @p arg as passed to drpm_apply_cb() and @p len bytes of
+ * output at @p data. Should return @c 0 on success, any other value
+ * aborts the reconstruction.
+ */
+typedef int (*drpm_write_func)(void *arg, const void *data, size_t len);
+
+/**
+ * @brief Job of drpm_apply_batch()
+ * @ingroup drpmApply
+ * Arguments are the same as those of drpm_apply_with_options().
+ */
+typedef struct drpm_apply_job {
+    const char *old_rpm;    /**< old RPM file (if @c NULL, filesystem data is used) */
+    const char *deltarpm;   /**< DeltaRPM file */
+    const char *new_rpm;    /**< new RPM file to be (re-)created */
+    int error;              /**< [out] error code of this job */
+} drpm_apply_job;
+
+/**
+ * @brief DeltaRPM prepared by drpm_prepare()
+ * @ingroup drpmApply
+ */
+typedef struct drpm_prepared drpm_prepared;
+
 /**
  * @ingroup drpmApply
  * @brief Applies a DeltaRPM to an old RPM or on-disk data to re-create a new RPM.
@@ -180,6 +239,166 @@ typedef struct drpm_make_options drpm_make_options;
 DRPM_VISIBLE
 int drpm_apply(const char *oldrpm, const char *deltarpm, const char *newrpm);
 
+/**
+ * @ingroup drpmApply
+ * @brief Applies a DeltaRPM like drpm_apply(), using the given options.
+ * Example of usage (without error handling):
+ * @code
+ * // spill paged-out blocks to /var/tmp, compressed with gzip
+ * drpm_apply_options *opts;
+ *
+ * drpm_apply_options_init(&opts);
+ * drpm_apply_options_set_spill_dir(opts, "/var/tmp");
+ * drpm_apply_options_set_spill_comp(opts, DRPM_COMP_GZIP);
+ *
+ * drpm_apply_with_options(NULL, "foo.drpm", "foo.rpm", opts);
+ *
+ * drpm_apply_options_destroy(&opts);
+ * @endcode
+ * @param [in]  oldrpm      Name of old RPM file (if @c NULL, filesystem data is used).
+ * @param [in]  deltarpm    Name of DeltaRPM file.
+ * @param [in]  newrpm      Name of new RPM file to be (re-)created.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @warning If not @c NULL, @p opts should have been initialized with
+ * drpm_apply_options_init(), otherwise behaviour is undefined.
+ */
+DRPM_VISIBLE
+int drpm_apply_with_options(const char *oldrpm, const char *deltarpm, const char *newrpm, const drpm_apply_options *opts);
+
+/**
+ * @ingroup drpmApply
+ * @brief Applies a DeltaRPM like drpm_apply_with_options(),
+ * writing the new RPM to a file descriptor.
+ * The new RPM is written from the current offset of @p fd,
+ * which may also be a pipe or socket.
+ * @param [in]  oldrpm      Name of old RPM file (if @c NULL, filesystem data is used).
+ * @param [in]  deltarpm    Name of DeltaRPM file.
+ * @param [in]  fd          File descriptor open for writing.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @note @p fd is not closed. On error, part of the new RPM
+ * may have been written already.
+ * @note If @p fd has been opened with @c O_DIRECT, data is written
+ * in aligned blocks. The unaligned tail of the new RPM (or all of it,
+ * if the current offset of @p fd is not aligned to 4096 bytes) is written
+ * with @c O_DIRECT cleared for the duration of the write. The file status
+ * flags are restored afterwards, but are shared with any duplicates
+ * of @p fd in the meantime.
+ */
+DRPM_VISIBLE
+int drpm_apply_fd(const char *oldrpm, const char *deltarpm, int fd, const drpm_apply_options *opts);
+
+/**
+ * @ingroup drpmApply
+ * @brief Applies a DeltaRPM like drpm_apply_with_options(),
+ * passing the new RPM to a callback as it is reconstructed.
+ * Output is delivered in order, in large chunks.
+ * Example of usage (without error handling):
+ * @code
+ * int write_out(void *arg, const void *data, size_t len)
+ * {
+ *     return fwrite(data, 1, len, (FILE *)arg) == len ? 0 : -1;
+ * }
+ *
+ * drpm_apply_cb(NULL, "foo.drpm", write_out, stdout, NULL);
+ * @endcode
+ * @param [in]  oldrpm      Name of old RPM file (if @c NULL, filesystem data is used).
+ * @param [in]  deltarpm    Name of DeltaRPM file.
+ * @param [in]  write_func  Callback receiving output.
+ * @param [in]  arg         Argument passed to @p write_func.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code (::DRPM_ERR_IO if @p write_func fails).
+ * @note The reconstructed RPM is only verified once all of it has
+ * been passed to @p write_func, so a consumer must not trust the
+ * data unless ::DRPM_ERR_OK is returned.
+ */
+DRPM_VISIBLE
+int drpm_apply_cb(const char *oldrpm, const char *deltarpm, drpm_write_func write_func, void *arg, const drpm_apply_options *opts);
+
+/**
+ * @ingroup drpmApply
+ * @brief Applies several DeltaRPMs in parallel,
+ * like calling drpm_apply_with_options() for each job.
+ * Jobs are run by a pool of @p workers threads, largest DeltaRPMs first.
+ * Jobs using filesystem data share one handle to the rpm database.
+ * Example of usage (without error handling):
+ * @code
+ * drpm_apply_job jobs[] = {
+ *     {NULL, "foo.drpm", "foo.rpm"},
+ *     {NULL, "bar.drpm", "bar.rpm"}
+ * };
+ *
+ * drpm_apply_batch(jobs, 2, 0, NULL);
+ *
+ * for (size_t i = 0; i < 2; i++)
+ *     if (jobs[i].error != DRPM_ERR_OK)
+ *         fprintf(stderr, "%s: %s\n", jobs[i].deltarpm, drpm_strerror(jobs[i].error));
+ * @endcode
+ * @param [in,out] jobs     Jobs to run (error code of each is stored in it).
+ * @param [in]  count       Number of jobs.
+ * @param [in]  workers     Number of threads (if @c 0, one per processor).
+ * @param [in]  opts        Options used for all jobs (if @c NULL, defaults used).
+ * @return Error code of the first failed job (in order of @p jobs),
+ * or of the batch itself.
+ * @note All jobs are run even if some of them fail.
+ * No two jobs should create the same new RPM file.
+ * @see drpmThreads
+ */
+DRPM_VISIBLE
+int drpm_apply_batch(drpm_apply_job *jobs, size_t count, unsigned workers, const drpm_apply_options *opts);
+
+/**
+ * @ingroup drpmApply
+ * @brief Reads a DeltaRPM, matches it against the installed package
+ * and checks its files, so that it can later be applied with
+ * drpm_apply_prepared().
+ * The installed package header, its file list and the expanded sequence
+ * are kept, so checking and then applying the DeltaRPM does not repeat
+ * that work (as calling drpm_check() and drpm_apply() would).
+ * Example of usage (without error handling):
+ * @code
+ * drpm_prepared *prep;
+ *
+ * if (drpm_prepare(&prep, "foo.drpm", DRPM_CHECK_FILESIZES) == DRPM_ERR_OK) {
+ *     drpm_apply_prepared(prep, "foo.rpm", NULL);
+ *     drpm_prepared_destroy(&prep);
+ * }
+ * @endcode
+ * @param [out] prep        Prepared DeltaRPM.
+ * @param [in]  deltarpm    Name of DeltaRPM file.
+ * @param [in]  checkmode   Full check, filesize changes only or no check.
+ * @return Error code (as of drpm_check() if the check fails).
+ * @note Only filesystem data can be used, the DeltaRPM file is kept
+ * open until @p prep is destroyed.
+ * @see DRPM_CHECK_NONE, DRPM_CHECK_FILESIZES, DRPM_CHECK_FULL
+ */
+DRPM_VISIBLE
+int drpm_prepare(drpm_prepared **prep, const char *deltarpm, int checkmode);
+
+/**
+ * @ingroup drpmApply
+ * @brief Applies a DeltaRPM prepared by drpm_prepare()
+ * like drpm_apply_with_options().
+ * @param [in]  prep        Prepared DeltaRPM.
+ * @param [in]  newrpm      Name of new RPM file to be (re-)created.
+ * @param [in]  opts        Options (if @c NULL, defaults used).
+ * @return Error code.
+ * @note A prepared DeltaRPM can only be applied once,
+ * ::DRPM_ERR_ARGS is returned on further attempts.
+ */
+DRPM_VISIBLE
+int drpm_apply_prepared(drpm_prepared *prep, const char *newrpm, const drpm_apply_options *opts);
+
+/**
+ * @ingroup drpmApply
+ * @brief Frees a DeltaRPM prepared by drpm_prepare().
+ * @param [out] prep        Prepared DeltaRPM to be freed.
+ * @return Error code.
+ */
+DRPM_VISIBLE
+int drpm_prepared_destroy(drpm_prepared **prep);
+
 /**
  * @ingroup drpmCheck
  * @brief Checks if the reconstruction is possible based on DeltaRPM file.
@@ -203,6 +422,60 @@ int drpm_check(const char *deltarpm, int checkmode);
 DRPM_VISIBLE
 int drpm_check_sequence(const char *oldrpm, const char *sequence, int checkmode);
 
+/**
+ * @ingroup drpmCheck
+ * @brief Checks if the reconstruction is possible based on several
+ * sequence IDs, like calling drpm_check_sequence() with filesystem data
+ * for each of them.
+ * Sequences with the same source package share the lookup of
+ * its header and the checks of its installed files.
+ * @param [in]  sequences   Sequence IDs of the DeltaRPMs.
+ * @param [in]  count       Number of sequence IDs.
+ * @param [in]  checkmode   Full check or filesize changes only.
+ * @param [out] errors      Error code of each sequence ID (@p count values).
+ * @return Error code of the first failed sequence ID (in order of
+ * @p sequences), or of the batch itself.
+ * @see DRPM_CHECK_FULL, DRPM_CHECK_FILESIZES
+ */
+DRPM_VISIBLE
+int drpm_check_sequence_batch(const char **sequences, size_t count, int checkmode, int *errors);
+
+/**
+ * @ingroup drpmCheck
+ * @brief Enables a persistent cache of installed file digests
+ * used by checks with ::DRPM_CHECK_FULL.
+ * A file is only read and hashed again once its device, inode, size,
+ * modification or status change time differ from when it was cached.
+ * The cache is kept in @p path, which is read on first use and
+ * replaced after each full check (or when another cache is set).
+ * Least recently used digests are dropped to keep at most
+ * @p max_entries of them.
+ * @param [in]  path        Cache file (if @c NULL, cache is disabled).
+ * @param [in]  max_entries Maximum number of cached digests
+ * (if @c 0, a default of 65536 is used).
+ * @return Error code (of saving the previous cache).
+ * @note The setting applies to the whole process.
+ * A malformed or unreadable cache file is ignored.
+ */
+DRPM_VISIBLE
+int drpm_set_digest_cache(const char *path, size_t max_entries);
+
+/**
+ * @ingroup drpmCheck
+ * @brief Drops original content of prelinked files kept from previous
+ * checks and applies.
+ * Undoing prelinking is expensive, so the restored content of up to
+ * 32 files (256 MiB in total) is kept in unlinked temporary files.
+ * Long-running processes should call this once they are done with
+ * a set of DeltaRPMs to release that storage.
+ * @return Error code.
+ * @note The cache is process-wide, content in use by concurrent
+ * checks or applies is released once they are finished with it.
+ * @see drpmThreads
+ */
+DRPM_VISIBLE
+int drpm_clear_prelink_cache(void);
+
 /**
  * @ingroup drpmMake
  * @brief Creates a DeltaRPM from two RPMs.
@@ -452,6 +725,158 @@ int drpm_make_options_add_patches(drpm_make_options *opts, const char *oldrpmpri
 
 /** @} */
 
+/**
+ * @addtogroup drpmApplyOptions
+ * @{
+ */
+
+/**
+ * @brief Initializes ::drpm_apply_options with default options.
+ * Passing @p *opts to drpm_apply_with_options() immediately after would
+ * have the same effect as passing @c NULL instead.
+ * @param [out] opts    Address of options structure pointer.
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_init(drpm_apply_options **opts);
+
+/**
+ * @brief Frees ::drpm_apply_options.
+ * @param [out] opts    Address of options structure pointer.
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_destroy(drpm_apply_options **opts);
+
+/**
+ * @brief Resets options to default values.
+ * Passing @p opts to drpm_apply_with_options() immediately after would
+ * have the same effect as passing @c NULL instead.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_defaults(drpm_apply_options *opts);
+
+/**
+ * @brief Copies ::drpm_apply_options.
+ * Copies data from @p src to @p dst.
+ * @param [out] dst Destination options.
+ * @param [in]  src Source options.
+ * @return Error code.
+ * @warning @p dst should have also been initialized with
+ * drpm_apply_options_init() previously, otherwise behaviour is undefined.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_copy(drpm_apply_options *dst, const drpm_apply_options *src);
+
+/**
+ * @brief Sets directory for spilling paged-out blocks.
+ * When reconstructing large packages, blocks of old data that are still
+ * needed but do not fit in memory are paged out to an anonymous temporary
+ * file created in @p dir.
+ * By default, @c /tmp is used, which may be memory-backed on some systems.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @param [in]  dir     Spill directory (if @c NULL, default is used).
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_set_spill_dir(drpm_apply_options *opts, const char *dir);
+
+/**
+ * @brief Sets compression of spilled blocks.
+ * Paged-out blocks are compressed (with the fastest compression level)
+ * before being written to the spill file, trading CPU time for less
+ * spill I/O. By default, spilled blocks are not compressed.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @param [in]  comp    Compression type.
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ * @see DRPM_COMP_NONE, DRPM_COMP_GZIP, DRPM_COMP_ZSTD
+ */
+DRPM_VISIBLE
+int drpm_apply_options_set_spill_comp(drpm_apply_options *opts, unsigned short comp);
+
+/**
+ * @brief Requests planned reading of old data.
+ * When reconstructing from filesystem data, old data needed more than once
+ * by the DeltaRPM is read up front in one sequential pass over the installed
+ * files, and staged in memory (or in the spill file, see
+ * drpm_apply_options_set_spill_dir()) until it is last used.
+ * This turns repeated random reads into streaming reads, which may be much
+ * faster on spinning disks and network filesystems.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @return Error code.
+ * @note Has no effect when applying to an old RPM, whose payload is
+ * always read sequentially.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_plan_reads(drpm_apply_options *opts);
+
+/**
+ * @brief Requests pipelined reconstruction.
+ * Decompression of the add block and recompression of the new RPM's
+ * payload are moved to separate threads, connected to the reconstruction
+ * of the payload by bounded queues of large buffers.
+ * On a multi-core machine, the time spent applying a DeltaRPM then
+ * approaches the cost of the slowest stage (usually recompression)
+ * instead of the sum of all of them.
+ * When applying from filesystem data, installed files are also opened
+ * and read ahead in a separate thread, so that reconstruction does not
+ * wait for the disk file by file.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @return Error code.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_use_pipeline(drpm_apply_options *opts);
+
+/**
+ * @brief Requests a new RPM with an uncompressed payload.
+ * The payload is not recompressed, which usually dominates the time
+ * spent applying a DeltaRPM. Useful when the new RPM is to be installed
+ * right away rather than distributed.
+ * The payload compressor and (compressed) payload digest tags are
+ * removed from the header. The signature only contains the size
+ * (as a 64-bit tag past 4 GiB, like rpmbuild writes it) and
+ * the SHA-256 digest of the header.
+ * The reconstruction is verified with the digest of the uncompressed
+ * payload if the header has one (SHA-256), otherwise the payload is
+ * still compressed, only to be checked against the expected MD5 sum.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @return Error code.
+ * @warning The new RPM is not identical to the original one and any
+ * signatures of the original RPM are not included.
+ * @note Only supported for standard DeltaRPMs, applying an rpm-only
+ * DeltaRPM with this option fails with ::DRPM_ERR_ARGS.
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_uncompressed_payload(drpm_apply_options *opts);
+
+/**
+ * @brief Writes the new RPM bypassing the page cache.
+ * The output file is opened with @c O_DIRECT, so that writing a large RPM
+ * does not evict data other processes rely on from the page cache.
+ * Falls back to regular writes if the filesystem does not support it.
+ * @param [out] opts    Structure specifying options for drpm_apply_with_options().
+ * @return Error code.
+ * @note Only affects drpm_apply_with_options(). Descriptors passed to
+ * drpm_apply_fd() are written with aligned buffers if they have been
+ * opened with @c O_DIRECT (see drpm_apply_fd()).
+ * @see drpm_apply_with_options()
+ */
+DRPM_VISIBLE
+int drpm_apply_options_use_direct_io(drpm_apply_options *opts);
+
+/** @} */
+
 /**
  * @addtogroup drpmRead
  * @{
@@ -476,6 +901,12 @@ int drpm_make_options_add_patches(drpm_make_options *opts, const char *oldrpmpri
  * @return Error code.
  * @note Memory allocated by calling drpm_read() should later be freed
  * by calling drpm_destroy().
+ * @note Only metadata preceding the internal and external copies is
+ * decompressed. The rest of the DeltaRPM is read when the copies or
+ * data lengths are first requested (#DRPM_TAG_INTCOPIES,
+ * #DRPM_TAG_EXTCOPIES, #DRPM_TAG_EXTDATALEN, #DRPM_TAG_INTDATALEN),
+ * so @p filename must still be readable then; ::DRPM_ERR_MISMATCH is
+ * returned if it has been changed in the meantime.
  */
 DRPM_VISIBLE
 int drpm_read(drpm **delta, const char *filename);
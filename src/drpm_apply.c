@@ -19,14 +19,19 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* statx() */
+#define _GNU_SOURCE
+
 #include "drpm.h"
 #include "drpm_private.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -34,41 +39,98 @@
 #include <openssl/sha.h>
 
 #define BUFFER_SIZE 4096
+#define CHECK_BUFFER_SIZE (1 << 18)
+
+/* installed files are read by more threads than there are
+ * processors, as their checks mostly wait for disk I/O */
+#define CHECK_WORKERS_PER_CPU 2
+
+/* filesize checks are cheap, so a thread only pays off for many of them */
+#define FILESIZE_CHECKS_PER_WORKER 1024
+
+/* check of a single file deferred until the sequence is expanded */
+struct file_check {
+    size_t file;
+    const char *filename;
+    /* offset of base name in <filename> */
+    size_t name_off;
+    unsigned char digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
+    size_t filesize;
+    int error;
+};
 
-struct checksum {
+struct file_checks {
+    struct file_check *checks;
     unsigned short digest_algo;
-    union {
-        MD5_CTX md5;
-        SHA256_CTX sha256;
-    } ctx;
+    /* filesize checks grouped by directory */
+    struct file_check **sorted;
+    size_t *groups;
+    /* lowest index of a failed check, checks past it are skipped */
+    size_t failed;
+    pthread_mutex_t mutex;
 };
 
+/* Undone prelinked file (unlinked, only reachable through <filedesc>),
+ * valid for as long as the original file keeps its identity,
+ * size and timestamps. */
+struct prelink_entry {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    int filedesc;
+    off_t undone_size;
+    uint64_t used;
+};
+
+/* Process-wide cache of undone prelinked files, so that prelink is not
+ * run again each time the same file is checked or read during apply. */
+static struct {
+    pthread_mutex_t mutex;
+    struct prelink_entry entries[PRELINK_CACHE_MAX];
+    size_t entries_len;
+    off_t bytes;
+    uint64_t clock;
+} prelink_cache = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static bool check_skip(struct file_checks *, size_t);
+static void check_failed(struct file_checks *, size_t);
+static int checks_finish(struct file_checks *, size_t);
+static int checks_start(struct file_checks *, size_t);
 static int check_filesize(const char *, unsigned short, const unsigned char *, size_t);
 static int check_full(const char *, unsigned short, const unsigned char *, size_t);
+static void check_full_job(void *, size_t);
+static int check_full_parallel(struct file_checks *, size_t);
+static int check_filesizes(struct file_checks *, size_t);
+static void check_filesizes_job(void *, size_t);
+static int compare_file_dirs(const void *, const void *);
+static int stat_size(int, const char *, off_t *);
 static int check_prelink(const char *, unsigned short, const unsigned char *, size_t);
-static size_t checksum_digest_len(struct checksum);
-static int checksum_final(struct checksum *, unsigned char *);
-static int checksum_init(struct checksum *, unsigned short);
-static int checksum_update(struct checksum *, const void *, size_t);
+static void prelink_cache_evict(size_t);
+static bool prelink_entry_matches(const struct prelink_entry *, const struct stat *);
+static int reopen(int);
 static uint16_t elf16(const unsigned char *, bool);
 static uint32_t elf32(const unsigned char *, bool);
 static uint64_t elf64(const unsigned char *, bool, bool);
 
 /* Expands the compressed sequence of the file order.
  * May perform checks on the individual files.
+ * If <checked> is not NULL, it holds results of earlier checks of <files>
+ * (-1 if not checked yet), which are reused and filled in.
  * May create an index of CPIO entry lengths and offsets into
  * <*seqfiles_ret> and <*seqfile_len_ret>. */
 int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
                     const unsigned char *sequence, uint32_t sequence_len,
                     const struct file_info *files, size_t file_count,
-                    unsigned short digest_algo, int check_mode)
+                    unsigned short digest_algo, int check_mode, int *checked)
 {
     int error = DRPM_ERR_OK;
     const bool want_seq = (seqfiles_ret != NULL && seqfiles_len_ret != NULL);
     struct cpio_file *seqfiles = NULL;
     size_t *positions;
     size_t positions_len = 0;
-    MD5_CTX seq_md5;
+    struct digest seq_md5 = {0};
     unsigned char seq_md5_digest[MD5_DIGEST_LENGTH];
     unsigned char digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
     bool even = true;
@@ -84,24 +146,15 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
     char *filename;
     size_t header_len;
     size_t off = 0;
-    int (*check)(const char *, unsigned short, const unsigned char *, size_t);
-
-    if (sequence == NULL || sequence_len < MD5_DIGEST_LENGTH)
-        return DRPM_ERR_PROG;
-
-    switch (check_mode) {
-    case DRPM_CHECK_NONE:
-        check = NULL;
-        break;
-    case DRPM_CHECK_FULL:
-        check = check_full;
-        break;
-    case DRPM_CHECK_FILESIZES:
-        check = check_filesize;
-        break;
-    default:
+    const char *slash;
+    struct file_checks chks = {.checks = NULL, .digest_algo = digest_algo, .sorted = NULL, .groups = NULL};
+    size_t chks_len = 0;
+
+    if (sequence == NULL || sequence_len < MD5_DIGEST_LENGTH ||
+        (check_mode != DRPM_CHECK_NONE &&
+         check_mode != DRPM_CHECK_FULL &&
+         check_mode != DRPM_CHECK_FILESIZES))
         return DRPM_ERR_PROG;
-    }
 
     if ((positions = malloc(file_count * sizeof(size_t))) == NULL)
         return DRPM_ERR_MEMORY;
@@ -165,11 +218,16 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
         goto cleanup_fail;
     }
 
-    if (MD5_Init(&seq_md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    /* files are checked (in parallel) once the sequence is expanded */
+    if (check_mode != DRPM_CHECK_NONE &&
+        (chks.checks = malloc(positions_len * sizeof(struct file_check))) == NULL) {
+        error = DRPM_ERR_MEMORY;
         goto cleanup_fail;
     }
 
+    if ((error = digest_init(&seq_md5, DIGEST_MASK(DIGESTALGO_MD5))) != DRPM_ERR_OK)
+        goto cleanup_fail;
+
     /* constructing an MD5 to match against the DeltaRPM sequence
      * checking that files have not changed,
      * and constructing an index of CPIO entries. */
@@ -192,19 +250,15 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
         if (filename[0] == '/')
             filename++;
 
-        if (MD5_Update(&seq_md5, filename, strlen(filename) + 1) != 1 ||
-            md5_update_be32(&seq_md5, files[i].mode) != 1 ||
-            md5_update_be32(&seq_md5, filesize) != 1 ||
-            md5_update_be32(&seq_md5, rdev) != 1) {
-            error = DRPM_ERR_OTHER;
+        if ((error = digest_update(&seq_md5, filename, strlen(filename) + 1)) != DRPM_ERR_OK ||
+            (error = digest_update_be32(&seq_md5, files[i].mode)) != DRPM_ERR_OK ||
+            (error = digest_update_be32(&seq_md5, filesize)) != DRPM_ERR_OK ||
+            (error = digest_update_be32(&seq_md5, rdev)) != DRPM_ERR_OK)
             goto cleanup_fail;
-        }
 
         if (S_ISLNK(files[i].mode)) {
-            if (MD5_Update(&seq_md5, files[i].linkto, strlen(files[i].linkto) + 1) != 1) {
-                error = DRPM_ERR_OTHER;
+            if ((error = digest_update(&seq_md5, files[i].linkto, strlen(files[i].linkto) + 1)) != DRPM_ERR_OK)
                 goto cleanup_fail;
-            }
         } else if (S_ISREG(files[i].mode) && filesize > 0) {
             switch (digest_algo) {
             case DIGESTALGO_MD5:
@@ -212,24 +266,28 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
                     error = DRPM_ERR_FORMAT;
                     goto cleanup_fail;
                 }
-                if (MD5_Update(&seq_md5, digest, MD5_DIGEST_LENGTH) != 1) {
-                    error = DRPM_ERR_OTHER;
+                if ((error = digest_update(&seq_md5, digest, MD5_DIGEST_LENGTH)) != DRPM_ERR_OK)
                     goto cleanup_fail;
-                }
                 break;
             case DIGESTALGO_SHA256:
                 if (!parse_sha256(digest, files[i].md5)) {
                     error = DRPM_ERR_FORMAT;
                     goto cleanup_fail;
                 }
-                if (MD5_Update(&seq_md5, digest, SHA256_DIGEST_LENGTH) != 1) {
-                    error = DRPM_ERR_OTHER;
+                if ((error = digest_update(&seq_md5, digest, SHA256_DIGEST_LENGTH)) != DRPM_ERR_OK)
                     goto cleanup_fail;
-                }
                 break;
             }
-            if (check != NULL && (error = check(files[i].name, digest_algo, digest, filesize)) != DRPM_ERR_OK)
-                goto cleanup;
+            if (chks.checks != NULL) {
+                slash = strrchr(files[i].name, '/');
+                chks.checks[chks_len].file = i;
+                chks.checks[chks_len].error = (checked != NULL) ? checked[i] : -1;
+                chks.checks[chks_len].filename = files[i].name;
+                chks.checks[chks_len].name_off = (slash != NULL) ? (size_t)(slash - files[i].name) + 1 : 0;
+                memcpy(chks.checks[chks_len].digest, digest, sizeof(digest));
+                chks.checks[chks_len].filesize = filesize;
+                chks_len++;
+            }
         }
 
         if (want_seq) {
@@ -245,9 +303,17 @@ int expand_sequence(struct cpio_file **seqfiles_ret, size_t *seqfiles_len_ret,
         }
     }
 
-    if (MD5_Final(seq_md5_digest, &seq_md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    if ((error = digest_final(&seq_md5, DIGESTALGO_MD5, seq_md5_digest)) != DRPM_ERR_OK)
         goto cleanup_fail;
+
+    if (chks.checks != NULL) {
+        error = (check_mode == DRPM_CHECK_FULL) ? check_full_parallel(&chks, chks_len) :
+                                                  check_filesizes(&chks, chks_len);
+        if (checked != NULL)
+            for (size_t i = 0; i < chks_len; i++)
+                checked[chks.checks[i].file] = chks.checks[i].error;
+        if (error != DRPM_ERR_OK)
+            goto cleanup_fail;
     }
 
     if (memcmp(sequence, seq_md5_digest, MD5_DIGEST_LENGTH) != 0) {
@@ -275,13 +341,226 @@ cleanup_fail:
     free(seqfiles);
 
 cleanup:
+    digest_destroy(&seq_md5);
     free(positions);
+    free(chks.checks);
 
     return error;
 }
 
 /******************************* check ********************************/
 
+/* Prepares parallel checks of <count> files. Only the first failure
+ * (in sequence order) is reported, so once a check fails, checks
+ * of later files are skipped. */
+int checks_start(struct file_checks *chks, size_t count)
+{
+    chks->failed = count;
+
+    /* already checked for an earlier sequence */
+    for (size_t i = 0; i < count; i++) {
+        if (chks->checks[i].error > DRPM_ERR_OK) {
+            chks->failed = i;
+            break;
+        }
+    }
+
+    if (pthread_mutex_init(&chks->mutex, NULL) != 0)
+        return DRPM_ERR_OTHER;
+
+    return DRPM_ERR_OK;
+}
+
+/* Returns the error of the first file (in sequence order) that failed.
+ * Skipped checks are left unchecked. */
+int checks_finish(struct file_checks *chks, size_t count)
+{
+    pthread_mutex_destroy(&chks->mutex);
+
+    return (chks->failed < count) ? chks->checks[chks->failed].error : DRPM_ERR_OK;
+}
+
+/* tells whether check <index> comes after a failed one */
+bool check_skip(struct file_checks *chks, size_t index)
+{
+    bool skip;
+
+    pthread_mutex_lock(&chks->mutex);
+    skip = (index > chks->failed);
+    pthread_mutex_unlock(&chks->mutex);
+
+    return skip;
+}
+
+/* records failure of check <index> */
+void check_failed(struct file_checks *chks, size_t index)
+{
+    pthread_mutex_lock(&chks->mutex);
+    if (index < chks->failed)
+        chks->failed = index;
+    pthread_mutex_unlock(&chks->mutex);
+}
+
+void check_full_job(void *arg, size_t index)
+{
+    struct file_checks *full_checks = arg;
+    struct file_check *chk = full_checks->checks + index;
+
+    /* already checked for an earlier sequence */
+    if (chk->error >= 0 || check_skip(full_checks, index))
+        return;
+
+    chk->error = check_full(chk->filename, full_checks->digest_algo, chk->digest, chk->filesize);
+
+    if (chk->error != DRPM_ERR_OK)
+        check_failed(full_checks, index);
+}
+
+/* orders filesize checks by directory, then by sequence */
+int compare_file_dirs(const void *a, const void *b)
+{
+    const struct file_check *chk_a = *(struct file_check * const *)a;
+    const struct file_check *chk_b = *(struct file_check * const *)b;
+    int cmp;
+
+    if ((cmp = strncmp(chk_a->filename, chk_b->filename, MIN(chk_a->name_off, chk_b->name_off))) != 0)
+        return cmp;
+    if (chk_a->name_off != chk_b->name_off)
+        return (chk_a->name_off > chk_b->name_off) - (chk_a->name_off < chk_b->name_off);
+
+    return (chk_a > chk_b) - (chk_a < chk_b);
+}
+
+/* gets size of file <name> in directory <dirfd> (following symlinks like stat()) */
+int stat_size(int dirfd, const char *name, off_t *size)
+{
+#ifdef HAVE_STATX
+    struct statx stats;
+
+    if (statx(dirfd, name, 0, STATX_SIZE, &stats) != 0 || (stats.stx_mask & STATX_SIZE) == 0)
+        return -1;
+
+    *size = stats.stx_size;
+#else
+    struct stat stats;
+
+    if (fstatat(dirfd, name, &stats, 0) != 0)
+        return -1;
+
+    *size = stats.st_size;
+#endif
+
+    return 0;
+}
+
+/* Checks sizes of files in one directory, looking them up
+ * relative to the directory instead of resolving each full path. */
+void check_filesizes_job(void *arg, size_t index)
+{
+    struct file_checks *chks = arg;
+    struct file_check **group = chks->sorted + chks->groups[index];
+    const size_t group_len = chks->groups[index + 1] - chks->groups[index];
+    const size_t name_off = group[0]->name_off;
+    char *dirname = NULL;
+    int dirfd = AT_FDCWD;
+    off_t size;
+
+    if (name_off > 0 && (dirname = malloc(name_off + 1)) != NULL) {
+        memcpy(dirname, group[0]->filename, name_off);
+        dirname[name_off > 1 ? name_off - 1 : name_off] = '\0';
+        if ((dirfd = open(dirname, O_RDONLY | O_DIRECTORY)) < 0)
+            dirfd = AT_FDCWD;
+    }
+
+    for (size_t i = 0; i < group_len; i++) {
+        /* already checked for an earlier sequence */
+        if (group[i]->error >= 0 || check_skip(chks, group[i] - chks->checks))
+            continue;
+        if (dirfd == AT_FDCWD)
+            size = -1;
+        else if (stat_size(dirfd, group[i]->filename + name_off, &size) != 0)
+            size = -1;
+        /* a mismatch (or failure) is examined further by full path */
+        if (size >= 0 && size == (off_t)group[i]->filesize)
+            group[i]->error = DRPM_ERR_OK;
+        else
+            group[i]->error = check_filesize(group[i]->filename, chks->digest_algo,
+                                             group[i]->digest, group[i]->filesize);
+        if (group[i]->error != DRPM_ERR_OK)
+            check_failed(chks, group[i] - chks->checks);
+    }
+
+    if (dirfd != AT_FDCWD)
+        close(dirfd);
+    free(dirname);
+}
+
+/* Checks sizes of <count> files, grouped by directory, with groups
+ * checked in parallel. Returns the error of the first file
+ * (in sequence order) that failed. */
+int check_filesizes(struct file_checks *chks, size_t count)
+{
+    int error = DRPM_ERR_OK;
+    size_t groups_len = 0;
+    unsigned workers;
+
+    if (count == 0)
+        return DRPM_ERR_OK;
+
+    if ((chks->sorted = malloc(count * sizeof(struct file_check *))) == NULL ||
+        (chks->groups = malloc((count + 1) * sizeof(size_t))) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        chks->sorted[i] = chks->checks + i;
+
+    qsort(chks->sorted, count, sizeof(struct file_check *), compare_file_dirs);
+
+    for (size_t i = 0; i < count; i++)
+        if (i == 0 || chks->sorted[i]->name_off != chks->sorted[i - 1]->name_off ||
+            strncmp(chks->sorted[i]->filename, chks->sorted[i - 1]->filename, chks->sorted[i]->name_off) != 0)
+            chks->groups[groups_len++] = i;
+    chks->groups[groups_len] = count;
+
+    workers = MIN(pool_default_workers(), (count + FILESIZE_CHECKS_PER_WORKER - 1) / FILESIZE_CHECKS_PER_WORKER);
+
+    if ((error = checks_start(chks, count)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if ((error = pool_run(groups_len, workers, check_filesizes_job, chks)) == DRPM_ERR_OK)
+        error = checks_finish(chks, count);
+    else
+        checks_finish(chks, count);
+
+cleanup:
+    free(chks->sorted);
+    free(chks->groups);
+    chks->sorted = NULL;
+    chks->groups = NULL;
+
+    return error;
+}
+
+/* Checks <count> files in parallel. Returns the error
+ * of the first file (in sequence order) that failed. */
+int check_full_parallel(struct file_checks *full_checks, size_t count)
+{
+    int error;
+
+    if ((error = checks_start(full_checks, count)) != DRPM_ERR_OK)
+        return error;
+
+    if ((error = pool_run(count, CHECK_WORKERS_PER_CPU * pool_default_workers(),
+                          check_full_job, full_checks)) != DRPM_ERR_OK) {
+        checks_finish(full_checks, count);
+        return error;
+    }
+
+    return checks_finish(full_checks, count);
+}
+
 int check_filesize(const char *filename, unsigned short digest_algo,
                    const unsigned char *digest, size_t filesize)
 {
@@ -302,8 +581,10 @@ int check_filesize(const char *filename, unsigned short digest_algo,
         if ((filedesc = open(filename, O_RDONLY)) < 0)
             return DRPM_ERR_IO;
         if ((read_len = read(filedesc, buf, 128)) > 0) {
-            if ((error = is_prelinked(&prelink, filedesc, buf, read_len)) != DRPM_ERR_OK)
+            if ((error = is_prelinked(&prelink, filedesc, buf, read_len)) != DRPM_ERR_OK) {
+                close(filedesc);
                 return error;
+            }
             if (prelink) {
                 close(filedesc);
                 return check_prelink(filename, digest_algo, digest, filesize);
@@ -324,12 +605,15 @@ int check_full(const char *filename, unsigned short digest_algo,
 {
     int error = DRPM_ERR_OK;
     int filedesc;
-    unsigned char buf[BUFFER_SIZE];
-    struct checksum chsm;
-    unsigned char chsm_digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
+    unsigned char *buf = NULL;
+    struct digest dgst = {0};
+    unsigned char file_digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
     ssize_t read_len;
     struct stat stats;
+    struct stat stats_after;
     bool prelink;
+    bool cacheable;
+    bool cached;
 
     if ((filedesc = open(filename, O_RDONLY)) < 0)
         return DRPM_ERR_IO;
@@ -339,42 +623,73 @@ int check_full(const char *filename, unsigned short digest_algo,
         goto cleanup;
     }
 
-    if ((error = checksum_init(&chsm, digest_algo)) != DRPM_ERR_OK)
+    /* only digests of whole files can be cached
+     * (a larger file may be prelinked) */
+    cacheable = (S_ISREG(stats.st_mode) && stats.st_size == (off_t)filesize);
+
+    if (cacheable) {
+        digest_cache_lookup(&stats, digest_algo, file_digest, &cached);
+        if (cached) {
+            if (memcmp(file_digest, digest, digest_len(digest_algo)) != 0)
+                error = DRPM_ERR_MISMATCH;
+            goto cleanup;
+        }
+    }
+
+    if ((buf = malloc(CHECK_BUFFER_SIZE)) == NULL) {
+        error = DRPM_ERR_MEMORY;
+        goto cleanup;
+    }
+
+    posix_fadvise(filedesc, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if ((error = digest_init(&dgst, DIGEST_MASK(digest_algo))) != DRPM_ERR_OK)
         goto cleanup;
 
     if (stats.st_size > (off_t)filesize) {
-        if ((read_len = read(filedesc, buf, BUFFER_SIZE)) > 0) {
+        if ((read_len = read(filedesc, buf, CHECK_BUFFER_SIZE)) > 0) {
             if ((error = is_prelinked(&prelink, filedesc, buf, read_len)) != DRPM_ERR_OK)
-                return error;
+                goto cleanup;
             if (prelink) {
-                close(filedesc);
-                return check_prelink(filename, digest_algo, digest, filesize);
+                error = check_prelink(filename, digest_algo, digest, filesize);
+                goto cleanup;
             }
             if (read_len > (ssize_t)filesize)
                 read_len = filesize;
-            if ((error = checksum_update(&chsm, buf, read_len)) != DRPM_ERR_OK)
+            if ((error = digest_update(&dgst, buf, read_len)) != DRPM_ERR_OK)
                 goto cleanup;
             filesize -= read_len;
         }
     }
 
-    while (filesize > 0 && (read_len = read(filedesc, buf, BUFFER_SIZE)) > 0) {
+    while (filesize > 0 && (read_len = read(filedesc, buf, CHECK_BUFFER_SIZE)) > 0) {
         if ((size_t)read_len > filesize)
             read_len = filesize;
-        if ((error = checksum_update(&chsm, buf, read_len)) != DRPM_ERR_OK)
+        if ((error = digest_update(&dgst, buf, read_len)) != DRPM_ERR_OK)
             goto cleanup;
         filesize -= read_len;
     }
 
-    if ((error = checksum_final(&chsm, chsm_digest)) != DRPM_ERR_OK)
+    if ((error = digest_final(&dgst, digest_algo, file_digest)) != DRPM_ERR_OK)
         goto cleanup;
 
-    if (memcmp(chsm_digest, digest, checksum_digest_len(chsm)) != 0) {
+    /* not caching digest of a file modified while being read */
+    if (cacheable && filesize == 0 && fstat(filedesc, &stats_after) == 0 &&
+        stats_after.st_size == stats.st_size &&
+        stats_after.st_mtim.tv_sec == stats.st_mtim.tv_sec &&
+        stats_after.st_mtim.tv_nsec == stats.st_mtim.tv_nsec &&
+        stats_after.st_ctim.tv_sec == stats.st_ctim.tv_sec &&
+        stats_after.st_ctim.tv_nsec == stats.st_ctim.tv_nsec)
+        digest_cache_store(&stats, digest_algo, file_digest);
+
+    if (memcmp(file_digest, digest, digest_len(digest_algo)) != 0) {
         error = DRPM_ERR_MISMATCH;
         goto cleanup;
     }
 
 cleanup:
+    digest_destroy(&dgst);
+    free(buf);
     close(filedesc);
 
     return error;
@@ -386,20 +701,20 @@ int check_prelink(const char *filename, unsigned short digest_algo,
     int error = DRPM_ERR_OK;
     int filedesc;
     unsigned char buf[BUFFER_SIZE];
-    struct checksum chsm;
-    unsigned char chsm_digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
+    struct digest dgst = {0};
+    unsigned char file_digest[MAX(MD5_DIGEST_LENGTH, SHA256_DIGEST_LENGTH)];
     ssize_t read_len;
 
     if ((error = prelink_open(filename, &filedesc)) != DRPM_ERR_OK)
         return error;
 
-    if ((error = checksum_init(&chsm, digest_algo)) != DRPM_ERR_OK)
+    if ((error = digest_init(&dgst, DIGEST_MASK(digest_algo))) != DRPM_ERR_OK)
         goto cleanup;
 
     while (filesize > 0 && (read_len = read(filedesc, buf, BUFFER_SIZE)) > 0) {
         if ((size_t)read_len > filesize)
             read_len = filesize;
-        if ((error = checksum_update(&chsm, buf, read_len)) != DRPM_ERR_OK)
+        if ((error = digest_update(&dgst, buf, read_len)) != DRPM_ERR_OK)
             goto cleanup;
         filesize -= read_len;
     }
@@ -409,80 +724,21 @@ int check_prelink(const char *filename, unsigned short digest_algo,
         goto cleanup;
     }
 
-    if ((error = checksum_final(&chsm, chsm_digest)) != DRPM_ERR_OK)
+    if ((error = digest_final(&dgst, digest_algo, file_digest)) != DRPM_ERR_OK)
         goto cleanup;
 
-    if (memcmp(chsm_digest, digest, checksum_digest_len(chsm)) != 0) {
+    if (memcmp(file_digest, digest, digest_len(digest_algo)) != 0) {
         error = DRPM_ERR_MISMATCH;
         goto cleanup;
     }
 
 cleanup:
+    digest_destroy(&dgst);
     close(filedesc);
 
     return error;
 }
 
-/***************************** MD5/SHA256 *****************************/
-
-int checksum_init(struct checksum *chsm, unsigned short digest_algo)
-{
-    if (chsm == NULL)
-        return DRPM_ERR_PROG;
-
-    switch (digest_algo) {
-    case DIGESTALGO_MD5:
-        if (MD5_Init(&chsm->ctx.md5) != 1)
-            return DRPM_ERR_OTHER;
-        break;
-    case DIGESTALGO_SHA256:
-        if (SHA256_Init(&chsm->ctx.sha256) != 1)
-            return DRPM_ERR_OTHER;
-        break;
-    default:
-        return DRPM_ERR_PROG;
-    }
-
-    chsm->digest_algo = digest_algo;
-
-    return DRPM_ERR_OK;
-}
-
-int checksum_update(struct checksum *chsm, const void *buf, size_t len)
-{
-    if (chsm == NULL || buf == NULL)
-        return DRPM_ERR_PROG;
-
-    switch (chsm->digest_algo) {
-    case DIGESTALGO_MD5:
-        return MD5_Update(&chsm->ctx.md5, buf, len) != 1 ? DRPM_ERR_OTHER : DRPM_ERR_OK;
-    case DIGESTALGO_SHA256:
-        return SHA256_Update(&chsm->ctx.sha256, buf, len) != 1 ? DRPM_ERR_OTHER : DRPM_ERR_OK;
-    default:
-        return DRPM_ERR_PROG;
-    }
-}
-
-int checksum_final(struct checksum *chsm, unsigned char *digest)
-{
-    if (chsm == NULL || digest == NULL)
-        return DRPM_ERR_PROG;
-
-    switch (chsm->digest_algo) {
-    case DIGESTALGO_MD5:
-        return MD5_Final(digest, &chsm->ctx.md5) != 1 ? DRPM_ERR_OTHER : DRPM_ERR_OK;
-    case DIGESTALGO_SHA256:
-        return SHA256_Final(digest, &chsm->ctx.sha256) != 1 ? DRPM_ERR_OTHER : DRPM_ERR_OK;
-    default:
-        return DRPM_ERR_PROG;
-    }
-}
-
-size_t checksum_digest_len(struct checksum chsm)
-{
-    return chsm.digest_algo == DIGESTALGO_MD5 ? MD5_DIGEST_LENGTH : SHA256_DIGEST_LENGTH;
-}
-
 /****************************** prelink *******************************/
 
 uint16_t elf16(const unsigned char *buf, bool little_endian)
@@ -620,26 +876,149 @@ cleanup:
     return error;
 }
 
+/* Opens file behind <filedesc> again (with its own offset).
+ * Cached descriptors must not leak into children (prelink or others). */
+int reopen(int filedesc)
+{
+    char path[32];
+
+    sprintf(path, "/proc/self/fd/%d", filedesc);
+
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+bool prelink_entry_matches(const struct prelink_entry *entry, const struct stat *stats)
+{
+    return entry->dev == stats->st_dev && entry->ino == stats->st_ino &&
+           entry->size == stats->st_size &&
+           entry->mtime.tv_sec == stats->st_mtim.tv_sec &&
+           entry->mtime.tv_nsec == stats->st_mtim.tv_nsec &&
+           entry->ctime.tv_sec == stats->st_ctim.tv_sec &&
+           entry->ctime.tv_nsec == stats->st_ctim.tv_nsec;
+}
+
+void prelink_cache_evict(size_t index)
+{
+    close(prelink_cache.entries[index].filedesc);
+    prelink_cache.bytes -= prelink_cache.entries[index].undone_size;
+    prelink_cache.entries[index] = prelink_cache.entries[--prelink_cache.entries_len];
+}
+
+/* Opens cached undone content of file with <stats> (-1 if not cached). */
+int prelink_cache_open(const struct stat *stats)
+{
+    int filedesc = -1;
+
+    pthread_mutex_lock(&prelink_cache.mutex);
+
+    for (size_t i = 0; i < prelink_cache.entries_len; i++) {
+        if (prelink_entry_matches(&prelink_cache.entries[i], stats)) {
+            if ((filedesc = reopen(prelink_cache.entries[i].filedesc)) >= 0)
+                prelink_cache.entries[i].used = ++prelink_cache.clock;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&prelink_cache.mutex);
+
+    return filedesc;
+}
+
+/* Caches undone content at <filedesc> of file with <stats>,
+ * evicting least recently used entries to stay within limits. */
+void prelink_cache_add(const struct stat *stats, int filedesc)
+{
+    struct prelink_entry entry;
+    struct stat undone_stats;
+    size_t lru;
+
+    if ((entry.filedesc = reopen(filedesc)) < 0)
+        return;
+
+    if (fstat(entry.filedesc, &undone_stats) != 0 ||
+        undone_stats.st_size > PRELINK_CACHE_BYTES) {
+        close(entry.filedesc);
+        return;
+    }
+
+    entry.dev = stats->st_dev;
+    entry.ino = stats->st_ino;
+    entry.size = stats->st_size;
+    entry.mtime = stats->st_mtim;
+    entry.ctime = stats->st_ctim;
+    entry.undone_size = undone_stats.st_size;
+
+    pthread_mutex_lock(&prelink_cache.mutex);
+
+    /* dropping older content of the same file
+     * (or newer one added by a concurrent undo) */
+    for (size_t i = 0; i < prelink_cache.entries_len; i++) {
+        if (prelink_cache.entries[i].dev == entry.dev && prelink_cache.entries[i].ino == entry.ino) {
+            prelink_cache_evict(i);
+            break;
+        }
+    }
+
+    while (prelink_cache.entries_len > 0 &&
+           (prelink_cache.entries_len == PRELINK_CACHE_MAX ||
+            prelink_cache.bytes + entry.undone_size > PRELINK_CACHE_BYTES)) {
+        lru = 0;
+        for (size_t i = 1; i < prelink_cache.entries_len; i++)
+            if (prelink_cache.entries[i].used < prelink_cache.entries[lru].used)
+                lru = i;
+        prelink_cache_evict(lru);
+    }
+
+    entry.used = ++prelink_cache.clock;
+    prelink_cache.entries[prelink_cache.entries_len++] = entry;
+    prelink_cache.bytes += entry.undone_size;
+
+    pthread_mutex_unlock(&prelink_cache.mutex);
+}
+
+int drpm_clear_prelink_cache(void)
+{
+    pthread_mutex_lock(&prelink_cache.mutex);
+
+    while (prelink_cache.entries_len > 0)
+        prelink_cache_evict(prelink_cache.entries_len - 1);
+
+    pthread_mutex_unlock(&prelink_cache.mutex);
+
+    return DRPM_ERR_OK;
+}
+
+/* Opens original (non-prelinked) content of <filename>.
+ * Content is restored by running prelink, unless it has been already. */
 int prelink_open(const char *filename, int *filedesc)
 {
     pid_t pid;
     int fd;
     int status;
     struct stat stats;
+    struct stat file_stats;
+    bool cacheable;
     char template[] = "/tmp/drpm.XXXXXX";
 
     if (filename == NULL || filedesc == NULL)
         return DRPM_ERR_PROG;
 
+    if ((cacheable = (stat(filename, &file_stats) == 0)) &&
+        (fd = prelink_cache_open(&file_stats)) >= 0) {
+        *filedesc = fd;
+        return DRPM_ERR_OK;
+    }
+
     if (stat("/usr/sbin/prelink", &stats) != 0)
         return DRPM_ERR_OTHER;
 
-    if ((fd = mkstemp(template)) < 0)
+    if ((fd = mkostemp(template, O_CLOEXEC)) < 0)
         return DRPM_ERR_IO;
     close(fd);
 
     pid = fork();
     if (pid == (pid_t)-1) {
+        unlink(template);
         return DRPM_ERR_OTHER;
     }
     if (pid == 0) {
@@ -649,13 +1028,15 @@ int prelink_open(const char *filename, int *filedesc)
 
     while (waitpid(pid, &status, 0) == (pid_t)-1);
 
-    if ((fd = open(template, O_RDONLY)) < 0)
+    if ((fd = open(template, O_RDONLY | O_CLOEXEC)) < 0)
         return DRPM_ERR_IO;
 
     unlink(template);
 
+    if (cacheable && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        prelink_cache_add(&file_stats, fd);
+
     *filedesc = fd;
 
     return DRPM_ERR_OK;
 }
-
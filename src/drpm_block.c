@@ -19,6 +19,9 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* O_TMPFILE */
+#define _GNU_SOURCE
+
 #include "drpm.h"
 #include "drpm_private.h"
 
@@ -32,9 +35,15 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <fcntl.h>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
 
-#define MAX_OPEN_FILES 50
+#define OPEN_FILES_MIN 16
+#define OPEN_FILES_MAX 65536
 #define MAX_CORE_BLOCKS 5000
 
 #define BLOCK_SIZE (1 << 13)
@@ -46,13 +55,23 @@
 
 #define BLOCKS(size) (1 + ((size) - 1) / BLOCK_SIZE)
 
+#define SPILL_DIR_DEFAULT "/tmp"
+#define SPILL_TEMPLATE "/drpmpageXXXXXX"
+#define SPILL_COMP_LEVEL 1
+
+/* Spill file slots are sized in eighths of a block, so that slots freed
+ * by compressed blocks fit most later ones and the spill file does not
+ * fragment into slots of every possible length. */
+#define SPILL_SLOT_UNIT (BLOCK_SIZE / 8)
+#define SPILL_SLOT_CAP(len) (SPILL_SLOT_UNIT * (1 + ((len) - 1) / SPILL_SLOT_UNIT))
+
 /* a list of open files */
 struct open_file {
     struct open_file *prev;
     struct open_file *next;
     int filedesc;
     const char *name;
-    off_t offset;
+    size_t cpio_index;
 };
 
 /* a block */
@@ -67,6 +86,10 @@ struct block {
         off_t offset;
         unsigned char *buffer;
     } data;
+    /* page blocks may be stored compressed, in which case they occupy
+     * <page_len> bytes of a slot of <page_cap> bytes */
+    size_t page_len;
+    size_t page_cap;
 };
 
 struct blocks {
@@ -77,9 +100,18 @@ struct blocks {
     struct block *page_blocks;
     size_t page_blocks_count;
     int page_filedesc;
+    off_t page_file_len;
+    const char *spill_dir;
+    unsigned short spill_comp;
+    unsigned char *spill_buffer;
+    size_t spill_buffer_len;
 
     struct block **blocks_table;
     size_t *blocks_max;
+    bool *blocks_used;
+    /* blocks needed by more than one external copy */
+    bool *blocks_reused;
+    size_t blocks_count;
 
     unsigned char *cpio_buffer;
     const char *linkto;
@@ -94,8 +126,10 @@ struct blocks {
         struct {
             struct open_file *files_head;
             struct open_file *files_tail;
-            unsigned short file_count;
+            size_t file_count;
+            size_t file_count_max;
             struct open_file **open_files;
+            struct prefetch *prefetch;
         } from_filesytem;
         struct {
             struct rpm *old_rpm;
@@ -108,19 +142,27 @@ struct blocks {
     } rpm_files;
 
     struct block *last_block;
+    /* counts core block allocations, every 8th one tries reusing blocks first */
+    size_t cleanup_count;
 
     int (*fill_block)(struct blocks *, struct block *, size_t, size_t);
 };
 
+static size_t find_cpio_file(const struct blocks *, uint64_t);
+static size_t open_files_max(size_t);
 static int fillblock_filesystem(struct blocks *, struct block *, size_t, size_t);
 static int fillblock_prelink(struct blocks *, struct block *, size_t, size_t, const struct cpio_file *);
 static int fillblock_rpm_rpmonly(struct blocks *, struct block *, size_t, size_t);
 static int fillblock_rpm_standard(struct blocks *, struct block *, size_t, size_t);
+static int evict_core_block(struct blocks *, struct block **, size_t);
 static struct block *get_free_core_block(struct blocks *);
 static int get_block(struct blocks *, struct block **, size_t, size_t);
 static int new_core_block(struct blocks *, struct block **);
 static int push_block(struct blocks *, const struct block *, size_t);
 static int read_page_block(struct blocks *, struct block *, const struct block *);
+static int spill_open(struct blocks *);
+static int spill_pack(struct blocks *, const unsigned char *, const unsigned char **, size_t *);
+static int spill_unpack(struct blocks *, unsigned char *, const unsigned char *, size_t);
 static int write_page_block(struct blocks *, const struct block *, size_t);
 
 /* returns size of block */
@@ -140,7 +182,8 @@ int blocks_create(struct blocks **blks_ret,
                   uint64_t ext_data_len, const struct file_info *files,
                   const struct cpio_file *cpio_files, size_t cpio_files_len,
                   const uint32_t *ext_copies, size_t ext_copies_count,
-                  struct rpm *old_rpm, bool rpm_only)
+                  struct rpm *old_rpm, bool rpm_only,
+                  const struct drpm_apply_options *opts)
 {
     int error = DRPM_ERR_OK;
     const size_t block_count = BLOCKS(ext_data_len);
@@ -149,7 +192,10 @@ int blocks_create(struct blocks **blks_ret,
     uint32_t old_header_size;
     struct blocks blks = {
         .page_filedesc = -1,
+        .spill_dir = SPILL_DIR_DEFAULT,
+        .spill_comp = DRPM_COMP_NONE,
         .cpio_files_index = -1,
+        .blocks_count = block_count,
         .cpio_files = cpio_files,
         .cpio_files_len = cpio_files_len,
         .files = files,
@@ -162,6 +208,28 @@ int blocks_create(struct blocks **blks_ret,
     if (block_count >= UINT32_MAX)
         return DRPM_ERR_OVERFLOW;
 
+    if (opts != NULL) {
+        if (opts->spill_dir != NULL)
+            blks.spill_dir = opts->spill_dir;
+        blks.spill_comp = opts->spill_comp;
+    }
+
+    switch (blks.spill_comp) {
+    case DRPM_COMP_NONE:
+        blks.spill_buffer_len = 0;
+        break;
+    case DRPM_COMP_GZIP:
+        blks.spill_buffer_len = compressBound(BLOCK_SIZE);
+        break;
+#ifdef WITH_ZSTD
+    case DRPM_COMP_ZSTD:
+        blks.spill_buffer_len = ZSTD_compressBound(BLOCK_SIZE);
+        break;
+#endif
+    default:
+        return DRPM_ERR_PROG;
+    }
+
     if (blks.from_rpm) {
         blks.rpm_files.from_rpm.old_rpm = old_rpm;
         blks.rpm_files.from_rpm.rpm_id = 0;
@@ -187,12 +255,16 @@ int blocks_create(struct blocks **blks_ret,
         blks.rpm_files.from_filesytem.files_head = NULL;
         blks.rpm_files.from_filesytem.files_tail = NULL;
         blks.rpm_files.from_filesytem.file_count = 0;
+        blks.rpm_files.from_filesytem.file_count_max = open_files_max(cpio_files_len);
+        blks.rpm_files.from_filesytem.prefetch = NULL;
         blks.fill_block = fillblock_filesystem;
     }
 
     if ((*blks_ret = malloc(sizeof(struct blocks))) == NULL ||
         (blks.blocks_table = calloc(block_count, sizeof(struct block *))) == NULL ||
-        (blks.blocks_max = calloc(block_count, sizeof(size_t))) == NULL) {
+        (blks.blocks_max = calloc(block_count, sizeof(size_t))) == NULL ||
+        (blks.blocks_used = calloc(block_count, sizeof(bool))) == NULL ||
+        (blks.blocks_reused = calloc(block_count, sizeof(bool))) == NULL) {
         error = DRPM_ERR_MEMORY;
         goto cleanup;
     }
@@ -202,8 +274,12 @@ int blocks_create(struct blocks **blks_ret,
         blk_i = off / BLOCK_SIZE;
         off += ext_copies[2 * i + 1];
         blk_l = BLOCKS(off);
-        for ( ; blk_i < blk_l; blk_i++)
+        for ( ; blk_i < blk_l; blk_i++) {
+            if (blks.blocks_used[blk_i] && blks.blocks_max[blk_i] != i)
+                blks.blocks_reused[blk_i] = true;
             blks.blocks_max[blk_i] = i;
+            blks.blocks_used[blk_i] = true;
+        }
     }
 
     max_cpio_header_len = CPIO_HEADER_SIZE + strlen(CPIO_TRAILER) + 1;
@@ -212,11 +288,20 @@ int blocks_create(struct blocks **blks_ret,
         if (cpio_files[i].header_len > max_cpio_header_len)
             max_cpio_header_len = cpio_files[i].header_len;
 
-    if ((blks.cpio_buffer = malloc(max_cpio_header_len)) == NULL) {
+    if ((blks.cpio_buffer = malloc(max_cpio_header_len)) == NULL ||
+        (blks.spill_buffer_len > 0 &&
+         (blks.spill_buffer = malloc(blks.spill_buffer_len)) == NULL)) {
         error = DRPM_ERR_MEMORY;
         goto cleanup;
     }
 
+    /* installed files are read ahead in a separate thread if pipelined */
+    if (!blks.from_rpm && opts != NULL && opts->pipelined &&
+        (error = prefetch_create(&blks.rpm_files.from_filesytem.prefetch,
+                                 cpio_files, cpio_files_len, files,
+                                 blks.blocks_used, block_count)) != DRPM_ERR_OK)
+        goto cleanup;
+
     **blks_ret = blks;
 
     return DRPM_ERR_OK;
@@ -225,11 +310,61 @@ cleanup:
     free(*blks_ret);
     free(blks.blocks_table);
     free(blks.blocks_max);
+    free(blks.blocks_used);
+    free(blks.blocks_reused);
     free(blks.cpio_buffer);
+    free(blks.spill_buffer);
 
     return error;
 }
 
+/* Finds the CPIO entry covering <offset>, trying the current entry first
+ * and falling back to binary search (entries are ordered by offset).
+ * Returns number of entries if there is no such entry. */
+size_t find_cpio_file(const struct blocks *blks, uint64_t offset)
+{
+    const struct cpio_file *cpio;
+    size_t low = 0;
+    size_t high = blks->cpio_files_len;
+    size_t mid;
+
+    if (blks->cpio_files_index >= 0 && (size_t)blks->cpio_files_index < blks->cpio_files_len) {
+        cpio = blks->cpio_files + blks->cpio_files_index;
+        if (cpio->offset <= offset && cpio->offset + cpio->header_len + cpio->content_len > offset)
+            return blks->cpio_files_index;
+    }
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        cpio = blks->cpio_files + mid;
+        if (cpio->offset + cpio->header_len + cpio->content_len <= offset)
+            low = mid + 1;
+        else if (cpio->offset > offset)
+            high = mid;
+        else
+            return mid;
+    }
+
+    return blks->cpio_files_len;
+}
+
+/* Determines how many installed files may be kept open at once.
+ * Half of the descriptor limit is used, leaving the rest to the caller. */
+size_t open_files_max(size_t cpio_files_len)
+{
+    struct rlimit limit;
+    size_t max = OPEN_FILES_MAX;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        limit.rlim_cur / 2 < OPEN_FILES_MAX)
+        max = limit.rlim_cur / 2;
+
+    if (max > cpio_files_len)
+        max = cpio_files_len;
+
+    return MAX(max, OPEN_FILES_MIN);
+}
+
 /* frees block data */
 int blocks_destroy(struct blocks **blks_ref)
 {
@@ -244,6 +379,7 @@ int blocks_destroy(struct blocks **blks_ref)
     if (blks->from_rpm) {
         free(blks->rpm_files.from_rpm.old_header);
     } else {
+        prefetch_destroy(&blks->rpm_files.from_filesytem.prefetch);
         for (struct open_file *tmp, *file = blks->rpm_files.from_filesytem.files_head; file != NULL; ) {
             close(file->filedesc);
             tmp = file;
@@ -272,7 +408,10 @@ int blocks_destroy(struct blocks **blks_ref)
 
     free(blks->blocks_table);
     free(blks->blocks_max);
+    free(blks->blocks_used);
+    free(blks->blocks_reused);
     free(blks->cpio_buffer);
+    free(blks->spill_buffer);
 
     free(*blks_ref);
 
@@ -309,7 +448,6 @@ int blocks_next(struct blocks *blks, unsigned char buffer[BLOCK_SIZE], size_t *b
 /* gets new block and fills it */
 int get_block(struct blocks *blks, struct block **blk_ret, size_t id, size_t copy_cnt)
 {
-    static size_t cleanup_count = 0;
     int error;
     struct block *blk;
     struct block *page_blk;
@@ -326,7 +464,7 @@ int get_block(struct blocks *blks, struct block **blk_ret, size_t id, size_t cop
     }
 
     if ((blk = get_free_core_block(blks)) == NULL) {
-        if (blks->core_blocks_count < MAX_CORE_BLOCKS && (++cleanup_count % 8) != 0) {
+        if (blks->core_blocks_count < MAX_CORE_BLOCKS && (++blks->cleanup_count % 8) != 0) {
             if ((error = new_core_block(blks, &blk)) != DRPM_ERR_OK)
                 return error;
         } else {
@@ -346,22 +484,8 @@ int get_block(struct blocks *blks, struct block **blk_ret, size_t id, size_t cop
                 if (blks->core_blocks_count < MAX_CORE_BLOCKS) {
                     if ((error = new_core_block(blks, &blk)) != DRPM_ERR_OK)
                         return error;
-                } else {
-                    for (struct block **blk_ptr = &blks->core_blocks; (blk = *blk_ptr) != NULL; blk_ptr = &blk->next) {
-                        if (blk->next == NULL) {
-                            *blk_ptr = NULL;
-                            break;
-                        }
-                    }
-                    blk->next = blks->core_blocks;
-                    blks->core_blocks = blk;
-                    if (blk->type == BLK_CORE) {
-                        if ((error = write_page_block(blks, blk, copy_cnt)) != DRPM_ERR_OK)
-                            return error;
-                    } else {
-                        blks->blocks_table[blk->id] = NULL;
-                    }
-                    blk->type = BLK_FREE;
+                } else if ((error = evict_core_block(blks, &blk, copy_cnt)) != DRPM_ERR_OK) {
+                    return error;
                 }
             }
         }
@@ -380,6 +504,75 @@ int get_block(struct blocks *blks, struct block **blk_ret, size_t id, size_t cop
     return DRPM_ERR_OK;
 }
 
+/* Frees the least recently used core block for reuse.
+ * Its data is paged out if it cannot be refilled later. */
+int evict_core_block(struct blocks *blks, struct block **blk_ret, size_t copy_cnt)
+{
+    int error;
+    struct block *blk;
+
+    for (struct block **blk_ptr = &blks->core_blocks; (blk = *blk_ptr) != NULL; blk_ptr = &blk->next) {
+        if (blk->next == NULL) {
+            *blk_ptr = NULL;
+            break;
+        }
+    }
+    blk->next = blks->core_blocks;
+    blks->core_blocks = blk;
+    if (blk->type == BLK_CORE) {
+        if ((error = write_page_block(blks, blk, copy_cnt)) != DRPM_ERR_OK)
+            return error;
+    } else {
+        blks->blocks_table[blk->id] = NULL;
+    }
+    blk->type = BLK_FREE;
+
+    *blk_ret = blk;
+
+    return DRPM_ERR_OK;
+}
+
+/* Reads blocks needed by more than one external copy in ascending order
+ * before reconstruction (after <copy_cnt> copies), so that old data
+ * is read in one sequential pass rather than again for each copy.
+ * Blocks are staged in core (or paged out) until they are used.
+ * Blocks needed only once are read when they are used. */
+int blocks_prefetch(struct blocks *blks, size_t copy_cnt)
+{
+    int error;
+    struct block *blk;
+
+    if (blks == NULL)
+        return DRPM_ERR_PROG;
+
+    for (size_t id = 0; id < blks->blocks_count; id++) {
+        if (!blks->blocks_reused[id] || blks->blocks_max[id] < copy_cnt ||
+            blks->blocks_table[id] != NULL)
+            continue;
+
+        if ((blk = get_free_core_block(blks)) == NULL) {
+            if (blks->core_blocks_count < MAX_CORE_BLOCKS)
+                error = new_core_block(blks, &blk);
+            else
+                error = evict_core_block(blks, &blk, copy_cnt);
+            if (error != DRPM_ERR_OK)
+                return error;
+        }
+
+        blks->blocks_table[id] = blk;
+        if ((error = blks->fill_block(blks, blk, id, copy_cnt)) != DRPM_ERR_OK)
+            return error;
+
+        /* staged blocks must not be dropped, as re-reading them would
+         * defeat the purpose */
+        blk->type = BLK_CORE;
+    }
+
+    blks->last_block = NULL;
+
+    return DRPM_ERR_OK;
+}
+
 /* allocates a new block */
 int new_core_block(struct blocks *blks, struct block **new_ret)
 {
@@ -453,8 +646,10 @@ int push_block(struct blocks *blks, const struct block *blk, size_t copy_cnt)
 /* insert a page block in table and writes its data to temporary file */
 int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_cnt)
 {
+    int error;
     struct block *new;
-    char template[] = "/tmp/drpmpageXXXXXX";
+    const unsigned char *data;
+    size_t data_len;
 
     if (blks == NULL || blk == NULL || blk->type == BLK_PAGE)
         return DRPM_ERR_PROG;
@@ -466,33 +661,33 @@ int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_c
         }
     }
 
+    if ((error = spill_pack(blks, blk->data.buffer, &data, &data_len)) != DRPM_ERR_OK)
+        return error;
+
     for (new = blks->page_blocks; new != NULL; new = new->next)
-        if (blks->blocks_max[new->id] < copy_cnt)
+        if (blks->blocks_max[new->id] < copy_cnt && new->page_cap >= data_len)
             break;
 
     if (new == NULL) {
+        if (blks->page_filedesc < 0 &&
+            (error = spill_open(blks)) != DRPM_ERR_OK)
+            return error;
         if ((new = malloc(sizeof(struct block))) == NULL)
             return DRPM_ERR_MEMORY;
         new->type = BLK_PAGE;
-        new->data.offset = blks->page_blocks_count;
+        new->data.offset = blks->page_file_len;
+        new->page_cap = SPILL_SLOT_CAP(data_len);
         new->next = blks->page_blocks;
         blks->page_blocks = new;
         blks->page_blocks_count++;
-        if (blks->page_filedesc < 0) {
-            if ((blks->page_filedesc = mkstemp(template)) < 0) {
-                free(new);
-                return DRPM_ERR_IO;
-            }
-            unlink(template);
-        }
+        blks->page_file_len += new->page_cap;
     }
 
     new->id = blk->id;
+    new->page_len = data_len;
 
-    if (pwrite(blks->page_filedesc, blk->data.buffer, BLOCK_SIZE, new->data.offset * BLOCK_SIZE) != BLOCK_SIZE) {
-        free(new);
+    if (pwrite(blks->page_filedesc, data, data_len, new->data.offset) != (ssize_t)data_len)
         return DRPM_ERR_IO;
-    }
 
     blks->blocks_table[new->id] = new;
 
@@ -502,13 +697,23 @@ int write_page_block(struct blocks *blks, const struct block *blk, size_t copy_c
 /* reads page block data from temporary file into destination block */
 int read_page_block(struct blocks *blks, struct block *dst, const struct block *src)
 {
+    int error;
+    unsigned char *buf;
+
     if (blks == NULL || dst == NULL || src == NULL ||
         blks->page_filedesc < 0 || dst->type == BLK_PAGE || src->type != BLK_PAGE)
         return DRPM_ERR_PROG;
 
-    if (pread(blks->page_filedesc, dst->data.buffer, BLOCK_SIZE, src->data.offset * BLOCK_SIZE) != BLOCK_SIZE)
+    /* blocks that did not compress well are stored as they are */
+    buf = (src->page_len == BLOCK_SIZE) ? dst->data.buffer : blks->spill_buffer;
+
+    if (pread(blks->page_filedesc, buf, src->page_len, src->data.offset) != (ssize_t)src->page_len)
         return DRPM_ERR_IO;
 
+    if (buf != dst->data.buffer &&
+        (error = spill_unpack(blks, dst->data.buffer, buf, src->page_len)) != DRPM_ERR_OK)
+        return error;
+
     dst->id = src->id;
     dst->type = BLK_CORE;
     blks->blocks_table[dst->id] = dst;
@@ -516,6 +721,94 @@ int read_page_block(struct blocks *blks, struct block *dst, const struct block *
     return DRPM_ERR_OK;
 }
 
+/* Opens anonymous temporary file for page blocks in spill directory.
+ * Falls back to an unlinked mkstemp() file if O_TMPFILE is unsupported. */
+int spill_open(struct blocks *blks)
+{
+    char *template;
+
+#ifdef O_TMPFILE
+    if ((blks->page_filedesc = open(blks->spill_dir, O_TMPFILE | O_RDWR | O_EXCL, S_IRUSR | S_IWUSR)) >= 0)
+        return DRPM_ERR_OK;
+#endif
+
+    if ((template = malloc(strlen(blks->spill_dir) + strlen(SPILL_TEMPLATE) + 1)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    strcpy(template, blks->spill_dir);
+    strcat(template, SPILL_TEMPLATE);
+
+    if ((blks->page_filedesc = mkstemp(template)) >= 0)
+        unlink(template);
+
+    free(template);
+
+    return (blks->page_filedesc < 0) ? DRPM_ERR_IO : DRPM_ERR_OK;
+}
+
+/* Prepares block data to be written to spill file.
+ * If compression is enabled and effective, <*data> points to compressed
+ * data in spill buffer, otherwise to <buffer> itself. */
+int spill_pack(struct blocks *blks, const unsigned char *buffer,
+               const unsigned char **data, size_t *data_len)
+{
+    uLongf gzip_len;
+#ifdef WITH_ZSTD
+    size_t zstd_len;
+#endif
+
+    *data = buffer;
+    *data_len = BLOCK_SIZE;
+
+    switch (blks->spill_comp) {
+    case DRPM_COMP_GZIP:
+        gzip_len = blks->spill_buffer_len;
+        if (compress2(blks->spill_buffer, &gzip_len, buffer, BLOCK_SIZE, SPILL_COMP_LEVEL) != Z_OK)
+            return DRPM_ERR_OTHER;
+        if (gzip_len < BLOCK_SIZE) {
+            *data = blks->spill_buffer;
+            *data_len = gzip_len;
+        }
+        break;
+#ifdef WITH_ZSTD
+    case DRPM_COMP_ZSTD:
+        zstd_len = ZSTD_compress(blks->spill_buffer, blks->spill_buffer_len, buffer, BLOCK_SIZE, SPILL_COMP_LEVEL);
+        if (ZSTD_isError(zstd_len))
+            return DRPM_ERR_OTHER;
+        if (zstd_len < BLOCK_SIZE) {
+            *data = blks->spill_buffer;
+            *data_len = zstd_len;
+        }
+        break;
+#endif
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* decompresses block data of size <len> read from spill file into <buffer> */
+int spill_unpack(struct blocks *blks, unsigned char *buffer, const unsigned char *data, size_t len)
+{
+    uLongf gzip_len = BLOCK_SIZE;
+
+    switch (blks->spill_comp) {
+    case DRPM_COMP_GZIP:
+        if (uncompress(buffer, &gzip_len, data, len) != Z_OK || gzip_len != BLOCK_SIZE)
+            return DRPM_ERR_FORMAT;
+        break;
+#ifdef WITH_ZSTD
+    case DRPM_COMP_ZSTD:
+        if (ZSTD_decompress(buffer, BLOCK_SIZE, data, len) != BLOCK_SIZE)
+            return DRPM_ERR_FORMAT;
+        break;
+#endif
+    default:
+        return DRPM_ERR_PROG;
+    }
+
+    return DRPM_ERR_OK;
+}
+
 /* fills CPIO header and linkto buffers based on file info at <index> */
 void fill_cpio_header(struct blocks *blks, ssize_t index)
 {
@@ -562,7 +855,9 @@ void fill_cpio_header(struct blocks *blks, ssize_t index)
            "\0\0\0", CPIO_PADDING(CPIO_HEADER_SIZE + header.namesize));
 }
 
-/* opens new file and appends it to list, sets <prelinked> indicator */
+/* Opens file of CPIO entry at <index> and appends it to list
+ * (closing the least recently used file if too many are open),
+ * sets <prelinked> indicator. */
 int open_new_file(struct blocks *blks, bool *prelinked, size_t index)
 {
     int error;
@@ -597,7 +892,11 @@ int open_new_file(struct blocks *blks, bool *prelinked, size_t index)
         }
     }
 
-    if (blks->rpm_files.from_filesytem.file_count < MAX_OPEN_FILES) {
+    /* file is about to be read from start to end */
+    posix_fadvise(filedesc, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(filedesc, 0, 0, POSIX_FADV_WILLNEED);
+
+    if (blks->rpm_files.from_filesytem.file_count < blks->rpm_files.from_filesytem.file_count_max) {
         if ((new = malloc(sizeof(struct open_file))) == NULL) {
             close(filedesc);
             return DRPM_ERR_MEMORY;
@@ -611,11 +910,12 @@ int open_new_file(struct blocks *blks, bool *prelinked, size_t index)
         else
             files_head->prev = NULL;
         close(new->filedesc);
+        blks->rpm_files.from_filesytem.open_files[new->cpio_index] = NULL;
     }
 
     new->filedesc = filedesc;
     new->name = file.name;
-    new->offset = 0;
+    new->cpio_index = index;
     new->prev = NULL;
     new->next = NULL;
 
@@ -635,7 +935,7 @@ int open_new_file(struct blocks *blks, bool *prelinked, size_t index)
     return DRPM_ERR_OK;
 }
 
-/* gets open file and moves it to end of list */
+/* gets open file of CPIO entry at <index> and moves it to end of list */
 struct open_file *get_open_file(struct blocks *blks, size_t index)
 {
     struct open_file *file = blks->rpm_files.from_filesytem.open_files[index];
@@ -667,6 +967,60 @@ struct open_file *get_open_file(struct blocks *blks, size_t index)
     return file;
 }
 
+/* Maps external data at <offset> to a range of an installed file, so that
+ * it can be copied without going through blocks (filesystem data only).
+ * <*range_len> is at most <len> and is zero if the data does not come
+ * as is from a regular file. */
+int blocks_file_range(struct blocks *blks, uint64_t offset, size_t len,
+                      int *filedesc, off_t *file_off, size_t *range_len)
+{
+    int error;
+    const struct cpio_file *cpio;
+    size_t i;
+    uint64_t content_off;
+    struct open_file *file;
+    bool prelinked;
+
+    if (blks == NULL || filedesc == NULL || file_off == NULL || range_len == NULL)
+        return DRPM_ERR_PROG;
+
+    *range_len = 0;
+
+    if (blks->from_rpm)
+        return DRPM_ERR_OK;
+
+    if ((i = find_cpio_file(blks, offset)) == blks->cpio_files_len)
+        return DRPM_ERR_OK;
+
+    cpio = blks->cpio_files + i;
+
+    prefetch_advance(blks->rpm_files.from_filesytem.prefetch, i);
+
+    if (cpio->index < 0 ||
+        offset < cpio->offset + cpio->header_len ||
+        !S_ISREG(blks->files[cpio->index].mode))
+        return DRPM_ERR_OK;
+
+    content_off = offset - (cpio->offset + cpio->header_len);
+    if (content_off >= blks->files[cpio->index].size)
+        return DRPM_ERR_OK;
+
+    if ((file = get_open_file(blks, i)) == NULL) {
+        if ((error = open_new_file(blks, &prelinked, i)) != DRPM_ERR_OK)
+            return error;
+        /* original content of prelinked files has to be restored */
+        if (prelinked)
+            return DRPM_ERR_OK;
+        file = get_open_file(blks, i);
+    }
+
+    *filedesc = file->filedesc;
+    *file_off = content_off;
+    *range_len = MIN(len, blks->files[cpio->index].size - content_off);
+
+    return DRPM_ERR_OK;
+}
+
 /***************************** fill block *****************************/
 
 /* Fills a block from old RPM in the case of a standard delta.
@@ -932,16 +1286,12 @@ int fillblock_filesystem(struct blocks *blks, struct block *blk, size_t id, size
     buf_ptr = blk->data.buffer;
     len = BLOCK_SIZE;
     off = id * BLOCK_SIZE;
-    i = blks->cpio_files_index >= 0 ? blks->cpio_files_index : 0;
+    if ((i = find_cpio_file(blks, off)) == blks->cpio_files_len)
+        return DRPM_ERR_PROG;
 
-    for (cpio = blks->cpio_files + i; i > 0 && cpio->offset > off; i--, cpio--);
+    cpio = blks->cpio_files + i;
 
-    for ( ; i < blks->cpio_files_len; i++, cpio++)
-        if (cpio->offset <= off && cpio->offset + cpio->header_len + cpio->content_len > off)
-            break;
-
-    if (i == blks->cpio_files_len)
-        return DRPM_ERR_PROG;
+    prefetch_advance(blks->rpm_files.from_filesytem.prefetch, i);
 
     if ((ssize_t)i != blks->cpio_files_index) {
         fill_cpio_header(blks, cpio->index);
@@ -976,25 +1326,20 @@ int fillblock_filesystem(struct blocks *blks, struct block *blk, size_t id, size
                     strncpy((char *)buf_ptr, blks->linkto + file_off, read_len);
             } else if (file_off < blks->files[cpio->index].size) {
                 read_len = MIN(len, blks->files[cpio->index].size - file_off);
-                file = get_open_file(blks, cpio->index);
+                file = get_open_file(blks, cpio - blks->cpio_files);
                 if (file == NULL) {
-                    if ((error = open_new_file(blks, &prelinked, cpio->index)) != DRPM_ERR_OK)
+                    if ((error = open_new_file(blks, &prelinked, cpio - blks->cpio_files)) != DRPM_ERR_OK)
                         break;
                     if (prelinked) {
                         blks->cpio_files_index = -1;
                         return fillblock_prelink(blks, blk, id, copy_cnt, cpio);
                     }
-                    file = get_open_file(blks, cpio->index);
-                }
-                if (file->offset != (off_t)file_off && lseek(file->filedesc, file_off, SEEK_SET) != (off_t)file_off) {
-                    error = DRPM_ERR_IO;
-                    break;
+                    file = get_open_file(blks, cpio - blks->cpio_files);
                 }
-                if (read(file->filedesc, buf_ptr, read_len) != (ssize_t)read_len) {
+                if (pread(file->filedesc, buf_ptr, read_len, file_off) != (ssize_t)read_len) {
                     error = DRPM_ERR_FORMAT;
                     break;
                 }
-                file->offset = file_off + read_len;
             } else {
                 read_len = MIN(len, cpio->content_len - file_off);
                 memset(buf_ptr, 0, read_len);
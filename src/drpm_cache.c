@@ -0,0 +1,393 @@
+/*
+    Copyright (C) 2016 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+#define DIGEST_CACHE_MAGIC "DRPMDGC1"
+#define DIGEST_CACHE_MAGIC_LEN 8
+#define DIGEST_CACHE_MAX_DEFAULT (1 << 16)
+
+/* Digest of an installed file, valid for as long as the file
+ * keeps its identity (device and inode), size and timestamps. */
+struct digest_cache_entry {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t digest_algo;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    /* time of last use (for eviction) */
+    uint64_t used;
+};
+
+/* Process-wide cache of file digests, kept in memory (sorted by device,
+ * inode and digest algorithm) and saved to <path> after checks.
+ * Loaded lazily on first use. */
+static struct {
+    pthread_mutex_t mutex;
+    char *path;
+    size_t max_entries;
+    bool loaded;
+    bool dirty;
+    uint64_t clock;
+    struct digest_cache_entry *entries;
+    size_t entries_len;
+    size_t entries_alloc;
+} digest_cache = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static int digest_cache_compare(const struct digest_cache_entry *, const struct digest_cache_entry *);
+static int digest_cache_compare_key(const void *, const void *);
+static int digest_cache_compare_used(const void *, const void *);
+static bool digest_cache_find(const struct digest_cache_entry *, size_t *);
+static void digest_cache_key(struct digest_cache_entry *, const struct stat *, unsigned short);
+static void digest_cache_load(void);
+static void digest_cache_prune(size_t);
+static int digest_cache_save(void);
+
+int digest_cache_compare(const struct digest_cache_entry *a, const struct digest_cache_entry *b)
+{
+    if (a->dev != b->dev)
+        return (a->dev > b->dev) - (a->dev < b->dev);
+    if (a->ino != b->ino)
+        return (a->ino > b->ino) - (a->ino < b->ino);
+    return (a->digest_algo > b->digest_algo) - (a->digest_algo < b->digest_algo);
+}
+
+int digest_cache_compare_key(const void *a, const void *b)
+{
+    return digest_cache_compare(a, b);
+}
+
+/* orders most recently used entries first */
+int digest_cache_compare_used(const void *a, const void *b)
+{
+    const uint64_t used_a = ((const struct digest_cache_entry *)a)->used;
+    const uint64_t used_b = ((const struct digest_cache_entry *)b)->used;
+
+    return (used_a < used_b) - (used_a > used_b);
+}
+
+void digest_cache_key(struct digest_cache_entry *entry, const struct stat *stats,
+                      unsigned short digest_algo)
+{
+    memset(entry, 0, sizeof(struct digest_cache_entry));
+
+    entry->dev = stats->st_dev;
+    entry->ino = stats->st_ino;
+    entry->size = stats->st_size;
+    entry->mtime_sec = stats->st_mtim.tv_sec;
+    entry->mtime_nsec = stats->st_mtim.tv_nsec;
+    entry->ctime_sec = stats->st_ctim.tv_sec;
+    entry->ctime_nsec = stats->st_ctim.tv_nsec;
+    entry->digest_algo = digest_algo;
+}
+
+/* Looks up entry for the same file and algorithm as <key>.
+ * Position of the entry (or where to insert it) is stored in <*pos>. */
+bool digest_cache_find(const struct digest_cache_entry *key, size_t *pos)
+{
+    size_t low = 0;
+    size_t high = digest_cache.entries_len;
+    size_t mid;
+    int cmp;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if ((cmp = digest_cache_compare(&digest_cache.entries[mid], key)) == 0) {
+            *pos = mid;
+            return true;
+        }
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    *pos = low;
+
+    return false;
+}
+
+/* keeps only <max> most recently used entries */
+void digest_cache_prune(size_t max)
+{
+    if (digest_cache.entries_len <= max)
+        return;
+
+    qsort(digest_cache.entries, digest_cache.entries_len,
+          sizeof(struct digest_cache_entry), digest_cache_compare_used);
+    digest_cache.entries_len = max;
+    qsort(digest_cache.entries, digest_cache.entries_len,
+          sizeof(struct digest_cache_entry), digest_cache_compare_key);
+}
+
+/* Reads cache file, keeping the most recently used entries within limit.
+ * A missing or malformed file leaves the cache empty. */
+void digest_cache_load(void)
+{
+    FILE *file;
+    char magic[DIGEST_CACHE_MAGIC_LEN];
+    uint32_t entry_size;
+    uint64_t count;
+    struct digest_cache_entry *entries;
+
+    digest_cache.loaded = true;
+
+    if ((file = fopen(digest_cache.path, "rb")) == NULL)
+        return;
+
+    if (fread(magic, 1, DIGEST_CACHE_MAGIC_LEN, file) != DIGEST_CACHE_MAGIC_LEN ||
+        memcmp(magic, DIGEST_CACHE_MAGIC, DIGEST_CACHE_MAGIC_LEN) != 0 ||
+        fread(&entry_size, sizeof(entry_size), 1, file) != 1 ||
+        entry_size != sizeof(struct digest_cache_entry) ||
+        fread(&count, sizeof(count), 1, file) != 1 ||
+        count == 0 || count > SIZE_MAX / sizeof(struct digest_cache_entry) ||
+        (entries = malloc(count * sizeof(struct digest_cache_entry))) == NULL)
+        goto cleanup;
+
+    if (fread(entries, sizeof(struct digest_cache_entry), count, file) != count) {
+        free(entries);
+        goto cleanup;
+    }
+
+    free(digest_cache.entries);
+    digest_cache.entries = entries;
+    digest_cache.entries_len = count;
+    digest_cache.entries_alloc = count;
+
+    qsort(digest_cache.entries, digest_cache.entries_len,
+          sizeof(struct digest_cache_entry), digest_cache_compare_key);
+
+    for (size_t i = 0; i < digest_cache.entries_len; i++)
+        digest_cache.clock = MAX(digest_cache.clock, digest_cache.entries[i].used);
+
+    /* file may have been saved with a higher limit */
+    digest_cache_prune(digest_cache.max_entries);
+
+cleanup:
+    fclose(file);
+}
+
+/* Writes cache file, replacing the old one atomically. */
+int digest_cache_save(void)
+{
+    int error = DRPM_ERR_OK;
+    char *tmp_path;
+    int filedesc;
+    FILE *file = NULL;
+    const uint32_t entry_size = sizeof(struct digest_cache_entry);
+    uint64_t count;
+
+    digest_cache_prune(digest_cache.max_entries);
+    count = digest_cache.entries_len;
+
+    if ((tmp_path = malloc(strlen(digest_cache.path) + 8)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    sprintf(tmp_path, "%s.XXXXXX", digest_cache.path);
+
+    if ((filedesc = mkstemp(tmp_path)) < 0) {
+        free(tmp_path);
+        return DRPM_ERR_IO;
+    }
+
+    if ((file = fdopen(filedesc, "wb")) == NULL) {
+        close(filedesc);
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+
+    if (fwrite(DIGEST_CACHE_MAGIC, 1, DIGEST_CACHE_MAGIC_LEN, file) != DIGEST_CACHE_MAGIC_LEN ||
+        fwrite(&entry_size, sizeof(entry_size), 1, file) != 1 ||
+        fwrite(&count, sizeof(count), 1, file) != 1 ||
+        fwrite(digest_cache.entries, sizeof(struct digest_cache_entry), count, file) != count) {
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+
+    if (fclose(file) != 0) {
+        file = NULL;
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+    file = NULL;
+
+    if (rename(tmp_path, digest_cache.path) != 0) {
+        error = DRPM_ERR_IO;
+        goto cleanup;
+    }
+
+    digest_cache.dirty = false;
+
+cleanup:
+    if (file != NULL)
+        fclose(file);
+    if (error != DRPM_ERR_OK)
+        unlink(tmp_path);
+    free(tmp_path);
+
+    return error;
+}
+
+/* Looks up digest of the file with <stats> (as of before reading it).
+ * Sets <*found> and copies the digest to <digest> if it is cached. */
+void digest_cache_lookup(const struct stat *stats, unsigned short digest_algo,
+                         unsigned char *digest, bool *found)
+{
+    struct digest_cache_entry key;
+    struct digest_cache_entry *entry;
+    size_t pos;
+
+    *found = false;
+
+    pthread_mutex_lock(&digest_cache.mutex);
+
+    if (digest_cache.path == NULL)
+        goto cleanup;
+
+    if (!digest_cache.loaded)
+        digest_cache_load();
+
+    digest_cache_key(&key, stats, digest_algo);
+
+    if (!digest_cache_find(&key, &pos))
+        goto cleanup;
+
+    entry = digest_cache.entries + pos;
+
+    /* file changed since its digest was cached */
+    if (entry->size != key.size ||
+        entry->mtime_sec != key.mtime_sec || entry->mtime_nsec != key.mtime_nsec ||
+        entry->ctime_sec != key.ctime_sec || entry->ctime_nsec != key.ctime_nsec)
+        goto cleanup;
+
+    /* recency of hits is saved along with new digests only,
+     * so that checks of unchanged files do not rewrite the cache */
+    memcpy(digest, entry->digest, digest_len(digest_algo));
+    entry->used = ++digest_cache.clock;
+    *found = true;
+
+cleanup:
+    pthread_mutex_unlock(&digest_cache.mutex);
+}
+
+/* Stores <digest> of the file with <stats> (as of before reading it). */
+void digest_cache_store(const struct stat *stats, unsigned short digest_algo,
+                        const unsigned char *digest)
+{
+    struct digest_cache_entry entry;
+    struct digest_cache_entry *entries;
+    size_t entries_alloc;
+    size_t pos;
+
+    pthread_mutex_lock(&digest_cache.mutex);
+
+    if (digest_cache.path == NULL)
+        goto cleanup;
+
+    if (!digest_cache.loaded)
+        digest_cache_load();
+
+    digest_cache_key(&entry, stats, digest_algo);
+    memcpy(entry.digest, digest, digest_len(digest_algo));
+    entry.used = ++digest_cache.clock;
+
+    if (!digest_cache_find(&entry, &pos)) {
+        /* cache is allowed to grow past its limit until saved */
+        if (digest_cache.entries_len >= 2 * digest_cache.max_entries) {
+            digest_cache_prune(digest_cache.max_entries);
+            digest_cache_find(&entry, &pos);
+        }
+        if (digest_cache.entries_len == digest_cache.entries_alloc) {
+            entries_alloc = MAX(64, 2 * digest_cache.entries_alloc);
+            if ((entries = realloc(digest_cache.entries,
+                                   entries_alloc * sizeof(struct digest_cache_entry))) == NULL)
+                goto cleanup;
+            digest_cache.entries = entries;
+            digest_cache.entries_alloc = entries_alloc;
+        }
+        memmove(digest_cache.entries + pos + 1, digest_cache.entries + pos,
+                (digest_cache.entries_len - pos) * sizeof(struct digest_cache_entry));
+        digest_cache.entries_len++;
+    }
+
+    digest_cache.entries[pos] = entry;
+    digest_cache.dirty = true;
+
+cleanup:
+    pthread_mutex_unlock(&digest_cache.mutex);
+}
+
+/* saves cached digests if any have been added */
+int digest_cache_flush(void)
+{
+    int error = DRPM_ERR_OK;
+
+    pthread_mutex_lock(&digest_cache.mutex);
+    if (digest_cache.path != NULL && digest_cache.dirty)
+        error = digest_cache_save();
+    pthread_mutex_unlock(&digest_cache.mutex);
+
+    return error;
+}
+
+int drpm_set_digest_cache(const char *path, size_t max_entries)
+{
+    int error = DRPM_ERR_OK;
+    char *path_copy = NULL;
+
+    if (path != NULL && (path_copy = malloc(strlen(path) + 1)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if (path != NULL)
+        strcpy(path_copy, path);
+
+    pthread_mutex_lock(&digest_cache.mutex);
+
+    if (digest_cache.path != NULL && digest_cache.dirty)
+        error = digest_cache_save();
+
+    free(digest_cache.path);
+    free(digest_cache.entries);
+
+    digest_cache.path = path_copy;
+    digest_cache.max_entries = (max_entries > 0) ? max_entries : DIGEST_CACHE_MAX_DEFAULT;
+    digest_cache.loaded = false;
+    digest_cache.dirty = false;
+    digest_cache.clock = 0;
+    digest_cache.entries = NULL;
+    digest_cache.entries_len = 0;
+    digest_cache.entries_alloc = 0;
+
+    pthread_mutex_unlock(&digest_cache.mutex);
+
+    return error;
+}
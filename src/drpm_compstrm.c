@@ -36,12 +36,13 @@
 #ifdef WITH_ZSTD
 #include <zstd.h>
 #endif
+#include <openssl/md5.h>
 
 struct compstrm {
     unsigned char *data;
     size_t data_len;
     size_t data_pos;
-    int filedesc;
+    struct sink *sink;
     union {
         z_stream gzip;
         bz_stream bzip2;
@@ -56,11 +57,13 @@ struct compstrm {
     int (*write_chunk)(struct compstrm *, size_t, const void *);
     int (*finish)(struct compstrm *);
     bool finished;
+    struct digest *md5;
 };
 
 static int finish_bzip2(struct compstrm *);
 static int finish_gzip(struct compstrm *);
 static int finish_lzma(struct compstrm *);
+static int flush(struct compstrm *);
 static int init_bzip2(struct compstrm *, int);
 static int init_gzip(struct compstrm *, int);
 static int init_lzma(struct compstrm *, int);
@@ -97,6 +100,32 @@ static int init_zstd(struct compstrm *, int);
 static int writechunk_zstd(struct compstrm *, size_t, const void *);
 #endif
 
+/* Writes newly compressed data to sink (if any) and updates MD5.
+ * Data is only kept in memory if neither written nor hashed. */
+int flush(struct compstrm *strm)
+{
+    int error;
+    size_t comp_write_len = strm->data_len - strm->data_pos;
+
+    if (comp_write_len == 0)
+        return DRPM_ERR_OK;
+
+    if (strm->sink != NULL &&
+        (error = sink_write(strm->sink, strm->data + strm->data_pos, comp_write_len)) != DRPM_ERR_OK)
+        return error;
+
+    if (strm->md5 != NULL &&
+        (error = digest_update(strm->md5, strm->data + strm->data_pos, comp_write_len)) != DRPM_ERR_OK)
+        return error;
+
+    if (strm->sink != NULL || strm->md5 != NULL)
+        strm->data_len = 0;
+
+    strm->data_pos = strm->data_len;
+
+    return DRPM_ERR_OK;
+}
+
 /* Functions for finishing compression for individual methods. */
 
 int finish_bzip2(struct compstrm *strm)
@@ -433,8 +462,11 @@ int compstrm_destroy(struct compstrm **strm)
 
 /* Initializes compression stream.
  * The compression method will be <comp> and the compression level will be <level>.
- * If <filedesc> is valid, compressed data will be written to the file. */
-int compstrm_init(struct compstrm **strm, int filedesc, unsigned short comp, int level)
+ * If <sink> is not NULL, compressed data will be written to it.
+ * If <md5> is not NULL, compressed data will be used to update the MD5
+ * digest as it is written.
+ * Compressed data is only kept for compstrm_finish() if neither is given. */
+int compstrm_init(struct compstrm **strm, struct sink *sink, unsigned short comp, int level, struct digest *md5)
 {
     int error;
 
@@ -447,8 +479,9 @@ int compstrm_init(struct compstrm **strm, int filedesc, unsigned short comp, int
     (*strm)->data = NULL;
     (*strm)->data_len = 0;
     (*strm)->data_pos = 0;
-    (*strm)->filedesc = filedesc;
+    (*strm)->sink = sink;
     (*strm)->finished = false;
+    (*strm)->md5 = md5;
 
     switch (comp) {
     case DRPM_COMP_NONE:
@@ -502,10 +535,10 @@ cleanup_fail:
 int compstrm_finish(struct compstrm *strm, unsigned char **data, size_t *data_len)
 {
     int error;
-    size_t comp_write_len;
     const bool copy_data = (data != NULL && data_len != NULL);
 
-    if (strm == NULL || strm->finished)
+    if (strm == NULL || strm->finished ||
+        (copy_data && (strm->sink != NULL || strm->md5 != NULL)))
         return DRPM_ERR_PROG;
 
     if (copy_data) {
@@ -514,13 +547,9 @@ int compstrm_finish(struct compstrm *strm, unsigned char **data, size_t *data_le
     }
 
     if (strm->finish != NULL) {
-        if ((error = strm->finish(strm)) != DRPM_ERR_OK)
+        if ((error = strm->finish(strm)) != DRPM_ERR_OK ||
+            (error = flush(strm)) != DRPM_ERR_OK)
             return error;
-        comp_write_len = strm->data_len - strm->data_pos;
-        if (strm->filedesc >= 0 && comp_write_len > 0 &&
-            write(strm->filedesc, strm->data + strm->data_pos,
-                  comp_write_len) != (ssize_t)comp_write_len)
-                return DRPM_ERR_IO;
     }
 
     strm->finished = true;
@@ -563,7 +592,6 @@ int compstrm_write_be64(struct compstrm *strm, uint64_t number)
 int compstrm_write(struct compstrm *strm, size_t write_len, const void *buffer)
 {
     int error;
-    size_t comp_write_len;
 
     if (strm == NULL || strm->finished)
         return DRPM_ERR_PROG;
@@ -577,17 +605,7 @@ int compstrm_write(struct compstrm *strm, size_t write_len, const void *buffer)
     if ((error = strm->write_chunk(strm, write_len, buffer)) != DRPM_ERR_OK)
         return error;
 
-    comp_write_len = strm->data_len - strm->data_pos;
-
-    if (strm->filedesc >= 0 && comp_write_len > 0) {
-        if (write(strm->filedesc, strm->data + strm->data_pos,
-                  comp_write_len) != (ssize_t)comp_write_len)
-            return DRPM_ERR_IO;
-    }
-
-    strm->data_pos = strm->data_len;
-
-    return DRPM_ERR_OK;
+    return flush(strm);
 }
 
 /* Functions for compressing input data using individual methods. */
@@ -67,7 +67,7 @@ struct decompstrm {
     int (*read_chunk)(struct decompstrm *);
     void (*finish)(struct decompstrm *);
     size_t comp_size;
-    MD5_CTX *md5;
+    struct digest *md5;
     const unsigned char *buffer;
     size_t buffer_len;
 };
@@ -258,10 +258,10 @@ int decompstrm_destroy(struct decompstrm **strm)
 
 /* Initializes decompression stream.
  * The detected compression method will be stored in <*comp> (if not NULL).
- * If <md5> is not NULL, input data will be used to update the MD5 context.
+ * If <md5> is not NULL, input data will be used to update the MD5 digest.
  * If <filedesc> is valid, compressed data will be read from the file.
  * Otherwise, input data is read from <buffer> of size <buffer_len>. */
-int decompstrm_init(struct decompstrm **strm, int filedesc, unsigned short *comp, MD5_CTX *md5,
+int decompstrm_init(struct decompstrm **strm, int filedesc, unsigned short *comp, struct digest *md5,
                     const unsigned char *buffer, size_t buffer_len)
 {
     uint64_t magic;
@@ -384,25 +384,68 @@ int decompstrm_read_be64(struct decompstrm *strm, uint64_t *buffer_ret)
     return DRPM_ERR_OK;
 }
 
-/* Decompresses enough data to store <read_len> bytes at <buffer_ret>. */
+/* Decompresses enough data to store <read_len> bytes at <buffer_ret>.
+ * Data is decompressed chunk by chunk and discarded once consumed,
+ * so that memory use does not depend on the size of the stream. */
 int decompstrm_read(struct decompstrm *strm, size_t read_len, void *buffer_ret)
 {
+    unsigned char *buffer = buffer_ret;
+    size_t len;
     int error;
 
     if (strm == NULL)
         return DRPM_ERR_PROG;
 
-    if (UNSIGNED_SUM_OVERFLOWS(strm->data_len, read_len))
-        return DRPM_ERR_OVERFLOW;
+    while (read_len > 0) {
+        if (strm->data_pos == strm->data_len) {
+            strm->data_pos = 0;
+            strm->data_len = 0;
+            if ((error = strm->read_chunk(strm)) != DRPM_ERR_OK)
+                return error;
+            continue;
+        }
 
-    while (strm->data_pos + read_len > strm->data_len)
-        if ((error = strm->read_chunk(strm)) != DRPM_ERR_OK)
-            return error;
+        len = MIN(read_len, strm->data_len - strm->data_pos);
+
+        if (buffer != NULL) {
+            memcpy(buffer, strm->data + strm->data_pos, len);
+            buffer += len;
+        }
+
+        strm->data_pos += len;
+        read_len -= len;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* Reads at most <max_len> bytes to <buffer_ret>, storing the number
+ * of bytes read in <*read_len_ret> (zero at the end of the stream). */
+int decompstrm_read_partial(struct decompstrm *strm, size_t max_len,
+                            void *buffer_ret, size_t *read_len_ret)
+{
+    int error;
+
+    if (strm == NULL || buffer_ret == NULL || read_len_ret == NULL)
+        return DRPM_ERR_PROG;
 
-    if (buffer_ret != NULL)
-        memcpy(buffer_ret, strm->data + strm->data_pos, read_len);
+    while (strm->data_pos == strm->data_len) {
+        strm->data_pos = 0;
+        strm->data_len = 0;
+        switch ((error = strm->read_chunk(strm))) {
+        case DRPM_ERR_OK:
+            break;
+        case DRPM_ERR_FORMAT: // nothing more to read
+            *read_len_ret = 0;
+            return DRPM_ERR_OK;
+        default:
+            return error;
+        }
+    }
 
-    strm->data_pos += read_len;
+    *read_len_ret = MIN(max_len, strm->data_len - strm->data_pos);
+    memcpy(buffer_ret, strm->data + strm->data_pos, *read_len_ret);
+    strm->data_pos += *read_len_ret;
 
     return DRPM_ERR_OK;
 }
@@ -476,9 +519,9 @@ int readchunk(struct decompstrm *strm)
     memcpy(strm->data + strm->data_len, buffer, in_len);
     strm->data_len += in_len;
 
-    strm->comp_size = strm->data_len;
+    strm->comp_size += in_len;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, buffer, in_len) != 1)
+    if (strm->md5 != NULL && digest_update(strm->md5, buffer, in_len) != DRPM_ERR_OK)
         return DRPM_ERR_OTHER;
 
     return DRPM_ERR_OK;
@@ -531,7 +574,7 @@ int readchunk_bzip2(struct decompstrm *strm)
 
     strm->comp_size += in_len;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
+    if (strm->md5 != NULL && digest_update(strm->md5, in_buffer, in_len) != DRPM_ERR_OK)
         return DRPM_ERR_OTHER;
 
     return DRPM_ERR_OK;
@@ -585,7 +628,7 @@ int readchunk_gzip(struct decompstrm *strm)
 
     strm->comp_size += in_len;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
+    if (strm->md5 != NULL && digest_update(strm->md5, in_buffer, in_len) != DRPM_ERR_OK)
         return DRPM_ERR_OTHER;
 
     return DRPM_ERR_OK;
@@ -645,7 +688,7 @@ int readchunk_lzma(struct decompstrm *strm)
 
     strm->comp_size += in_len;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
+    if (strm->md5 != NULL && digest_update(strm->md5, in_buffer, in_len) != DRPM_ERR_OK)
         return DRPM_ERR_OTHER;
 
     return DRPM_ERR_OK;
@@ -722,7 +765,7 @@ int readchunk_lzip(struct decompstrm *strm)
 
     strm->comp_size += in_len;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
+    if (strm->md5 != NULL && digest_update(strm->md5, in_buffer, in_len) != DRPM_ERR_OK)
         return DRPM_ERR_OTHER;
 
     return DRPM_ERR_OK;
@@ -772,7 +815,7 @@ int readchunk_zstd(struct decompstrm *strm)
 
     strm->comp_size += in_len;
 
-    if (strm->md5 != NULL && MD5_Update(strm->md5, in_buffer, in_len) != 1)
+    if (strm->md5 != NULL && digest_update(strm->md5, in_buffer, in_len) != DRPM_ERR_OK)
         return DRPM_ERR_OTHER;
 
     free(buffOut);
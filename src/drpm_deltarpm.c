@@ -22,8 +22,10 @@
 #include "drpm.h"
 #include "drpm_private.h"
 
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 #define DELTARPM_COMP_UN 0
 #define DELTARPM_COMP_GZ 1
@@ -134,5 +136,10 @@ void free_deltarpm(struct deltarpm *delta)
     else
         free(delta->int_data.bytes);
 
+    if (delta->int_data_strm != NULL) {
+        decompstrm_destroy(&delta->int_data_strm);
+        close(delta->int_data_filedesc);
+    }
+
     *delta = delta_init;
 }
@@ -128,7 +128,7 @@ int make_diff(const unsigned char *old, size_t old_len,
     if ((error = hash_create(&hashtab, old, old_len)) != DRPM_ERR_OK)
         goto cleanup_fail;
 
-    if (addblk && (error = compstrm_init(&stream, -1, add_block_comp, add_block_comp_level)) != DRPM_ERR_OK)
+    if (addblk && (error = compstrm_init(&stream, NULL, add_block_comp, add_block_comp_level, NULL)) != DRPM_ERR_OK)
         goto cleanup_fail;
 
     while (new_pos_prev < new_len) {
@@ -233,8 +233,7 @@ int make_diff(const unsigned char *old, size_t old_len,
         if (addblk) {
             while (len_forward > 0) {
                 write_len = MIN(len_forward, BUFFER_SIZE);
-                for (i = 0; i < write_len; i++)
-                    buffer[i] = new[new_pos_prev + i] - old[old_pos_prev + i];
+                bytes_sub(buffer, new + new_pos_prev, old + old_pos_prev, write_len);
                 if ((error = compstrm_write(stream, write_len, buffer)) != DRPM_ERR_OK)
                     goto cleanup_fail;
                 old_pos_prev += write_len;
@@ -0,0 +1,136 @@
+/*
+    Copyright (C) 2016 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdlib.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+/* several digests of the same data are computed over chunks small
+ * enough to still be in cache when passed to the next algorithm */
+#define DIGEST_CHUNK_SIZE (1 << 16)
+
+static const EVP_MD *digest_md(unsigned short);
+
+const EVP_MD *digest_md(unsigned short digest_algo)
+{
+    switch (digest_algo) {
+    case DIGESTALGO_MD5:
+        return EVP_md5();
+    case DIGESTALGO_SHA256:
+        return EVP_sha256();
+    default:
+        return NULL;
+    }
+}
+
+/* Starts computing digests of algorithms in <algos> (see DIGEST_MASK).
+ * May be called again to start further algorithms, which then only
+ * cover data fed from that point on. <dgst> must be zero-initialized.
+ * Uses EVP, which picks hardware-accelerated implementations. */
+int digest_init(struct digest *dgst, unsigned algos)
+{
+    if (dgst == NULL || algos == 0 || algos >= DIGEST_MASK(DIGESTALGO_COUNT))
+        return DRPM_ERR_PROG;
+
+    for (unsigned short algo = 0; algo < DIGESTALGO_COUNT; algo++)
+        if ((algos & DIGEST_MASK(algo)) != 0 && dgst->ctx[algo] != NULL)
+            return DRPM_ERR_PROG;
+
+    for (unsigned short algo = 0; algo < DIGESTALGO_COUNT; algo++) {
+        if ((algos & DIGEST_MASK(algo)) == 0)
+            continue;
+        if ((dgst->ctx[algo] = EVP_MD_CTX_new()) == NULL) {
+            digest_destroy(dgst);
+            return DRPM_ERR_MEMORY;
+        }
+        if (EVP_DigestInit_ex(dgst->ctx[algo], digest_md(algo), NULL) != 1) {
+            digest_destroy(dgst);
+            return DRPM_ERR_OTHER;
+        }
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* feeds <len> bytes of <buf> to all digests in a single pass */
+int digest_update(struct digest *dgst, const void *buf, size_t len)
+{
+    const unsigned char *data = buf;
+    size_t chunk_len;
+
+    if (dgst == NULL || (buf == NULL && len > 0))
+        return DRPM_ERR_PROG;
+
+    for (size_t off = 0; off < len; off += chunk_len) {
+        chunk_len = MIN(len - off, DIGEST_CHUNK_SIZE);
+        for (unsigned short algo = 0; algo < DIGESTALGO_COUNT; algo++)
+            if (dgst->ctx[algo] != NULL &&
+                EVP_DigestUpdate(dgst->ctx[algo], data + off, chunk_len) != 1)
+                return DRPM_ERR_OTHER;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* feeds <number> in network byte order to digests */
+int digest_update_be32(struct digest *dgst, uint32_t number)
+{
+    unsigned char be32[4];
+
+    create_be32(number, be32);
+
+    return digest_update(dgst, be32, 4);
+}
+
+/* Writes digest of <digest_algo> to <digest>. Other digests
+ * may still be updated and finalized afterwards. */
+int digest_final(struct digest *dgst, unsigned short digest_algo, unsigned char *digest)
+{
+    int error = DRPM_ERR_OK;
+
+    if (dgst == NULL || digest == NULL || digest_algo >= DIGESTALGO_COUNT ||
+        dgst->ctx[digest_algo] == NULL)
+        return DRPM_ERR_PROG;
+
+    if (EVP_DigestFinal_ex(dgst->ctx[digest_algo], digest, NULL) != 1)
+        error = DRPM_ERR_OTHER;
+
+    EVP_MD_CTX_free(dgst->ctx[digest_algo]);
+    dgst->ctx[digest_algo] = NULL;
+
+    return error;
+}
+
+/* frees digests that have not been finalized */
+void digest_destroy(struct digest *dgst)
+{
+    if (dgst == NULL)
+        return;
+
+    for (unsigned short algo = 0; algo < DIGESTALGO_COUNT; algo++) {
+        EVP_MD_CTX_free(dgst->ctx[algo]);
+        dgst->ctx[algo] = NULL;
+    }
+}
+
+size_t digest_len(unsigned short digest_algo)
+{
+    return digest_algo == DIGESTALGO_MD5 ? MD5_DIGEST_LENGTH : SHA256_DIGEST_LENGTH;
+}
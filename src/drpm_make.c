@@ -302,7 +302,7 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
 
     unsigned char *sequence = NULL;
     uint32_t sequence_len;
-    MD5_CTX seq_md5;
+    struct digest seq_md5 = {0};
     unsigned char seq_md5_digest[MD5_DIGEST_LENGTH];
     struct files_seq seq = SEQ_INIT;
     unsigned char *seq_files = NULL;
@@ -329,8 +329,8 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
         *offadjn_ret = 0;
     }
 
-    if (MD5_Init(&seq_md5) != 1)
-        return DRPM_ERR_OTHER;
+    if ((error = digest_init(&seq_md5, DIGEST_MASK(DIGESTALGO_MD5))) != DRPM_ERR_OK)
+        return error;
 
     if ((error = rpm_get_file_info(rpm_file, &files, &file_count, &file_colors)) != DRPM_ERR_OK ||
         (error = rpm_get_digest_algo(rpm_file, &digest_algo)) != DRPM_ERR_OK)
@@ -481,23 +481,19 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
                                      CPIO_PADDING(CPIO_HEADER_SIZE + cpio_hdr.namesize))) != DRPM_ERR_OK)
                 goto cleanup_fail;
 
-            if (MD5_Update(&seq_md5, name, name_len) != 1 ||
-                md5_update_be32(&seq_md5, cpio_hdr.mode) != 1 ||
-                md5_update_be32(&seq_md5, cpio_hdr.filesize) != 1 ||
-                md5_update_be32(&seq_md5, makedev(cpio_hdr.rdevmajor,
-                                                  cpio_hdr.rdevminor)) != 1) {
-                error = DRPM_ERR_OTHER;
+            if ((error = digest_update(&seq_md5, name, name_len)) != DRPM_ERR_OK ||
+                (error = digest_update_be32(&seq_md5, cpio_hdr.mode)) != DRPM_ERR_OK ||
+                (error = digest_update_be32(&seq_md5, cpio_hdr.filesize)) != DRPM_ERR_OK ||
+                (error = digest_update_be32(&seq_md5, makedev(cpio_hdr.rdevmajor,
+                                                              cpio_hdr.rdevminor))) != DRPM_ERR_OK)
                 goto cleanup_fail;
-            }
 
             if (S_ISLNK(file.mode)) {
                 if ((error = cpio_extend(&cpio, &cpio_len, file.linkto, cpio_hdr.filesize)) != DRPM_ERR_OK ||
                     (error = cpio_extend(&cpio, &cpio_len, "\0\0\0", CPIO_PADDING(cpio_hdr.filesize))) != DRPM_ERR_OK)
                     goto cleanup_fail;
-                if (MD5_Update(&seq_md5, file.linkto, cpio_hdr.filesize + 1) != 1) {
-                    error = DRPM_ERR_OTHER;
+                if ((error = digest_update(&seq_md5, file.linkto, cpio_hdr.filesize + 1)) != DRPM_ERR_OK)
                     goto cleanup_fail;
-                }
             } else if (S_ISREG(file.mode) && cpio_hdr.filesize) {
                 switch (digest_algo) {
                 case DIGESTALGO_MD5:
@@ -505,20 +501,16 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
                         error = DRPM_ERR_FORMAT;
                         goto cleanup_fail;
                     }
-                    if (MD5_Update(&seq_md5, digest, MD5_DIGEST_LENGTH) != 1) {
-                        error = DRPM_ERR_OTHER;
+                    if ((error = digest_update(&seq_md5, digest, MD5_DIGEST_LENGTH)) != DRPM_ERR_OK)
                         goto cleanup_fail;
-                    }
                     break;
                 case DIGESTALGO_SHA256:
                     if (!parse_sha256(digest, file.md5)) {
                         error = DRPM_ERR_FORMAT;
                         goto cleanup_fail;
                     }
-                    if (MD5_Update(&seq_md5, digest, SHA256_DIGEST_LENGTH) != 1) {
-                        error = DRPM_ERR_OTHER;
+                    if ((error = digest_update(&seq_md5, digest, SHA256_DIGEST_LENGTH)) != DRPM_ERR_OK)
                         goto cleanup_fail;
-                    }
                     break;
                 }
             }
@@ -572,10 +564,8 @@ int parse_cpio_from_rpm_filedata(struct rpm *rpm_file,
     if ((error = seq_final(&seq, &seq_files, &seq_files_len)) != DRPM_ERR_OK)
         goto cleanup_fail;
 
-    if (MD5_Final(seq_md5_digest, &seq_md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    if ((error = digest_final(&seq_md5, DIGESTALGO_MD5, seq_md5_digest)) != DRPM_ERR_OK)
         goto cleanup_fail;
-    }
 
     sequence_len = MD5_DIGEST_LENGTH + seq_files_len;
     if ((sequence = malloc(sequence_len)) == NULL) {
@@ -604,6 +594,7 @@ cleanup_fail:
         free(offadjs);
 
 cleanup:
+    digest_destroy(&seq_md5);
     for (size_t i = 0; i < file_count; i++) {
         free(files[i].name);
         free(files[i].md5);
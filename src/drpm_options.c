@@ -283,3 +283,154 @@ int drpm_make_options_set_memlimit(struct drpm_make_options *opts, unsigned mbyt
 
     return DRPM_ERR_OK;
 }
+
+int drpm_apply_options_init(struct drpm_apply_options **opts)
+{
+    const struct drpm_apply_options init = {0};
+
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    if ((*opts = malloc(sizeof(struct drpm_apply_options))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    **opts = init;
+
+    drpm_apply_options_defaults(*opts);
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_destroy(struct drpm_apply_options **opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    free((*opts)->spill_dir);
+    free(*opts);
+    *opts = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_defaults(struct drpm_apply_options *opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    free(opts->spill_dir);
+
+    opts->spill_dir = NULL;
+    opts->spill_comp = DRPM_COMP_NONE;
+    opts->planned = false;
+    opts->pipelined = false;
+    opts->uncompressed = false;
+    opts->direct_io = false;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_copy(struct drpm_apply_options *opts_dst, const struct drpm_apply_options *opts_src)
+{
+    if (opts_dst == NULL || opts_src == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts_dst->spill_comp = opts_src->spill_comp;
+    opts_dst->planned = opts_src->planned;
+    opts_dst->pipelined = opts_src->pipelined;
+    opts_dst->uncompressed = opts_src->uncompressed;
+    opts_dst->direct_io = opts_src->direct_io;
+
+    free(opts_dst->spill_dir);
+    opts_dst->spill_dir = NULL;
+
+    if (opts_src->spill_dir != NULL) {
+        if ((opts_dst->spill_dir = malloc(strlen(opts_src->spill_dir) + 1)) == NULL)
+            return DRPM_ERR_MEMORY;
+        strcpy(opts_dst->spill_dir, opts_src->spill_dir);
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_spill_dir(struct drpm_apply_options *opts, const char *dir)
+{
+    char *tmp;
+
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    if (dir == NULL) {
+        free(opts->spill_dir);
+        opts->spill_dir = NULL;
+    } else {
+        if (opts->spill_dir == NULL || strlen(opts->spill_dir) < strlen(dir)) {
+            if ((tmp = realloc(opts->spill_dir, strlen(dir) + 1)) == NULL)
+                return DRPM_ERR_MEMORY;
+            opts->spill_dir = tmp;
+        }
+        strcpy(opts->spill_dir, dir);
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_set_spill_comp(struct drpm_apply_options *opts, unsigned short comp)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    switch (comp) {
+    case DRPM_COMP_NONE:
+    case DRPM_COMP_GZIP:
+#ifdef WITH_ZSTD
+    case DRPM_COMP_ZSTD:
+#endif
+        opts->spill_comp = comp;
+        break;
+    default:
+        return DRPM_ERR_ARGS;
+    }
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_plan_reads(struct drpm_apply_options *opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->planned = true;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_use_pipeline(struct drpm_apply_options *opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->pipelined = true;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_uncompressed_payload(struct drpm_apply_options *opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->uncompressed = true;
+
+    return DRPM_ERR_OK;
+}
+
+int drpm_apply_options_use_direct_io(struct drpm_apply_options *opts)
+{
+    if (opts == NULL)
+        return DRPM_ERR_ARGS;
+
+    opts->direct_io = true;
+
+    return DRPM_ERR_OK;
+}
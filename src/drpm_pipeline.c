@@ -0,0 +1,365 @@
+/*
+    Copyright (C) 2016 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#define PIPELINE_BUFFERS 4
+#define PIPELINE_BUFFER_SIZE (1 << 18)
+
+/* A pipeline stage running in its own thread, connected to the calling
+ * thread by a bounded queue of large buffers.
+ * A writer stage consumes buffers filled by the caller and feeds them
+ * to a compression stream wrapper, a reader stage fills buffers from
+ * a decompression stream for the caller to consume.
+ * If not threaded, data is passed through synchronously. */
+struct pipeline {
+    bool threaded;
+    bool thread_running;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned char *buffers[PIPELINE_BUFFERS];
+    size_t lens[PIPELINE_BUFFERS];
+    size_t head;
+    size_t filled;
+    bool eof;
+    bool cancel;
+    int error;
+    /* caller's position within the buffer it is filling or consuming */
+    size_t pos;
+    struct compstrm_wrapper *csw;
+    struct decompstrm *strm;
+    uint64_t left;
+};
+
+static int pipeline_init(struct pipeline **, struct pipeline *, void *(*)(void *));
+static void *reader_thread(void *);
+static void *writer_thread(void *);
+
+/* consumes filled buffers, writing them to compression stream */
+void *writer_thread(void *arg)
+{
+    struct pipeline *pl = arg;
+    size_t index;
+    int error;
+
+    pthread_mutex_lock(&pl->mutex);
+
+    while (true) {
+        while (pl->filled == 0 && !pl->eof && !pl->cancel)
+            pthread_cond_wait(&pl->cond, &pl->mutex);
+
+        if (pl->cancel || pl->filled == 0)
+            break;
+
+        index = pl->head;
+
+        pthread_mutex_unlock(&pl->mutex);
+        error = compstrm_wrapper_write(pl->csw, pl->buffers[index], pl->lens[index]);
+        pthread_mutex_lock(&pl->mutex);
+
+        if (error != DRPM_ERR_OK) {
+            pl->error = error;
+            pthread_cond_broadcast(&pl->cond);
+            break;
+        }
+
+        pl->head = (pl->head + 1) % PIPELINE_BUFFERS;
+        pl->filled--;
+        pthread_cond_broadcast(&pl->cond);
+    }
+
+    pthread_mutex_unlock(&pl->mutex);
+
+    return NULL;
+}
+
+/* fills empty buffers with data from decompression stream */
+void *reader_thread(void *arg)
+{
+    struct pipeline *pl = arg;
+    size_t index;
+    size_t len;
+    int error;
+
+    pthread_mutex_lock(&pl->mutex);
+
+    while (true) {
+        while (pl->filled == PIPELINE_BUFFERS && !pl->cancel)
+            pthread_cond_wait(&pl->cond, &pl->mutex);
+
+        if (pl->cancel)
+            break;
+
+        if (pl->left == 0) {
+            pl->eof = true;
+            pthread_cond_broadcast(&pl->cond);
+            break;
+        }
+
+        index = (pl->head + pl->filled) % PIPELINE_BUFFERS;
+        len = MIN(pl->left, PIPELINE_BUFFER_SIZE);
+
+        pthread_mutex_unlock(&pl->mutex);
+        error = decompstrm_read(pl->strm, len, pl->buffers[index]);
+        pthread_mutex_lock(&pl->mutex);
+
+        if (error != DRPM_ERR_OK) {
+            pl->error = error;
+            pthread_cond_broadcast(&pl->cond);
+            break;
+        }
+
+        pl->lens[index] = len;
+        pl->left -= len;
+        pl->filled++;
+        pthread_cond_broadcast(&pl->cond);
+    }
+
+    pthread_mutex_unlock(&pl->mutex);
+
+    return NULL;
+}
+
+/* allocates stage, starts <routine> in a new thread if <threaded> */
+int pipeline_init(struct pipeline **pl_ret, struct pipeline *init, void *(*routine)(void *))
+{
+    struct pipeline *pl;
+
+    if ((pl = malloc(sizeof(struct pipeline))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    *pl = *init;
+    *pl_ret = pl;
+
+    if (!pl->threaded)
+        return DRPM_ERR_OK;
+
+    for (unsigned short i = 0; i < PIPELINE_BUFFERS; i++)
+        if ((pl->buffers[i] = malloc(PIPELINE_BUFFER_SIZE)) == NULL)
+            return DRPM_ERR_MEMORY;
+
+    if (pthread_mutex_init(&pl->mutex, NULL) != 0)
+        return DRPM_ERR_OTHER;
+
+    if (pthread_cond_init(&pl->cond, NULL) != 0) {
+        pthread_mutex_destroy(&pl->mutex);
+        return DRPM_ERR_OTHER;
+    }
+
+    if (pthread_create(&pl->thread, NULL, routine, pl) != 0) {
+        pthread_cond_destroy(&pl->cond);
+        pthread_mutex_destroy(&pl->mutex);
+        return DRPM_ERR_OTHER;
+    }
+
+    pl->thread_running = true;
+
+    return DRPM_ERR_OK;
+}
+
+/* Creates a stage feeding data written with pipeline_write()
+ * to <csw> (in a separate thread if <threaded>). */
+int pipeline_writer_init(struct pipeline **pl_ret, struct compstrm_wrapper *csw, bool threaded)
+{
+    struct pipeline init = {
+        .threaded = threaded,
+        .csw = csw
+    };
+
+    if (pl_ret == NULL || csw == NULL)
+        return DRPM_ERR_PROG;
+
+    return pipeline_init(pl_ret, &init, writer_thread);
+}
+
+/* Creates a stage reading <len> bytes from <strm> ahead of
+ * pipeline_read() calls (in a separate thread if <threaded>). */
+int pipeline_reader_init(struct pipeline **pl_ret, struct decompstrm *strm, uint64_t len, bool threaded)
+{
+    struct pipeline init = {
+        .threaded = threaded,
+        .strm = strm,
+        .left = len
+    };
+
+    if (pl_ret == NULL || strm == NULL)
+        return DRPM_ERR_PROG;
+
+    return pipeline_init(pl_ret, &init, reader_thread);
+}
+
+/* stops thread and frees stage */
+int pipeline_destroy(struct pipeline **pl_ref)
+{
+    struct pipeline *pl;
+
+    if (pl_ref == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((pl = *pl_ref) == NULL)
+        return DRPM_ERR_OK;
+
+    if (pl->thread_running) {
+        pthread_mutex_lock(&pl->mutex);
+        pl->cancel = true;
+        pthread_cond_broadcast(&pl->cond);
+        pthread_mutex_unlock(&pl->mutex);
+        pthread_join(pl->thread, NULL);
+        pthread_cond_destroy(&pl->cond);
+        pthread_mutex_destroy(&pl->mutex);
+    }
+
+    for (unsigned short i = 0; i < PIPELINE_BUFFERS; i++)
+        free(pl->buffers[i]);
+
+    free(pl);
+    *pl_ref = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+/* queues <len> bytes of <data> for writer stage */
+int pipeline_write(struct pipeline *pl, const void *data, size_t len)
+{
+    const unsigned char *ptr = data;
+    size_t index;
+    size_t write_len;
+    int error;
+
+    if (pl == NULL || (data == NULL && len > 0))
+        return DRPM_ERR_PROG;
+
+    if (!pl->threaded)
+        return compstrm_wrapper_write(pl->csw, data, len);
+
+    while (len > 0) {
+        pthread_mutex_lock(&pl->mutex);
+        while (pl->filled == PIPELINE_BUFFERS && pl->error == DRPM_ERR_OK)
+            pthread_cond_wait(&pl->cond, &pl->mutex);
+        error = pl->error;
+        index = (pl->head + pl->filled) % PIPELINE_BUFFERS;
+        pthread_mutex_unlock(&pl->mutex);
+
+        if (error != DRPM_ERR_OK)
+            return error;
+
+        write_len = MIN(len, PIPELINE_BUFFER_SIZE - pl->pos);
+        memcpy(pl->buffers[index] + pl->pos, ptr, write_len);
+        pl->pos += write_len;
+        ptr += write_len;
+        len -= write_len;
+
+        if (pl->pos == PIPELINE_BUFFER_SIZE) {
+            pthread_mutex_lock(&pl->mutex);
+            pl->lens[index] = pl->pos;
+            pl->filled++;
+            pthread_cond_broadcast(&pl->cond);
+            pthread_mutex_unlock(&pl->mutex);
+            pl->pos = 0;
+        }
+    }
+
+    return DRPM_ERR_OK;
+}
+
+/* flushes queued data and waits until writer stage has written it */
+int pipeline_finish(struct pipeline *pl)
+{
+    int error;
+
+    if (pl == NULL)
+        return DRPM_ERR_PROG;
+
+    if (!pl->thread_running)
+        return DRPM_ERR_OK;
+
+    pthread_mutex_lock(&pl->mutex);
+    /* a reader stage is simply stopped */
+    if (pl->strm != NULL)
+        pl->cancel = true;
+    if (pl->pos > 0 && pl->csw != NULL) {
+        pl->lens[(pl->head + pl->filled) % PIPELINE_BUFFERS] = pl->pos;
+        pl->filled++;
+        pl->pos = 0;
+    }
+    pl->eof = true;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->mutex);
+
+    pthread_join(pl->thread, NULL);
+    pl->thread_running = false;
+    pthread_cond_destroy(&pl->cond);
+    pthread_mutex_destroy(&pl->mutex);
+
+    error = pl->error;
+
+    return error;
+}
+
+/* reads <len> bytes from reader stage into <buffer> */
+int pipeline_read(struct pipeline *pl, size_t len, void *buffer)
+{
+    unsigned char *ptr = buffer;
+    size_t index;
+    size_t read_len;
+    size_t filled;
+    int error;
+
+    if (pl == NULL || (buffer == NULL && len > 0))
+        return DRPM_ERR_PROG;
+
+    if (!pl->threaded)
+        return decompstrm_read(pl->strm, len, buffer);
+
+    while (len > 0) {
+        pthread_mutex_lock(&pl->mutex);
+        while (pl->filled == 0 && !pl->eof && pl->error == DRPM_ERR_OK)
+            pthread_cond_wait(&pl->cond, &pl->mutex);
+        filled = pl->filled;
+        error = pl->error;
+        index = pl->head;
+        pthread_mutex_unlock(&pl->mutex);
+
+        if (filled == 0)
+            return (error != DRPM_ERR_OK) ? error : DRPM_ERR_FORMAT;
+
+        read_len = MIN(len, pl->lens[index] - pl->pos);
+        memcpy(ptr, pl->buffers[index] + pl->pos, read_len);
+        pl->pos += read_len;
+        ptr += read_len;
+        len -= read_len;
+
+        if (pl->pos == pl->lens[index]) {
+            pthread_mutex_lock(&pl->mutex);
+            pl->head = (pl->head + 1) % PIPELINE_BUFFERS;
+            pl->filled--;
+            pthread_cond_broadcast(&pl->cond);
+            pthread_mutex_unlock(&pl->mutex);
+            pl->pos = 0;
+        }
+    }
+
+    return DRPM_ERR_OK;
+}
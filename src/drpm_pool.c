@@ -0,0 +1,103 @@
+/*
+    Copyright (C) 2016 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Runs <count> independent tasks on a fixed number of threads.
+ * Tasks are handed out in index order, each to the first idle thread. */
+struct pool {
+    pthread_mutex_t mutex;
+    size_t next;
+    size_t count;
+    void (*func)(void *, size_t);
+    void *arg;
+};
+
+static void *pool_thread(void *);
+
+void *pool_thread(void *arg)
+{
+    struct pool *pool = arg;
+    size_t index;
+
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+        if ((index = pool->next) < pool->count)
+            pool->next++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (index >= pool->count)
+            break;
+
+        pool->func(pool->arg, index);
+    }
+
+    return NULL;
+}
+
+/* returns number of online processors (at least 1) */
+unsigned pool_default_workers(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (count > 0) ? (unsigned)count : 1;
+}
+
+/* Calls <func>(<arg>, i) for each i in [0, <count>) using up to <workers>
+ * threads, including the calling one (if 0, one per processor).
+ * If threads cannot be created, the remaining ones do all the work. */
+int pool_run(size_t count, unsigned workers, void (*func)(void *, size_t), void *arg)
+{
+    struct pool pool = {.next = 0, .count = count, .func = func, .arg = arg};
+    pthread_t *threads;
+    unsigned started = 0;
+
+    if (func == NULL)
+        return DRPM_ERR_PROG;
+
+    if (workers == 0)
+        workers = pool_default_workers();
+    if (workers > count)
+        workers = count;
+
+    if (workers <= 1 || pthread_mutex_init(&pool.mutex, NULL) != 0) {
+        for (size_t i = 0; i < count; i++)
+            func(arg, i);
+        return DRPM_ERR_OK;
+    }
+
+    if ((threads = malloc((workers - 1) * sizeof(pthread_t))) != NULL)
+        for (; started < workers - 1; started++)
+            if (pthread_create(&threads[started], NULL, pool_thread, &pool) != 0)
+                break;
+
+    pool_thread(&pool);
+
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&pool.mutex);
+    free(threads);
+
+    return DRPM_ERR_OK;
+}
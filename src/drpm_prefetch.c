@@ -0,0 +1,210 @@
+/*
+    Copyright (C) 2016 Red Hat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2.1 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "drpm.h"
+#include "drpm_private.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define PREFETCH_WINDOW (1 << 25)
+
+/* Reads installed files ahead of block filling in a separate thread.
+ * Files are opened (resolving their path and inode) and handed to
+ * kernel readahead (or restored if prelinked) in the order of the CPIO
+ * entries, staying at most PREFETCH_WINDOW bytes ahead of the entry
+ * currently being read.
+ * Only files with data needed for external copies are prefetched. */
+struct prefetch {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool cancel;
+    /* CPIO entry being read and next entry to be prefetched */
+    size_t cursor;
+    size_t next;
+    const struct cpio_file *cpio_files;
+    size_t cpio_files_len;
+    const struct file_info *files;
+    const bool *blocks_used;
+    size_t blocks_count;
+};
+
+static bool file_needed(const struct prefetch *, const struct cpio_file *);
+static void *prefetch_thread(void *);
+
+/* checks if any data of installed file is used by external copies */
+bool file_needed(const struct prefetch *pf, const struct cpio_file *cpio)
+{
+    uint64_t start;
+    uint64_t end;
+
+    if (cpio->index < 0 || !S_ISREG(pf->files[cpio->index].mode) ||
+        pf->files[cpio->index].size == 0)
+        return false;
+
+    start = cpio->offset + cpio->header_len;
+    end = start + MIN(cpio->content_len, pf->files[cpio->index].size);
+
+    for (size_t id = block_id(start); id <= block_id(end - 1) && id < pf->blocks_count; id++)
+        if (pf->blocks_used[id])
+            return true;
+
+    return false;
+}
+
+void *prefetch_thread(void *arg)
+{
+    struct prefetch *pf = arg;
+    const struct cpio_file *cpio;
+    int filedesc;
+    int undone;
+    struct stat stats;
+    unsigned char buf[128];
+    bool prelinked;
+
+    pthread_mutex_lock(&pf->mutex);
+
+    while (true) {
+        while (!pf->cancel && pf->next < pf->cpio_files_len &&
+               pf->cpio_files[pf->next].offset >= pf->cpio_files[pf->cursor].offset + PREFETCH_WINDOW)
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+
+        if (pf->cancel || pf->next >= pf->cpio_files_len)
+            break;
+
+        /* entries already read need no prefetching */
+        if (pf->next < pf->cursor)
+            pf->next = pf->cursor;
+
+        cpio = pf->cpio_files + pf->next++;
+
+        pthread_mutex_unlock(&pf->mutex);
+
+        if (file_needed(pf, cpio) &&
+            (filedesc = open(pf->files[cpio->index].name, O_RDONLY)) >= 0) {
+            /* prelinked files are restored ahead (the result is cached) */
+            if (fstat(filedesc, &stats) == 0 && stats.st_size != (off_t)pf->files[cpio->index].size &&
+                is_prelinked(&prelinked, filedesc, buf, pread(filedesc, buf, sizeof(buf), 0)) == DRPM_ERR_OK &&
+                prelinked) {
+                if (prelink_open(pf->files[cpio->index].name, &undone) == DRPM_ERR_OK)
+                    close(undone);
+            } else {
+                posix_fadvise(filedesc, 0, 0, POSIX_FADV_WILLNEED);
+            }
+            close(filedesc);
+        }
+
+        pthread_mutex_lock(&pf->mutex);
+    }
+
+    pthread_mutex_unlock(&pf->mutex);
+
+    return NULL;
+}
+
+/* Starts prefetching installed files of <cpio_files>.
+ * <blocks_used> tells which of <blocks_count> blocks are needed. */
+int prefetch_create(struct prefetch **pf_ret,
+                    const struct cpio_file *cpio_files, size_t cpio_files_len,
+                    const struct file_info *files,
+                    const bool *blocks_used, size_t blocks_count)
+{
+    struct prefetch *pf;
+
+    if (pf_ret == NULL || cpio_files == NULL || files == NULL || blocks_used == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((pf = malloc(sizeof(struct prefetch))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    pf->cancel = false;
+    pf->cursor = 0;
+    pf->next = 0;
+    pf->cpio_files = cpio_files;
+    pf->cpio_files_len = cpio_files_len;
+    pf->files = files;
+    pf->blocks_used = blocks_used;
+    pf->blocks_count = blocks_count;
+
+    if (pthread_mutex_init(&pf->mutex, NULL) != 0) {
+        free(pf);
+        return DRPM_ERR_OTHER;
+    }
+
+    if (pthread_cond_init(&pf->cond, NULL) != 0) {
+        pthread_mutex_destroy(&pf->mutex);
+        free(pf);
+        return DRPM_ERR_OTHER;
+    }
+
+    if (pthread_create(&pf->thread, NULL, prefetch_thread, pf) != 0) {
+        pthread_cond_destroy(&pf->cond);
+        pthread_mutex_destroy(&pf->mutex);
+        free(pf);
+        return DRPM_ERR_OTHER;
+    }
+
+    *pf_ret = pf;
+
+    return DRPM_ERR_OK;
+}
+
+/* stops prefetching thread and frees prefetcher */
+int prefetch_destroy(struct prefetch **pf_ref)
+{
+    struct prefetch *pf;
+
+    if (pf_ref == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((pf = *pf_ref) == NULL)
+        return DRPM_ERR_OK;
+
+    pthread_mutex_lock(&pf->mutex);
+    pf->cancel = true;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+
+    pthread_join(pf->thread, NULL);
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->mutex);
+
+    free(pf);
+    *pf_ref = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+/* moves prefetching window forward to CPIO entry at <index> */
+void prefetch_advance(struct prefetch *pf, size_t index)
+{
+    if (pf == NULL)
+        return;
+
+    pthread_mutex_lock(&pf->mutex);
+    if (index > pf->cursor) {
+        pf->cursor = index;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->mutex);
+}
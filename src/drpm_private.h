@@ -30,7 +30,9 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <openssl/md5.h>
+#include <openssl/evp.h>
 
 #define CHUNK_SIZE 1024
 
@@ -38,6 +40,12 @@
 
 #define DIGESTALGO_MD5 0
 #define DIGESTALGO_SHA256 1
+#define DIGESTALGO_COUNT 2
+#define DIGEST_MASK(algo) (1u << (algo))
+
+/* limits of undone prelinked files kept in temporary storage */
+#define PRELINK_CACHE_MAX 32
+#define PRELINK_CACHE_BYTES (1 << 28)
 
 #define RPM_PAYLOAD_FORMAT_DRPM 0
 #define RPM_PAYLOAD_FORMAT_CPIO 1
@@ -46,6 +54,12 @@
 #define RPM_ARCHIVE_DONT_READ 0
 #define RPM_ARCHIVE_READ_UNCOMP 1
 #define RPM_ARCHIVE_READ_DECOMP 2
+#define RPM_ARCHIVE_STREAM_DECOMP 3
+
+#define DELTARPM_INT_DATA_READ 0
+#define DELTARPM_INT_DATA_SKIP 1
+#define DELTARPM_INT_DATA_STREAM 2
+#define DELTARPM_PREFIX_ONLY 3
 
 #define MIN(x,y) (((x) < (y)) ? (x) : (y))
 #define MAX(x,y) (((x) > (y)) ? (x) : (y))
@@ -88,6 +102,11 @@ struct drpm {
     uint32_t offadj_elems_size;
     uint32_t int_copies_size;
     uint32_t ext_copies_size;
+
+    /* copies and data lengths are read on demand
+     * (as long as the file is unchanged) */
+    bool copies_read;
+    struct stat stats;
 };
 
 struct drpm_make_options {
@@ -105,6 +124,20 @@ struct drpm_make_options {
     unsigned mbytes;
 };
 
+struct drpm_apply_options {
+    char *spill_dir;
+    unsigned short spill_comp;
+    bool planned;
+    bool pipelined;
+    bool uncompressed;
+    bool direct_io;
+};
+
+/* digests being computed over the same data (through EVP) */
+struct digest {
+    EVP_MD_CTX *ctx[DIGESTALGO_COUNT];
+};
+
 struct cpio_file;
 struct cpio_header;
 struct deltarpm;
@@ -118,18 +151,26 @@ struct compstrm;
 struct decompstrm;
 //drpm_make.c
 struct rpm_patches;
+//drpm_pipeline.c
+struct pipeline;
+//drpm_prefetch.c
+struct prefetch;
 //drpm_rpm.c
 struct rpm;
+struct rpm_db;
 //drpm_search.c
 struct hash;
 struct sfxsrt;
 //drpm_write.c
 struct compstrm_wrapper;
+struct sink;
 
 //drpm_apply.c
 int expand_sequence(struct cpio_file **, size_t *, const unsigned char *, uint32_t,
-                    const struct file_info *, size_t, unsigned short, int);
+                    const struct file_info *, size_t, unsigned short, int, int *);
 int is_prelinked(bool *, int, const unsigned char *, ssize_t);
+void prelink_cache_add(const struct stat *, int);
+int prelink_cache_open(const struct stat *);
 int prelink_open(const char *, int *);
 
 //drpm_block.c
@@ -137,15 +178,22 @@ size_t block_id(uint64_t offset);
 size_t block_size();
 int blocks_create(struct blocks **, uint64_t, const struct file_info *,
                   const struct cpio_file *, size_t, const uint32_t *, size_t,
-                  struct rpm *, bool);
+                  struct rpm *, bool, const struct drpm_apply_options *);
 int blocks_destroy(struct blocks **);
+int blocks_file_range(struct blocks *, uint64_t, size_t, int *, off_t *, size_t *);
 int blocks_next(struct blocks *, unsigned char *, size_t *, uint64_t, size_t,
                 size_t, size_t);
+int blocks_prefetch(struct blocks *, size_t);
+
+//drpm_cache.c
+int digest_cache_flush(void);
+void digest_cache_lookup(const struct stat *, unsigned short, unsigned char *, bool *);
+void digest_cache_store(const struct stat *, unsigned short, const unsigned char *);
 
 //drpm_compstrm.c
 int compstrm_destroy(struct compstrm **);
 int compstrm_finish(struct compstrm *, unsigned char **, size_t *);
-int compstrm_init(struct compstrm **, int, unsigned short, int);
+int compstrm_init(struct compstrm **, struct sink *, unsigned short, int, struct digest *);
 int compstrm_write(struct compstrm *, size_t, const void *);
 int compstrm_write_be32(struct compstrm *, uint32_t);
 int compstrm_write_be64(struct compstrm *, uint64_t);
@@ -153,10 +201,11 @@ int compstrm_write_be64(struct compstrm *, uint64_t);
 //drpm_decompstrm.c
 int decompstrm_destroy(struct decompstrm **);
 int decompstrm_get_comp_size(struct decompstrm *, size_t *);
-int decompstrm_init(struct decompstrm **, int, unsigned short *, MD5_CTX *, const unsigned char *, size_t);
+int decompstrm_init(struct decompstrm **, int, unsigned short *, struct digest *, const unsigned char *, size_t);
 int decompstrm_read(struct decompstrm *, size_t, void *);
 int decompstrm_read_be32(struct decompstrm *, uint32_t *);
 int decompstrm_read_be64(struct decompstrm *, uint64_t *);
+int decompstrm_read_partial(struct decompstrm *, size_t, void *, size_t *);
 int decompstrm_read_until_eof(struct decompstrm *, size_t *, unsigned char **);
 
 //drpm_deltarpm.c
@@ -164,6 +213,14 @@ bool deltarpm_decode_comp(uint32_t, unsigned short *, unsigned short *);
 bool deltarpm_encode_comp(uint32_t *, unsigned short, unsigned short);
 void free_deltarpm(struct deltarpm *);
 
+//drpm_digest.c
+void digest_destroy(struct digest *);
+int digest_final(struct digest *, unsigned short, unsigned char *);
+int digest_init(struct digest *, unsigned);
+size_t digest_len(unsigned short);
+int digest_update(struct digest *, const void *, size_t);
+int digest_update_be32(struct digest *, uint32_t);
+
 //drpm_diff.c
 int make_diff(const unsigned char *, size_t, const unsigned char *, size_t,
               const unsigned char ***, uint64_t *, uint32_t **, uint32_t *,
@@ -182,12 +239,30 @@ int patches_check_nevr(const struct rpm_patches *, const char *);
 int patches_destroy(struct rpm_patches **);
 int patches_read(const char *, const char *, struct rpm_patches **);
 
+//drpm_pipeline.c
+int pipeline_destroy(struct pipeline **);
+int pipeline_finish(struct pipeline *);
+int pipeline_read(struct pipeline *, size_t, void *);
+int pipeline_reader_init(struct pipeline **, struct decompstrm *, uint64_t, bool);
+int pipeline_write(struct pipeline *, const void *, size_t);
+int pipeline_writer_init(struct pipeline **, struct compstrm_wrapper *, bool);
+
+//drpm_pool.c
+unsigned pool_default_workers(void);
+int pool_run(size_t, unsigned, void (*)(void *, size_t), void *);
+
+//drpm_prefetch.c
+void prefetch_advance(struct prefetch *, size_t);
+int prefetch_create(struct prefetch **, const struct cpio_file *, size_t,
+                    const struct file_info *, const bool *, size_t);
+int prefetch_destroy(struct prefetch **);
+
 //drpm_read.c
 int deltarpm_to_drpm(const struct deltarpm *, struct drpm *);
 void drpm_free(struct drpm *);
 int read_be32(int, uint32_t *);
 int read_be64(int, uint64_t *);
-int read_deltarpm(struct deltarpm *, const char *);
+int read_deltarpm(struct deltarpm *, const char *, unsigned short);
 
 //drpm_rpm.c
 int rpm_archive_read_chunk(struct rpm *, void *, size_t);
@@ -202,21 +277,29 @@ int rpm_get_comp_level(struct rpm *, unsigned short *);
 int rpm_get_digest_algo(struct rpm *, unsigned short *);
 int rpm_get_file_info(struct rpm *, struct file_info **, size_t *, bool *);
 int rpm_get_nevr(struct rpm *, char **);
+int rpm_get_payload_digest(struct rpm *, unsigned char *, bool *);
+int rpm_get_payload_digest_alt(struct rpm *, unsigned char *, bool *);
 int rpm_get_payload_format(struct rpm *, unsigned short *);
 bool rpm_is_sourcerpm(struct rpm *);
 int rpm_patch_payload_format(struct rpm *, const char *);
+int rpm_patch_payload_uncompressed(struct rpm *);
 int rpm_read(struct rpm **, const char *, int, unsigned short *,
              unsigned char *, unsigned char *);
-int rpm_read_header(struct rpm **, const char *, const char *);
+int rpm_db_close(struct rpm_db **);
+int rpm_db_open(struct rpm_db **);
+int rpm_read_header(struct rpm **, struct rpm_db *, const char *, const char *);
 int rpm_replace_lead_and_signature(struct rpm *, unsigned char *, size_t);
 int rpm_signature_empty(struct rpm *);
 int rpm_signature_get_md5(struct rpm *, unsigned char *, bool *);
+int rpm_signature_get_size(struct rpm *, uint64_t *, bool *);
 int rpm_signature_reload(struct rpm *);
+int rpm_signature_set_header_sha256(struct rpm *);
 int rpm_signature_set_md5(struct rpm *, unsigned char *);
-int rpm_signature_set_size(struct rpm *, uint32_t);
+int rpm_signature_set_size(struct rpm *, uint64_t);
 uint32_t rpm_size_full(struct rpm *);
 uint32_t rpm_size_header(struct rpm *);
 int rpm_write(struct rpm *, const char *, bool, unsigned char *, bool);
+int rpm_write_sink(struct rpm *, struct sink *, bool, unsigned char *, bool);
 
 //drpm_search.c
 int hash_create(struct hash **, const unsigned char *, size_t);
@@ -229,10 +312,12 @@ size_t sfxsrt_search(struct sfxsrt *, const unsigned char *, size_t,
                      const unsigned char *, size_t, size_t, size_t, size_t *, size_t *);
 
 //drpm_utils.c
+void bytes_add(unsigned char *, const unsigned char *, size_t);
+void bytes_sub(unsigned char *, const unsigned char *, const unsigned char *, size_t);
+bool bytes_zero(const unsigned char *, size_t);
 void create_be32(uint32_t, unsigned char *);
 void create_be64(uint64_t, unsigned char *);
 void dump_hex(char *, const unsigned char *, size_t);
-int md5_update_be32(MD5_CTX *, uint32_t);
 uint16_t parse_be16(const unsigned char *);
 uint32_t parse_be32(const unsigned char *);
 uint64_t parse_be64(const unsigned char *);
@@ -245,10 +330,17 @@ bool resize32(void **, size_t, size_t);
 
 //drpm_write.c
 int compstrm_wrapper_destroy(struct compstrm_wrapper **);
-int compstrm_wrapper_finish(struct compstrm_wrapper *, unsigned char **, size_t *);
+int compstrm_wrapper_finish(struct compstrm_wrapper *);
 int compstrm_wrapper_init(struct compstrm_wrapper **, size_t,
-                          int, unsigned short, int);
+                          struct sink *, unsigned short, int, struct digest *);
 int compstrm_wrapper_write(struct compstrm_wrapper *, const unsigned char *, size_t);
+int sink_allocate(struct sink *, uint64_t);
+int sink_copy_range(struct sink *, int, off_t, size_t, struct digest *);
+int sink_destroy(struct sink **);
+int sink_flush(struct sink *);
+int sink_init_fd(struct sink **, int, bool);
+int sink_init_func(struct sink **, drpm_write_func, void *);
+int sink_write(struct sink *, const void *, size_t);
 int write_be32(int, uint32_t);
 int write_be64(int, uint64_t);
 int write_comp(struct compstrm *, size_t *, int, const void *, size_t);
@@ -315,6 +407,9 @@ struct deltarpm {
         unsigned char *bytes;
         const unsigned char **ptrs;
     } int_data;
+    /* internal data yet to be read (if streamed) */
+    struct decompstrm *int_data_strm;
+    int int_data_filedesc;
 };
 
 struct file_info {
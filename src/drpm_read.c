@@ -35,8 +35,8 @@
 #define MAGIC_DLT(x) (((x) >> 8) == 0x444C54)
 #define MAGIC_DLT3(x) ((x) == 0x444C5433)
 
-static int readdelta_rest(int, struct deltarpm *);
-static int readdelta_rpmonly(int, struct deltarpm *);
+static int readdelta_rest(int, struct deltarpm *, unsigned short);
+static int readdelta_rpmonly(int, struct deltarpm *, unsigned short);
 static int readdelta_standard(int, struct deltarpm *);
 
 /* Reads 32-byte integer in network byte order from file. */
@@ -78,8 +78,10 @@ int read_be64(int filedesc, uint64_t *buffer_ret)
 }
 
 /* Reads the rest of the DeltaRPM, i.e. the compressed part
- * that has the same format for standard and rpm-only deltas. */
-int readdelta_rest(int filedesc, struct deltarpm *delta)
+ * that has the same format for standard and rpm-only deltas.
+ * Internal data is read, skipped or left in the stream
+ * according to <int_data_mode>. */
+int readdelta_rest(int filedesc, struct deltarpm *delta, unsigned short int_data_mode)
 {
     struct decompstrm *stream;
     uint32_t version;
@@ -235,8 +237,14 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
 
     /* reading payload format offset and internal and external copies */
 
-    if ((error = decompstrm_read_be32(stream, &delta->payload_fmt_off)) != DRPM_ERR_OK ||
-        (error = decompstrm_read_be32(stream, &delta->int_copies_count)) != DRPM_ERR_OK ||
+    if ((error = decompstrm_read_be32(stream, &delta->payload_fmt_off)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    /* nothing more is decompressed if only metadata is needed */
+    if (int_data_mode == DELTARPM_PREFIX_ONLY)
+        goto cleanup;
+
+    if ((error = decompstrm_read_be32(stream, &delta->int_copies_count)) != DRPM_ERR_OK ||
         (error = decompstrm_read_be32(stream, &delta->ext_copies_count)) != DRPM_ERR_OK)
         goto cleanup;
 
@@ -318,7 +326,7 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
         goto cleanup;
     }
 
-    if (delta->int_data_len > 0) {
+    if (delta->int_data_len > 0 && int_data_mode == DELTARPM_INT_DATA_READ) {
         if ((delta->int_data.bytes = malloc(delta->int_data_len)) == NULL) {
             error = DRPM_ERR_MEMORY;
             goto cleanup;
@@ -354,14 +362,22 @@ int readdelta_rest(int filedesc, struct deltarpm *delta)
         }
     }
 
+    /* internal copies are applied in order, so internal data
+     * can be read from the stream as they are performed */
+    if (int_data_mode == DELTARPM_INT_DATA_STREAM) {
+        delta->int_data_strm = stream;
+        return DRPM_ERR_OK;
+    }
+
 cleanup:
     decompstrm_destroy(&stream);
 
     return error;
 }
 
-/* Reads part of DeltaRPM specific to rpm-only deltas. */
-int readdelta_rpmonly(int filedesc, struct deltarpm *delta)
+/* Reads part of DeltaRPM specific to rpm-only deltas.
+ * Add data is skipped if <int_data_mode> is DELTARPM_PREFIX_ONLY. */
+int readdelta_rpmonly(int filedesc, struct deltarpm *delta, unsigned short int_data_mode)
 {
     uint32_t version;
     uint32_t tgt_nevr_len;
@@ -395,6 +411,13 @@ int readdelta_rpmonly(int filedesc, struct deltarpm *delta)
     if ((error = read_be32(filedesc, &delta->add_data_len)) != DRPM_ERR_OK)
         return error;
 
+    if (int_data_mode == DELTARPM_PREFIX_ONLY) {
+        if (lseek(filedesc, delta->add_data_len, SEEK_CUR) == (off_t)-1)
+            return DRPM_ERR_IO;
+        delta->add_data_len = 0;
+        return DRPM_ERR_OK;
+    }
+
     if ((delta->add_data = malloc(delta->add_data_len)) == NULL)
         return DRPM_ERR_MEMORY;
 
@@ -429,8 +452,13 @@ int readdelta_standard(int filedesc, struct deltarpm *delta)
     return DRPM_ERR_OK;
 }
 
-/* Reads DeltaRPM from file. */
-int read_deltarpm(struct deltarpm *delta, const char *filename)
+/* Reads DeltaRPM from file.
+ * If <int_data_mode> is DELTARPM_INT_DATA_STREAM, the file is kept open
+ * and internal data is to be read from <delta->int_data_strm>.
+ * If DELTARPM_INT_DATA_SKIP, internal data is not read at all.
+ * If DELTARPM_PREFIX_ONLY, reading stops after the payload format offset
+ * (copies, add data and data lengths are left empty). */
+int read_deltarpm(struct deltarpm *delta, const char *filename, unsigned short int_data_mode)
 {
     int filedesc;
     uint32_t magic;
@@ -452,7 +480,7 @@ int read_deltarpm(struct deltarpm *delta, const char *filename)
     switch (magic) {
     case MAGIC_DRPM:
         delta->type = DRPM_TYPE_RPMONLY;
-        if ((error = readdelta_rpmonly(filedesc, delta)) != DRPM_ERR_OK)
+        if ((error = readdelta_rpmonly(filedesc, delta, int_data_mode)) != DRPM_ERR_OK)
             goto cleanup_fail;
         break;
     case MAGIC_RPM:
@@ -466,9 +494,14 @@ int read_deltarpm(struct deltarpm *delta, const char *filename)
     }
 
     /* the rest of the delta is the same for both types */
-    if ((error = readdelta_rest(filedesc, delta)) != DRPM_ERR_OK)
+    if ((error = readdelta_rest(filedesc, delta, int_data_mode)) != DRPM_ERR_OK)
         goto cleanup_fail;
 
+    if (delta->int_data_strm != NULL) {
+        delta->int_data_filedesc = filedesc;
+        return DRPM_ERR_OK;
+    }
+
     goto cleanup;
 
 cleanup_fail:
@@ -500,6 +533,7 @@ int deltarpm_to_drpm(const struct deltarpm *src, struct drpm *dst)
     dst->payload_fmt_off = src->payload_fmt_off;
     dst->ext_data_len = src->ext_data_len;
     dst->int_data_len = src->int_data_len;
+    dst->copies_read = true;
 
     dst->offadj_elems_size = src->offadj_elems_count * 2;
     dst->int_copies_size = src->int_copies_count * 2;
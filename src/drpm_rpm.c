@@ -22,16 +22,28 @@
 #include "drpm_private.h"
 
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <rpm/rpmlib.h>
 #include <rpm/rpmts.h>
 #include <rpm/rpmdb.h>
+#include <rpm/rpmmacro.h>
 #include <openssl/md5.h>
+#include <openssl/sha.h>
 
 #define BUFFER_SIZE 4096
 
+/* tags missing from older rpmlib versions */
+#define TAG_PAYLOADDIGEST 5092
+#define TAG_PAYLOADDIGESTALGO 5093
+#define TAG_PAYLOADDIGESTALT 5097
+#define SIGTAG_SHA256 273
+
 /* RFC 4880 - Section 9.4. Hash Algorithms */
 #define RFC4880_HASH_ALGO_MD5 1
 #define RFC4880_HASH_ALGO_SHA256 8
@@ -48,15 +60,61 @@ struct rpm {
     size_t archive_size;
     size_t archive_offset;
     size_t archive_comp_size;
+    /* archive decompressed on demand (if streamed) */
+    struct decompstrm *archive_strm;
+    int archive_filedesc;
+};
+
+/* rpmlib configuration is process-wide, so it is only read once,
+ * and rpm database lookups from concurrent calls are serialized */
+static pthread_once_t rpm_config_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t rpmdb_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* files of the rpm database backends, any of which changes
+ * (together with the database directory) when packages are installed */
+static const char *rpm_db_files[] = {"rpmdb.sqlite", "rpmdb.sqlite-wal", "Packages.db", "Packages"};
+
+/* cached header of installed package (NULL if not installed) */
+struct rpm_db_entry {
+    char *nevr;
+    char *arch;
+    unsigned char *header;
+    size_t header_size;
 };
 
+/* Rpm database handle shared by several lookups (e.g. batch applies).
+ * Headers that have been looked up are cached, sorted by NEVR and arch.
+ * The cache is dropped whenever the database files are modified. */
+struct rpm_db {
+    rpmts trans;
+    char *path;
+    struct timespec stamp;
+    struct rpm_db_entry *entries;
+    size_t entries_len;
+    size_t entries_max;
+};
+
+static void read_rpm_config(void);
+static int rpm_db_cache(struct rpm_db *, size_t, const char *, const char *, unsigned char *, size_t);
+static int rpm_db_compare(const struct rpm_db_entry *, const char *, const char *);
+static bool rpm_db_find(struct rpm_db *, const char *, const char *, size_t *);
+static void rpm_db_flush(struct rpm_db *);
+static void rpm_db_stamp(const char *, struct timespec *);
+static void rpm_db_validate(struct rpm_db *);
 static void rpm_init(struct rpm *);
 static void rpm_free(struct rpm *);
 static int rpm_export_header(struct rpm *, unsigned char **, size_t *);
 static int rpm_export_signature(struct rpm *, unsigned char **, size_t *);
+static int rpm_get_payload_sha256(struct rpm *, rpmTagVal, unsigned char *, bool *);
 static void rpm_header_unload_region(struct rpm *, rpmTagVal);
+static int rpm_open_archive(struct rpm *, const char *, off_t, unsigned short *);
 static int rpm_read_archive(struct rpm *, const char *, off_t, bool,
-                            unsigned short *, MD5_CTX *, MD5_CTX *);
+                            unsigned short *, struct digest *, struct digest *);
+
+void read_rpm_config(void)
+{
+    rpmReadConfigFiles(NULL, NULL);
+}
 
 void rpm_init(struct rpm *rpmst)
 {
@@ -70,6 +128,8 @@ void rpm_init(struct rpm *rpmst)
     rpmst->archive_size = 0;
     rpmst->archive_offset = 0;
     rpmst->archive_comp_size = 0;
+    rpmst->archive_strm = NULL;
+    rpmst->archive_filedesc = -1;
 }
 
 void rpm_free(struct rpm *rpmst)
@@ -81,6 +141,11 @@ void rpm_free(struct rpm *rpmst)
     headerFree(rpmst->header);
     free(rpmst->archive);
 
+    if (rpmst->archive_strm != NULL) {
+        decompstrm_destroy(&rpmst->archive_strm);
+        close(rpmst->archive_filedesc);
+    }
+
     rpm_init(rpmst);
 }
 
@@ -174,16 +239,42 @@ void rpm_header_unload_region(struct rpm *rpmst, rpmTagVal rpmtag)
     rpmtdFree(td);
 }
 
+/* Prepares the archive to be decompressed as it is read,
+ * keeping the file open until the RPM is freed. */
+int rpm_open_archive(struct rpm *rpmst, const char *filename,
+                     off_t offset, unsigned short *comp_ret)
+{
+    int filedesc;
+    int error;
+
+    if ((filedesc = open(filename, O_RDONLY)) < 0)
+        return DRPM_ERR_IO;
+
+    if (lseek(filedesc, offset, SEEK_SET) != offset) {
+        close(filedesc);
+        return DRPM_ERR_IO;
+    }
+
+    if ((error = decompstrm_init(&rpmst->archive_strm, filedesc, comp_ret, NULL, NULL, 0)) != DRPM_ERR_OK) {
+        close(filedesc);
+        return error;
+    }
+
+    rpmst->archive_filedesc = filedesc;
+
+    return DRPM_ERR_OK;
+}
+
 int rpm_read_archive(struct rpm *rpmst, const char *filename,
                      off_t offset, bool decompress, unsigned short *comp_ret,
-                     MD5_CTX *seq_md5, MD5_CTX *full_md5)
+                     struct digest *seq_md5, struct digest *full_md5)
 {
     struct decompstrm *stream = NULL;
     int filedesc;
     unsigned char *archive_tmp;
     unsigned char buffer[BUFFER_SIZE];
     ssize_t bytes_read;
-    MD5_CTX *md5;
+    struct digest *md5;
     int error = DRPM_ERR_OK;
 
     if ((filedesc = open(filename, O_RDONLY)) < 0)
@@ -210,11 +301,9 @@ int rpm_read_archive(struct rpm *rpmst, const char *filename,
                 error = DRPM_ERR_MEMORY;
                 goto cleanup;
             }
-            if ((seq_md5 != NULL && MD5_Update(seq_md5, buffer, bytes_read) != 1) ||
-                (full_md5 != NULL && MD5_Update(full_md5, buffer, bytes_read) != 1)) {
-                error = DRPM_ERR_OTHER;
+            if ((seq_md5 != NULL && (error = digest_update(seq_md5, buffer, bytes_read)) != DRPM_ERR_OK) ||
+                (full_md5 != NULL && (error = digest_update(full_md5, buffer, bytes_read)) != DRPM_ERR_OK))
                 goto cleanup;
-            }
             rpmst->archive = archive_tmp;
             memcpy(rpmst->archive + rpmst->archive_size, buffer, bytes_read);
             rpmst->archive_size += bytes_read;
@@ -237,6 +326,9 @@ cleanup:
 
 /* Reads RPM (or RPM-like file) from file <filename> into <*rpmst>.
  * The archive may be decompressed, read "as is", or not read at all.
+ * It may also be streamed, i.e. decompressed on demand as it is read
+ * with rpm_archive_read_chunk(), in which case no MD5s can be made
+ * and the archive can only be read once, front to back.
  * If read, the compression method used in the archive is stored in
  * <*archive_comp>.
  * Two MD5 checksums may be created. An MD5 digest of the header
@@ -252,8 +344,9 @@ int rpm_read(struct rpm **rpmst, const char *filename,
     off_t file_pos;
     bool include_archive;
     bool decomp_archive = false;
-    MD5_CTX seq_md5;
-    MD5_CTX full_md5;
+    bool stream_archive = false;
+    struct digest seq_md5 = {0};
+    struct digest full_md5 = {0};
     unsigned char *signature = NULL;
     size_t signature_len;
     unsigned char *header = NULL;
@@ -275,6 +368,12 @@ int rpm_read(struct rpm **rpmst, const char *filename,
         include_archive = true;
         decomp_archive = true;
         break;
+    case RPM_ARCHIVE_STREAM_DECOMP:
+        if (seq_md5_digest != NULL || full_md5_digest != NULL)
+            return DRPM_ERR_PROG;
+        include_archive = false;
+        stream_archive = true;
+        break;
     default:
         return DRPM_ERR_PROG;
     }
@@ -301,24 +400,20 @@ int rpm_read(struct rpm **rpmst, const char *filename,
     if (seq_md5_digest != NULL) {
         if ((error = rpm_export_header(*rpmst, &header, &header_len)) != DRPM_ERR_OK)
             goto cleanup_fail;
-        if (MD5_Init(&seq_md5) != 1 ||
-            MD5_Update(&seq_md5, header, header_len) != 1) {
-            error = DRPM_ERR_OTHER;
+        if ((error = digest_init(&seq_md5, DIGEST_MASK(DIGESTALGO_MD5))) != DRPM_ERR_OK ||
+            (error = digest_update(&seq_md5, header, header_len)) != DRPM_ERR_OK)
             goto cleanup_fail;
-        }
     }
 
     if (full_md5_digest != NULL) {
         if ((error = rpm_export_signature(*rpmst, &signature, &signature_len)) != DRPM_ERR_OK ||
             (header == NULL && (error = rpm_export_header(*rpmst, &header, &header_len)) != DRPM_ERR_OK))
             goto cleanup_fail;
-        if (MD5_Init(&full_md5) != 1 ||
-            MD5_Update(&full_md5, (*rpmst)->lead, RPMLEAD_SIZE) != 1 ||
-            MD5_Update(&full_md5, signature, signature_len) != 1 ||
-            MD5_Update(&full_md5, header, header_len) != 1) {
-            error = DRPM_ERR_OTHER;
+        if ((error = digest_init(&full_md5, DIGEST_MASK(DIGESTALGO_MD5))) != DRPM_ERR_OK ||
+            (error = digest_update(&full_md5, (*rpmst)->lead, RPMLEAD_SIZE)) != DRPM_ERR_OK ||
+            (error = digest_update(&full_md5, signature, signature_len)) != DRPM_ERR_OK ||
+            (error = digest_update(&full_md5, header, header_len)) != DRPM_ERR_OK)
             goto cleanup_fail;
-        }
     }
 
     if (include_archive) {
@@ -333,18 +428,27 @@ int rpm_read(struct rpm **rpmst, const char *filename,
             goto cleanup_fail;
     }
 
-    if ((seq_md5_digest != NULL && MD5_Final(seq_md5_digest, &seq_md5) != 1) ||
-        (full_md5_digest != NULL && MD5_Final(full_md5_digest, &full_md5) != 1)) {
-        error = DRPM_ERR_OTHER;
-        goto cleanup_fail;
+    if (stream_archive) {
+        if ((file_pos = Ftell(file)) < 0) {
+            error = DRPM_ERR_IO;
+            goto cleanup_fail;
+        }
+        if ((error = rpm_open_archive(*rpmst, filename, file_pos, archive_comp)) != DRPM_ERR_OK)
+            goto cleanup_fail;
     }
 
+    if ((seq_md5_digest != NULL && (error = digest_final(&seq_md5, DIGESTALGO_MD5, seq_md5_digest)) != DRPM_ERR_OK) ||
+        (full_md5_digest != NULL && (error = digest_final(&full_md5, DIGESTALGO_MD5, full_md5_digest)) != DRPM_ERR_OK))
+        goto cleanup_fail;
+
     goto cleanup;
 
 cleanup_fail:
     rpm_free(*rpmst);
 
 cleanup:
+    digest_destroy(&seq_md5);
+    digest_destroy(&full_md5);
     free(signature);
     free(header);
     Fclose(file);
@@ -368,9 +472,18 @@ int rpm_destroy(struct rpm **rpmst)
 /* Reads <count> bytes to <buffer> from the current offset in the archive. */
 int rpm_archive_read_chunk(struct rpm *rpmst, void *buffer, size_t count)
 {
+    int error;
+
     if (rpmst == NULL)
         return DRPM_ERR_PROG;
 
+    if (rpmst->archive_strm != NULL) {
+        if ((error = decompstrm_read(rpmst->archive_strm, count, buffer)) != DRPM_ERR_OK)
+            return error;
+        rpmst->archive_offset += count;
+        return DRPM_ERR_OK;
+    }
+
     if (rpmst->archive_offset + count > rpmst->archive_size)
         return DRPM_ERR_FORMAT;
 
@@ -382,10 +495,12 @@ int rpm_archive_read_chunk(struct rpm *rpmst, void *buffer, size_t count)
     return DRPM_ERR_OK;
 }
 
-/* Positions the archive offset at the beginning of the archive. */
+/* Positions the archive offset at the beginning of the archive.
+ * A streamed archive cannot be rewound once read from. */
 int rpm_archive_rewind(struct rpm *rpmst)
 {
-    if (rpmst == NULL)
+    if (rpmst == NULL ||
+        (rpmst->archive_strm != NULL && rpmst->archive_offset > 0))
         return DRPM_ERR_PROG;
 
     rpmst->archive_offset = 0;
@@ -466,7 +581,8 @@ int rpm_fetch_header(struct rpm *rpmst, unsigned char **header_ret, uint32_t *le
 /* Fetches the archive (in whatever format it was read). */
 int rpm_fetch_archive(struct rpm *rpmst, unsigned char **archive_ret, size_t *len)
 {
-    if (rpmst == NULL || archive_ret == NULL || len == NULL)
+    if (rpmst == NULL || archive_ret == NULL || len == NULL ||
+        rpmst->archive_strm != NULL)
         return DRPM_ERR_PROG;
 
     if ((*archive_ret = malloc(rpmst->archive_size)) == NULL)
@@ -483,63 +599,87 @@ int rpm_fetch_archive(struct rpm *rpmst, unsigned char **archive_ret, size_t *le
  * data to <digest>. If <full_md5> is false, then this will not include
  * the lead and signature. */
 int rpm_write(struct rpm *rpmst, const char *filename, bool include_archive, unsigned char digest[MD5_DIGEST_LENGTH], bool full_md5)
+{
+    int error;
+    int filedesc;
+    struct sink *sink = NULL;
+
+    if (rpmst == NULL || filename == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((filedesc = creat(filename, CREAT_MODE)) < 0)
+        return DRPM_ERR_IO;
+
+    if ((error = sink_init_fd(&sink, filedesc, false)) == DRPM_ERR_OK &&
+        (error = rpm_write_sink(rpmst, sink, include_archive, digest, full_md5)) == DRPM_ERR_OK)
+        error = sink_flush(sink);
+
+    sink_destroy(&sink);
+    close(filedesc);
+
+    return error;
+}
+
+/* Writes the RPM to <sink>, like rpm_write().
+ * The sink is not flushed. */
+int rpm_write_sink(struct rpm *rpmst, struct sink *sink, bool include_archive, unsigned char digest[MD5_DIGEST_LENGTH], bool full_md5)
 {
     int error = DRPM_ERR_OK;
-    FD_t file;
     unsigned char *signature = NULL;
     size_t signature_len;
     unsigned char *header = NULL;
     size_t header_len;
-    MD5_CTX md5;
+    struct digest md5 = {0};
+    unsigned char buffer[BUFFER_SIZE];
+    size_t read_len;
 
-    if (rpmst == NULL)
+    if (rpmst == NULL || sink == NULL)
         return DRPM_ERR_PROG;
 
-    // hack: extra '\0' to prevent rpmlib from compressing (see rpmio.c)
-    if ((file = Fopen(filename, "wb\0")) == NULL)
-        return DRPM_ERR_IO;
-
     if ((error = rpm_export_signature(rpmst, &signature, &signature_len)) != DRPM_ERR_OK ||
         (error = rpm_export_header(rpmst, &header, &header_len)) != DRPM_ERR_OK)
         goto cleanup;
 
-    if (Fwrite(rpmst->lead, 1, RPMLEAD_SIZE, file) != RPMLEAD_SIZE ||
-        Fwrite(signature, 1, signature_len, file) != (ssize_t)signature_len ||
-        Fwrite(header, 1, header_len, file) != (ssize_t)header_len) {
-        error = DRPM_ERR_IO;
+    if ((error = sink_write(sink, rpmst->lead, RPMLEAD_SIZE)) != DRPM_ERR_OK ||
+        (error = sink_write(sink, signature, signature_len)) != DRPM_ERR_OK ||
+        (error = sink_write(sink, header, header_len)) != DRPM_ERR_OK)
         goto cleanup;
-    }
 
     if (digest != NULL) {
-        if (MD5_Init(&md5) != 1 ||
+        if ((error = digest_init(&md5, DIGEST_MASK(DIGESTALGO_MD5))) != DRPM_ERR_OK ||
             (full_md5 &&
-             (MD5_Update(&md5, rpmst->lead, RPMLEAD_SIZE) != 1 ||
-              MD5_Update(&md5, signature, signature_len) != 1)) ||
-            MD5_Update(&md5, header, header_len) != 1) {
-            error = DRPM_ERR_OTHER;
+             ((error = digest_update(&md5, rpmst->lead, RPMLEAD_SIZE)) != DRPM_ERR_OK ||
+              (error = digest_update(&md5, signature, signature_len)) != DRPM_ERR_OK)) ||
+            (error = digest_update(&md5, header, header_len)) != DRPM_ERR_OK)
             goto cleanup;
-        }
     }
 
-    if (include_archive) {
-        if (Fwrite(rpmst->archive, 1, rpmst->archive_size, file)
-            != (ssize_t)rpmst->archive_size) {
-            error = DRPM_ERR_IO;
-            goto cleanup;
+    if (include_archive && rpmst->archive_strm != NULL) {
+        /* writing out the rest of a streamed archive */
+        while (true) {
+            if ((error = decompstrm_read_partial(rpmst->archive_strm, BUFFER_SIZE,
+                                                 buffer, &read_len)) != DRPM_ERR_OK)
+                goto cleanup;
+            if (read_len == 0)
+                break;
+            if ((error = sink_write(sink, buffer, read_len)) != DRPM_ERR_OK)
+                goto cleanup;
+            if (digest != NULL && (error = digest_update(&md5, buffer, read_len)) != DRPM_ERR_OK)
+                goto cleanup;
+            rpmst->archive_offset += read_len;
         }
-        if (digest != NULL && MD5_Update(&md5, rpmst->archive, rpmst->archive_size) != 1) {
-            error = DRPM_ERR_OTHER;
+    } else if (include_archive) {
+        if ((error = sink_write(sink, rpmst->archive, rpmst->archive_size)) != DRPM_ERR_OK)
+            goto cleanup;
+        if (digest != NULL && (error = digest_update(&md5, rpmst->archive, rpmst->archive_size)) != DRPM_ERR_OK)
             goto cleanup;
-        }
     }
 
-    if (digest != NULL && MD5_Final(digest, &md5) != 1) {
-        error = DRPM_ERR_OTHER;
+    if (digest != NULL && (error = digest_final(&md5, DIGESTALGO_MD5, digest)) != DRPM_ERR_OK)
         goto cleanup;
-    }
 
 cleanup:
-    Fclose(file);
+    digest_destroy(&md5);
     free(signature);
     free(header);
 
@@ -720,6 +860,65 @@ int rpm_patch_payload_format(struct rpm *rpmst, const char *new_payfmt)
     return DRPM_ERR_OK;
 }
 
+/* Marks the payload as uncompressed, like rpmbuild does for "w.ufdio".
+ * The digest of the compressed payload no longer applies and is removed. */
+int rpm_patch_payload_uncompressed(struct rpm *rpmst)
+{
+    if (rpmst == NULL)
+        return DRPM_ERR_PROG;
+
+    rpm_header_unload_region(rpmst, RPMTAG_HEADERIMMUTABLE);
+
+    headerDel(rpmst->header, RPMTAG_PAYLOADCOMPRESSOR);
+    headerDel(rpmst->header, TAG_PAYLOADDIGEST);
+
+    rpmst->header = headerReload(rpmst->header, RPMTAG_HEADERIMMUTABLE);
+
+    return DRPM_ERR_OK;
+}
+
+/* Fetches payload digest <tag> from the header if it is a SHA-256 digest. */
+int rpm_get_payload_sha256(struct rpm *rpmst, rpmTagVal tag, unsigned char digest[SHA256_DIGEST_LENGTH], bool *has_digest)
+{
+    rpmtd tag_data;
+    const char *digest_hex;
+
+    if (rpmst == NULL || digest == NULL || has_digest == NULL)
+        return DRPM_ERR_PROG;
+
+    *has_digest = false;
+
+    if (headerGetNumber(rpmst->header, TAG_PAYLOADDIGESTALGO) != RFC4880_HASH_ALGO_SHA256)
+        return DRPM_ERR_OK;
+
+    tag_data = rpmtdNew();
+
+    if (headerGet(rpmst->header, tag, tag_data, HEADERGET_MINMEM) == 1 &&
+        (digest_hex = rpmtdNextString(tag_data)) != NULL)
+        *has_digest = parse_sha256(digest, digest_hex);
+
+    rpmtdFreeData(tag_data);
+    rpmtdFree(tag_data);
+
+    return DRPM_ERR_OK;
+}
+
+/* Fetches the SHA-256 digest of the (compressed) payload from the header.
+ * <*has_digest> is false if there is no such digest (or it uses
+ * another algorithm). */
+int rpm_get_payload_digest(struct rpm *rpmst, unsigned char digest[SHA256_DIGEST_LENGTH], bool *has_digest)
+{
+    return rpm_get_payload_sha256(rpmst, TAG_PAYLOADDIGEST, digest, has_digest);
+}
+
+/* Fetches the SHA-256 digest of the uncompressed payload from the header.
+ * <*has_digest> is false if there is no such digest (or it uses
+ * another algorithm). */
+int rpm_get_payload_digest_alt(struct rpm *rpmst, unsigned char digest[SHA256_DIGEST_LENGTH], bool *has_digest)
+{
+    return rpm_get_payload_sha256(rpmst, TAG_PAYLOADDIGESTALT, digest, has_digest);
+}
+
 /* Fetches a list of file information from the header. */
 int rpm_get_file_info(struct rpm *rpmst, struct file_info **files_ret,
                       size_t *count_ret, bool *colors_ret)
@@ -917,19 +1116,27 @@ int rpm_signature_empty(struct rpm *rpmst)
 }
 
 /* Sets size tag in the signature.
- * Should be equal to the size all data following the signature. */
-int rpm_signature_set_size(struct rpm *rpmst, uint32_t size)
+ * Should be equal to the size all data following the signature.
+ * Like rpmbuild, uses the 64-bit tag if the size does not fit 32 bits. */
+int rpm_signature_set_size(struct rpm *rpmst, uint64_t size)
 {
     rpmtd tag_data;
+    uint32_t size32 = size;
 
     if (rpmst == NULL)
         return DRPM_ERR_PROG;
 
     tag_data = rpmtdNew();
 
-    tag_data->tag = RPMSIGTAG_SIZE;
-    tag_data->type = RPM_INT32_TYPE;
-    tag_data->data = &size;
+    if (size > UINT32_MAX) {
+        tag_data->tag = RPMSIGTAG_LONGSIZE;
+        tag_data->type = RPM_INT64_TYPE;
+        tag_data->data = &size;
+    } else {
+        tag_data->tag = RPMSIGTAG_SIZE;
+        tag_data->type = RPM_INT32_TYPE;
+        tag_data->data = &size32;
+    }
     tag_data->count = 1;
 
     headerPut(rpmst->signature, tag_data, HEADERPUT_DEFAULT);
@@ -962,6 +1169,49 @@ int rpm_signature_set_md5(struct rpm *rpmst, unsigned char md5[MD5_DIGEST_LENGTH
     return DRPM_ERR_OK;
 }
 
+/* Sets SHA-256 tag in the signature to the digest of the header. */
+int rpm_signature_set_header_sha256(struct rpm *rpmst)
+{
+    int error;
+    rpmtd tag_data;
+    unsigned char *header;
+    size_t header_len;
+    struct digest dgst = {0};
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char digest_hex[SHA256_DIGEST_LENGTH * 2 + 1];
+
+    if (rpmst == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((error = rpm_export_header(rpmst, &header, &header_len)) != DRPM_ERR_OK)
+        return error;
+
+    if ((error = digest_init(&dgst, DIGEST_MASK(DIGESTALGO_SHA256))) == DRPM_ERR_OK &&
+        (error = digest_update(&dgst, header, header_len)) == DRPM_ERR_OK)
+        error = digest_final(&dgst, DIGESTALGO_SHA256, digest);
+
+    digest_destroy(&dgst);
+    free(header);
+
+    if (error != DRPM_ERR_OK)
+        return error;
+
+    dump_hex(digest_hex, digest, SHA256_DIGEST_LENGTH);
+
+    tag_data = rpmtdNew();
+
+    tag_data->tag = SIGTAG_SHA256;
+    tag_data->type = RPM_STRING_TYPE;
+    tag_data->data = digest_hex;
+    tag_data->count = 1;
+
+    headerPut(rpmst->signature, tag_data, HEADERPUT_DEFAULT);
+
+    rpmtdFree(tag_data);
+
+    return DRPM_ERR_OK;
+}
+
 /* Reloads the signature to accomodate for changes. */
 int rpm_signature_reload(struct rpm *rpmst)
 {
@@ -970,6 +1220,20 @@ int rpm_signature_reload(struct rpm *rpmst)
     return DRPM_ERR_OK;
 }
 
+/* Fetches size tag from the signature (either of its variants). */
+int rpm_signature_get_size(struct rpm *rpmst, uint64_t *size, bool *has_size)
+{
+    if (rpmst == NULL || size == NULL || has_size == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((*has_size = (headerIsEntry(rpmst->signature, RPMSIGTAG_LONGSIZE) == 1)))
+        *size = headerGetNumber(rpmst->signature, RPMSIGTAG_LONGSIZE);
+    else if ((*has_size = (headerIsEntry(rpmst->signature, RPMSIGTAG_SIZE) == 1)))
+        *size = headerGetNumber(rpmst->signature, RPMSIGTAG_SIZE);
+
+    return DRPM_ERR_OK;
+}
+
 /* Fetches the MD5 sum from the signature. */
 int rpm_signature_get_md5(struct rpm *rpmst, unsigned char md5[MD5_DIGEST_LENGTH], bool *has_md5)
 {
@@ -996,12 +1260,198 @@ cleanup:
     return error;
 }
 
+/* Gets the latest modification time of the database at <path>. */
+void rpm_db_stamp(const char *path, struct timespec *stamp)
+{
+    struct stat stats;
+    char *filename;
+
+    stamp->tv_sec = 0;
+    stamp->tv_nsec = 0;
+
+    if (path == NULL)
+        return;
+
+    if (stat(path, &stats) == 0)
+        *stamp = stats.st_mtim;
+
+    for (size_t i = 0; i < sizeof(rpm_db_files) / sizeof(rpm_db_files[0]); i++) {
+        if ((filename = malloc(strlen(path) + strlen(rpm_db_files[i]) + 2)) == NULL)
+            continue;
+        sprintf(filename, "%s/%s", path, rpm_db_files[i]);
+        if (stat(filename, &stats) == 0 &&
+            (stats.st_mtim.tv_sec > stamp->tv_sec ||
+             (stats.st_mtim.tv_sec == stamp->tv_sec && stats.st_mtim.tv_nsec > stamp->tv_nsec)))
+            *stamp = stats.st_mtim;
+        free(filename);
+    }
+}
+
+void rpm_db_flush(struct rpm_db *db)
+{
+    for (size_t i = 0; i < db->entries_len; i++) {
+        free(db->entries[i].nevr);
+        free(db->entries[i].arch);
+        free(db->entries[i].header);
+    }
+    db->entries_len = 0;
+}
+
+/* drops cached headers if the database has been modified since */
+void rpm_db_validate(struct rpm_db *db)
+{
+    struct timespec stamp;
+
+    rpm_db_stamp(db->path, &stamp);
+
+    if (stamp.tv_sec != db->stamp.tv_sec || stamp.tv_nsec != db->stamp.tv_nsec) {
+        rpm_db_flush(db);
+        db->stamp = stamp;
+    }
+}
+
+int rpm_db_compare(const struct rpm_db_entry *entry, const char *nevr, const char *arch)
+{
+    int cmp;
+
+    if ((cmp = strcmp(entry->nevr, nevr)) != 0)
+        return cmp;
+
+    return strcmp(entry->arch != NULL ? entry->arch : "", arch != NULL ? arch : "");
+}
+
+/* Looks up cached header of <nevr> (and <arch>).
+ * Position of the entry (or where to insert it) is stored in <*pos>. */
+bool rpm_db_find(struct rpm_db *db, const char *nevr, const char *arch, size_t *pos)
+{
+    size_t low = 0;
+    size_t high = db->entries_len;
+    size_t mid;
+    int cmp;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if ((cmp = rpm_db_compare(&db->entries[mid], nevr, arch)) == 0) {
+            *pos = mid;
+            return true;
+        }
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    *pos = low;
+
+    return false;
+}
+
+/* Caches <header> (taking ownership of it) at position <pos>. */
+int rpm_db_cache(struct rpm_db *db, size_t pos, const char *nevr, const char *arch,
+                 unsigned char *header, size_t header_size)
+{
+    struct rpm_db_entry entry = {.header = header, .header_size = header_size};
+    struct rpm_db_entry *entries;
+    size_t entries_max;
+
+    if (db->entries_len == db->entries_max) {
+        entries_max = (db->entries_max == 0) ? 64 : 2 * db->entries_max;
+        if ((entries = realloc(db->entries, entries_max * sizeof(struct rpm_db_entry))) == NULL)
+            return DRPM_ERR_MEMORY;
+        db->entries = entries;
+        db->entries_max = entries_max;
+    }
+
+    if ((entry.nevr = malloc(strlen(nevr) + 1)) == NULL ||
+        (arch != NULL && (entry.arch = malloc(strlen(arch) + 1)) == NULL)) {
+        free(entry.nevr);
+        return DRPM_ERR_MEMORY;
+    }
+    strcpy(entry.nevr, nevr);
+    if (arch != NULL)
+        strcpy(entry.arch, arch);
+
+    memmove(db->entries + pos + 1, db->entries + pos, (db->entries_len - pos) * sizeof(struct rpm_db_entry));
+    db->entries[pos] = entry;
+    db->entries_len++;
+
+    return DRPM_ERR_OK;
+}
+
+/* Opens rpm database for reading, so that it is not reopened
+ * by each rpm_read_header() call made with the returned handle. */
+int rpm_db_open(struct rpm_db **db_ret)
+{
+    struct rpm_db *db;
+    const char *root;
+    char *dbpath;
+
+    if (db_ret == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((db = malloc(sizeof(struct rpm_db))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    db->path = NULL;
+    db->entries = NULL;
+    db->entries_len = 0;
+    db->entries_max = 0;
+
+    pthread_once(&rpm_config_once, read_rpm_config);
+
+    pthread_mutex_lock(&rpmdb_mutex);
+    if ((db->trans = rpmtsCreate()) != NULL) {
+        rpmtsOpenDB(db->trans, O_RDONLY);
+        root = rpmtsRootDir(db->trans);
+        if ((dbpath = rpmExpand("%{?_dbpath}", NULL)) != NULL && *dbpath != '\0' &&
+            (db->path = malloc((root != NULL ? strlen(root) : 0) + strlen(dbpath) + 1)) != NULL)
+            sprintf(db->path, "%s%s", (root != NULL && strcmp(root, "/") != 0) ? root : "", dbpath);
+        free(dbpath);
+        rpm_db_stamp(db->path, &db->stamp);
+    }
+    pthread_mutex_unlock(&rpmdb_mutex);
+
+    if (db->trans == NULL) {
+        free(db);
+        return DRPM_ERR_CONFIG;
+    }
+
+    *db_ret = db;
+
+    return DRPM_ERR_OK;
+}
+
+int rpm_db_close(struct rpm_db **db)
+{
+    if (db == NULL)
+        return DRPM_ERR_PROG;
+
+    if (*db == NULL)
+        return DRPM_ERR_OK;
+
+    pthread_mutex_lock(&rpmdb_mutex);
+    rpmtsCloseDB((*db)->trans);
+    rpmtsFree((*db)->trans);
+    pthread_mutex_unlock(&rpmdb_mutex);
+
+    rpm_db_flush(*db);
+    free((*db)->entries);
+    free((*db)->path);
+    free(*db);
+    *db = NULL;
+
+    return DRPM_ERR_OK;
+}
+
 /* Reads only the header of an installed RPM from the database.
- * The RPM is identified by its <nevr> string. */
-int rpm_read_header(struct rpm **rpmst, const char *nevr, const char *arch)
+ * The RPM is identified by its <nevr> string (and <arch> if not NULL).
+ * If <db> is NULL, the database is opened just for this lookup,
+ * otherwise headers are cached in <db>. */
+int rpm_read_header(struct rpm **rpmst, struct rpm_db *db, const char *nevr, const char *arch)
 {
     int error = DRPM_ERR_OK;
     rpmts trans = NULL;
+    bool locked = false;
     rpmdbMatchIterator iter = NULL;
     char *name;
     char *epoch = NULL;
@@ -1009,7 +1459,9 @@ int rpm_read_header(struct rpm **rpmst, const char *nevr, const char *arch)
     char *release;
     char *str = NULL;
     unsigned char *header = NULL;
-    size_t header_size;
+    size_t header_size = 0;
+    bool cached = false;
+    size_t cache_pos;
 
     if (rpmst == NULL || nevr == NULL)
         return DRPM_ERR_PROG;
@@ -1052,24 +1504,48 @@ int rpm_read_header(struct rpm **rpmst, const char *nevr, const char *arch)
     }
     name = str;
 
-    rpmReadConfigFiles(NULL, NULL);
+    pthread_once(&rpm_config_once, read_rpm_config);
 
-    trans = rpmtsCreate();
+    pthread_mutex_lock(&rpmdb_mutex);
+    locked = true;
 
-    iter = rpmtsInitIterator(trans, RPMTAG_NAME, name, 0);
-    rpmdbSetIteratorRE(iter, RPMTAG_EPOCH, RPMMIRE_STRCMP, epoch);
-    rpmdbSetIteratorRE(iter, RPMTAG_VERSION, RPMMIRE_STRCMP, version);
-    rpmdbSetIteratorRE(iter, RPMTAG_RELEASE, RPMMIRE_STRCMP, release);
-    if (arch)
-        rpmdbSetIteratorRE(iter, RPMTAG_ARCH, RPMMIRE_STRCMP, arch);
+    if (db != NULL) {
+        rpm_db_validate(db);
+        if ((cached = rpm_db_find(db, nevr, arch, &cache_pos))) {
+            header = db->entries[cache_pos].header;
+            header_size = db->entries[cache_pos].header_size;
+        }
+    }
 
-    if (((*rpmst)->header = rpmdbNextIterator(iter)) == NULL) {
-        error = DRPM_ERR_NOINSTALL;
-        goto cleanup_fail;
+    if (!cached) {
+        trans = (db != NULL) ? db->trans : rpmtsCreate();
+
+        iter = rpmtsInitIterator(trans, RPMTAG_NAME, name, 0);
+        rpmdbSetIteratorRE(iter, RPMTAG_EPOCH, RPMMIRE_STRCMP, epoch);
+        rpmdbSetIteratorRE(iter, RPMTAG_VERSION, RPMMIRE_STRCMP, version);
+        rpmdbSetIteratorRE(iter, RPMTAG_RELEASE, RPMMIRE_STRCMP, release);
+        if (arch)
+            rpmdbSetIteratorRE(iter, RPMTAG_ARCH, RPMMIRE_STRCMP, arch);
+
+        if (((*rpmst)->header = rpmdbNextIterator(iter)) != NULL) {
+            error = rpm_export_header(*rpmst, &header, &header_size);
+            (*rpmst)->header = NULL; // owned by iterator
+            if (error != DRPM_ERR_OK)
+                goto cleanup_fail;
+        }
+
+        /* not installed packages are cached as well */
+        if (db != NULL) {
+            if ((error = rpm_db_cache(db, cache_pos, nevr, arch, header, header_size)) != DRPM_ERR_OK)
+                goto cleanup_fail;
+            cached = true;
+        }
     }
 
-    if ((error = rpm_export_header(*rpmst, &header, &header_size)) != DRPM_ERR_OK)
+    if (header == NULL) {
+        error = DRPM_ERR_NOINSTALL;
         goto cleanup_fail;
+    }
 
     if (((*rpmst)->header = headerImport(header + sizeof(rpm_header_magic), 0, HEADERIMPORT_COPY)) == NULL) {
         error = DRPM_ERR_OTHER;
@@ -1086,8 +1562,16 @@ cleanup_fail:
     }
 
 cleanup:
-    rpmdbFreeIterator(iter);
-    rpmtsFree(trans);
+    if (locked) {
+        if (trans != NULL) {
+            rpmdbFreeIterator(iter);
+            if (db == NULL)
+                rpmtsFree(trans);
+        }
+        pthread_mutex_unlock(&rpmdb_mutex);
+    }
+    if (!cached)
+        free(header);
     free(str);
 
     return error;
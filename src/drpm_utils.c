@@ -30,8 +30,24 @@
 #include <sys/types.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BYTES_X86
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define BYTES_NEON
+#endif
+
+#define SWAR_LOW 0x7F7F7F7F7F7F7F7FULL
+#define SWAR_HIGH 0x8080808080808080ULL
 
 static bool resize(void **, size_t, size_t, size_t);
+static void bytes_add_generic(unsigned char *, const unsigned char *, size_t);
+static void bytes_sub_generic(unsigned char *, const unsigned char *, const unsigned char *, size_t);
+#ifdef BYTES_X86
+static void bytes_add_avx2(unsigned char *, const unsigned char *, size_t);
+static void bytes_sub_avx2(unsigned char *, const unsigned char *, const unsigned char *, size_t);
+#endif
 
 /* Reads 16-byte integer in network byte order buffer. */
 uint16_t parse_be16(const unsigned char buffer[2])
@@ -83,15 +99,6 @@ void create_be64(uint64_t in, unsigned char out[8])
     out[7] = in;
 }
 
-int md5_update_be32(MD5_CTX *md5, uint32_t number)
-{
-    unsigned char be32[4];
-
-    create_be32(number, be32);
-
-    return MD5_Update(md5, be32, 4);
-}
-
 /* Represents array of bytes pointed to by <source> of size <count>
  * as human-readable ASCII hexadecimals and stores this string in
  * <dest> (should be at least of size <count> * 2 + 1). */
@@ -178,3 +185,147 @@ bool resize32(void **buffer, size_t members_count, size_t member_size)
 {
     return resize(buffer, members_count, member_size, 32);
 }
+
+/****************************** byte arrays ******************************/
+
+/* Byte-wise addition and subtraction (modulo 256) used for add blocks.
+ * Vectorized with SSE2 (baseline on x86-64) or AVX2 (detected at runtime)
+ * on x86, NEON on AArch64, and 64-bit SWAR arithmetic elsewhere. */
+
+/* adds 8 bytes at a time without carries between bytes */
+void bytes_add_generic(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    uint64_t a;
+    uint64_t b;
+    size_t i = 0;
+
+    for ( ; i + 8 <= len; i += 8) {
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a = ((a & SWAR_LOW) + (b & SWAR_LOW)) ^ ((a ^ b) & SWAR_HIGH);
+        memcpy(dst + i, &a, 8);
+    }
+
+    for ( ; i < len; i++)
+        dst[i] += src[i];
+}
+
+/* subtracts 8 bytes at a time without borrows between bytes */
+void bytes_sub_generic(unsigned char *dst, const unsigned char *minuend,
+                       const unsigned char *subtrahend, size_t len)
+{
+    uint64_t a;
+    uint64_t b;
+    size_t i = 0;
+
+    for ( ; i + 8 <= len; i += 8) {
+        memcpy(&a, minuend + i, 8);
+        memcpy(&b, subtrahend + i, 8);
+        a = ((a | SWAR_HIGH) - (b & SWAR_LOW)) ^ ((a ^ ~b) & SWAR_HIGH);
+        memcpy(dst + i, &a, 8);
+    }
+
+    for ( ; i < len; i++)
+        dst[i] = minuend[i] - subtrahend[i];
+}
+
+#ifdef BYTES_X86
+__attribute__((target("avx2")))
+void bytes_add_avx2(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    size_t i = 0;
+
+    for ( ; i + 32 <= len; i += 32)
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_add_epi8(_mm256_loadu_si256((const __m256i *)(dst + i)),
+                                            _mm256_loadu_si256((const __m256i *)(src + i))));
+
+    bytes_add_generic(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+void bytes_sub_avx2(unsigned char *dst, const unsigned char *minuend,
+                    const unsigned char *subtrahend, size_t len)
+{
+    size_t i = 0;
+
+    for ( ; i + 32 <= len; i += 32)
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(minuend + i)),
+                                            _mm256_loadu_si256((const __m256i *)(subtrahend + i))));
+
+    bytes_sub_generic(dst + i, minuend + i, subtrahend + i, len - i);
+}
+#endif
+
+/* <dst>[i] += <src>[i] for <len> bytes */
+void bytes_add(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    size_t i = 0;
+
+#ifdef BYTES_X86
+    if (__builtin_cpu_supports("avx2")) {
+        bytes_add_avx2(dst, src, len);
+        return;
+    }
+#ifdef __SSE2__
+    for ( ; i + 16 <= len; i += 16)
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_add_epi8(_mm_loadu_si128((const __m128i *)(dst + i)),
+                                      _mm_loadu_si128((const __m128i *)(src + i))));
+#endif
+#elif defined(BYTES_NEON)
+    for ( ; i + 16 <= len; i += 16)
+        vst1q_u8(dst + i, vaddq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+#endif
+
+    bytes_add_generic(dst + i, src + i, len - i);
+}
+
+/* <dst>[i] = <minuend>[i] - <subtrahend>[i] for <len> bytes */
+void bytes_sub(unsigned char *dst, const unsigned char *minuend,
+               const unsigned char *subtrahend, size_t len)
+{
+    size_t i = 0;
+
+#ifdef BYTES_X86
+    if (__builtin_cpu_supports("avx2")) {
+        bytes_sub_avx2(dst, minuend, subtrahend, len);
+        return;
+    }
+#ifdef __SSE2__
+    for ( ; i + 16 <= len; i += 16)
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(minuend + i)),
+                                      _mm_loadu_si128((const __m128i *)(subtrahend + i))));
+#endif
+#elif defined(BYTES_NEON)
+    for ( ; i + 16 <= len; i += 16)
+        vst1q_u8(dst + i, vsubq_u8(vld1q_u8(minuend + i), vld1q_u8(subtrahend + i)));
+#endif
+
+    bytes_sub_generic(dst + i, minuend + i, subtrahend + i, len - i);
+}
+
+/* returns true if all <len> bytes are zero */
+bool bytes_zero(const unsigned char *buffer, size_t len)
+{
+    uint64_t word;
+    size_t i = 0;
+
+    for ( ; i + 32 <= len; i += 32) {
+        uint64_t acc = 0;
+        for (unsigned short j = 0; j < 32; j += 8) {
+            memcpy(&word, buffer + i + j, 8);
+            acc |= word;
+        }
+        if (acc != 0)
+            return false;
+    }
+
+    for ( ; i < len; i++)
+        if (buffer[i] != 0)
+            return false;
+
+    return true;
+}
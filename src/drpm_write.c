@@ -18,24 +18,47 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* copy_file_range(), fallocate(), O_DIRECT */
+#define _GNU_SOURCE
+
 #include "drpm.h"
 #include "drpm_private.h"
 
 #include <stdio.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <openssl/md5.h>
 #include <rpm/rpmlib.h>
 
+#define SINK_BUFFER_SIZE (1 << 20)
+#define SINK_COPY_BUFFER_SIZE (1 << 16)
+#define SINK_ALIGNMENT 4096
+
+/* Destination of written data, either a file descriptor
+ * or a callback receiving data in large chunks. */
+struct sink {
+    int filedesc; // file descriptor (if no callback)
+    bool direct; // writing aligned blocks with O_DIRECT
+    bool direct_fd; // file descriptor opened with O_DIRECT
+    drpm_write_func write_func; // callback
+    void *write_arg; // callback argument
+    unsigned char *buffer; // data not yet written
+    size_t buffer_len; // length of buffered data
+};
+
 /* Wrapper for struct compstrm. Used to prepend uncompressed header. */
 struct compstrm_wrapper {
     struct compstrm *strm; // compression stream
-    int filedesc; // file descriptor
+    struct sink *sink; // output
     size_t uncomp_len; // length of uncompressed data
     size_t uncomp_left; // how much uncompressed data left to write
-    unsigned char *uncomp_data; // uncompressed data
+    struct digest *md5; // MD5 of all written data
 };
 
+static int hash_range(int, off_t, size_t, struct digest *, unsigned char *);
+static int write_buffered(struct sink *, const void *, size_t);
+
 /* Writes 32-byte integer in network byte order to file. */
 int write_be32(int filedesc, uint32_t number)
 {
@@ -76,7 +99,7 @@ int write_deltarpm(struct deltarpm *delta)
     uint32_t ext_copies_size;
     unsigned char *header = NULL;
     uint32_t header_size;
-    MD5_CTX md5;
+    struct digest md5 = {0};
     unsigned char md5_digest[MD5_DIGEST_LENGTH] = {0};
     unsigned char *strm_data = NULL;
     size_t strm_data_len;
@@ -92,7 +115,7 @@ int write_deltarpm(struct deltarpm *delta)
 
     src_nevr_len = strlen(delta->src_nevr) + 1;
 
-    if ((error = compstrm_init(&stream, -1, delta->comp, (int)delta->comp_level)) != DRPM_ERR_OK ||
+    if ((error = compstrm_init(&stream, NULL, delta->comp, (int)delta->comp_level, NULL)) != DRPM_ERR_OK ||
         (error = compstrm_write(stream, 4, version)) != DRPM_ERR_OK ||
         (error = compstrm_write_be32(stream, src_nevr_len)) != DRPM_ERR_OK ||
         (error = compstrm_write(stream, src_nevr_len, delta->src_nevr)) != DRPM_ERR_OK ||
@@ -210,11 +233,15 @@ int write_deltarpm(struct deltarpm *delta)
         if ((error = rpm_fetch_header(delta->head.tgt_rpm, &header, &header_size)) != DRPM_ERR_OK)
             return error;
 
-        if (MD5_Init(&md5) != 1 ||
-            MD5_Update(&md5, header, header_size) != 1 ||
-            MD5_Update(&md5, strm_data, strm_data_len) != 1 ||
-            MD5_Final(md5_digest, &md5) != 1)
-            return DRPM_ERR_OTHER;
+        if ((error = digest_init(&md5, DIGEST_MASK(DIGESTALGO_MD5))) != DRPM_ERR_OK)
+            return error;
+
+        if ((error = digest_update(&md5, header, header_size)) != DRPM_ERR_OK ||
+            (error = digest_update(&md5, strm_data, strm_data_len)) != DRPM_ERR_OK ||
+            (error = digest_final(&md5, DIGESTALGO_MD5, md5_digest)) != DRPM_ERR_OK) {
+            digest_destroy(&md5);
+            return error;
+        }
 
         if ((error = rpm_signature_empty(delta->head.tgt_rpm)) != DRPM_ERR_OK ||
             (error = rpm_signature_set_size(delta->head.tgt_rpm, header_size + strm_data_len)) != DRPM_ERR_OK ||
@@ -295,33 +322,32 @@ cleanup:
     return error;
 }
 
-/* Wrapper functions for compstrm. Used to prepend uncompressed header. */
+/* Wrapper functions for compstrm. Used to prepend uncompressed header.
+ * All written data is passed on to <sink> and/or hashed with <md5>
+ * as it is written, nothing is kept for compstrm_wrapper_finish(). */
 
 int compstrm_wrapper_init(struct compstrm_wrapper **csw, size_t uncomp_len,
-                          int filedesc, unsigned short comp, int level)
+                          struct sink *sink, unsigned short comp, int level,
+                          struct digest *md5)
 {
     int error;
 
-    if (csw == NULL || filedesc < 0)
+    if (csw == NULL || (sink == NULL && md5 == NULL))
         return DRPM_ERR_PROG;
 
-    if ((*csw = malloc(sizeof(struct compstrm_wrapper))) == NULL ||
-        ((*csw)->uncomp_data = malloc(uncomp_len)) == NULL) {
-        free(*csw);
-        *csw = NULL;
+    if ((*csw = malloc(sizeof(struct compstrm_wrapper))) == NULL)
         return DRPM_ERR_MEMORY;
-    }
 
-    if ((error = compstrm_init(&(*csw)->strm, filedesc, comp, level)) != DRPM_ERR_OK) {
-        free((*csw)->uncomp_data);
+    if ((error = compstrm_init(&(*csw)->strm, sink, comp, level, md5)) != DRPM_ERR_OK) {
         free(*csw);
         *csw = NULL;
         return error;
     }
 
-    (*csw)->filedesc = filedesc;
+    (*csw)->sink = sink;
     (*csw)->uncomp_len = uncomp_len;
     (*csw)->uncomp_left = uncomp_len;
+    (*csw)->md5 = md5;
 
     return DRPM_ERR_OK;
 }
@@ -332,7 +358,6 @@ int compstrm_wrapper_destroy(struct compstrm_wrapper **csw)
         return DRPM_ERR_PROG;
 
     compstrm_destroy(&(*csw)->strm);
-    free((*csw)->uncomp_data);
     free(*csw);
 
     return DRPM_ERR_OK;
@@ -342,7 +367,9 @@ int compstrm_wrapper_write(struct compstrm_wrapper *csw, const unsigned char *bu
 {
     size_t write_len;
 
-    if (csw == NULL || csw->strm == NULL || csw->filedesc < 0)
+    int error;
+
+    if (csw == NULL || csw->strm == NULL)
         return DRPM_ERR_PROG;
 
     if (csw->uncomp_left > 0) {
@@ -353,9 +380,12 @@ int compstrm_wrapper_write(struct compstrm_wrapper *csw, const unsigned char *bu
             return DRPM_ERR_PROG;
 
         write_len = MIN(csw->uncomp_left, buffer_len);
-        if (write(csw->filedesc, buffer, write_len) != (ssize_t)write_len)
-            return DRPM_ERR_IO;
-        memcpy(csw->uncomp_data + csw->uncomp_len - csw->uncomp_left, buffer, write_len);
+        if (csw->sink != NULL &&
+            (error = sink_write(csw->sink, buffer, write_len)) != DRPM_ERR_OK)
+            return error;
+        if (csw->md5 != NULL &&
+            (error = digest_update(csw->md5, buffer, write_len)) != DRPM_ERR_OK)
+            return error;
         buffer += write_len;
         buffer_len -= write_len;
         csw->uncomp_left -= write_len;
@@ -364,27 +394,278 @@ int compstrm_wrapper_write(struct compstrm_wrapper *csw, const unsigned char *bu
     return compstrm_write(csw->strm, buffer_len, buffer);
 }
 
-int compstrm_wrapper_finish(struct compstrm_wrapper *csw, unsigned char **data, size_t *data_len)
+int compstrm_wrapper_finish(struct compstrm_wrapper *csw)
+{
+    if (csw == NULL)
+        return DRPM_ERR_PROG;
+
+    return compstrm_finish(csw->strm, NULL, NULL);
+}
+
+/* Sink functions. Data written to a sink is buffered until there
+ * is enough of it to be written at once or sink_flush() is called. */
+
+/* If <direct> is true, <filedesc> has been opened with O_DIRECT,
+ * which requires data to be written in aligned blocks at aligned offsets.
+ * Data that cannot be (an unaligned tail, or everything if the current
+ * offset is unaligned) is written with O_DIRECT cleared temporarily,
+ * restoring the file status flags afterwards, as the descriptor may
+ * belong to the caller. */
+int sink_init_fd(struct sink **sink, int filedesc, bool direct)
+{
+    void *buffer;
+    off_t offset;
+
+    if (sink == NULL || filedesc < 0)
+        return DRPM_ERR_PROG;
+
+    if ((*sink = malloc(sizeof(struct sink))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if (posix_memalign(&buffer, SINK_ALIGNMENT, SINK_BUFFER_SIZE) != 0) {
+        free(*sink);
+        *sink = NULL;
+        return DRPM_ERR_MEMORY;
+    }
+
+    (*sink)->filedesc = filedesc;
+    (*sink)->direct = (direct && (offset = lseek(filedesc, 0, SEEK_CUR)) != (off_t)-1 &&
+                       offset % SINK_ALIGNMENT == 0);
+    (*sink)->direct_fd = direct;
+    (*sink)->write_func = NULL;
+    (*sink)->write_arg = NULL;
+    (*sink)->buffer = buffer;
+    (*sink)->buffer_len = 0;
+
+    return DRPM_ERR_OK;
+}
+
+int sink_init_func(struct sink **sink, drpm_write_func write_func, void *write_arg)
+{
+    if (sink == NULL || write_func == NULL)
+        return DRPM_ERR_PROG;
+
+    if ((*sink = malloc(sizeof(struct sink))) == NULL)
+        return DRPM_ERR_MEMORY;
+
+    if (((*sink)->buffer = malloc(SINK_BUFFER_SIZE)) == NULL) {
+        free(*sink);
+        *sink = NULL;
+        return DRPM_ERR_MEMORY;
+    }
+
+    (*sink)->filedesc = -1;
+    (*sink)->direct = false;
+    (*sink)->direct_fd = false;
+    (*sink)->write_func = write_func;
+    (*sink)->write_arg = write_arg;
+    (*sink)->buffer_len = 0;
+
+    return DRPM_ERR_OK;
+}
+
+/* Frees sink without flushing it. File descriptor is not closed. */
+int sink_destroy(struct sink **sink)
+{
+    if (sink == NULL || *sink == NULL)
+        return DRPM_ERR_PROG;
+
+    free((*sink)->buffer);
+    free(*sink);
+    *sink = NULL;
+
+    return DRPM_ERR_OK;
+}
+
+/* Announces that about <len> more bytes will be written, so that space
+ * can be reserved in the output file up front. Merely a hint. */
+int sink_allocate(struct sink *sink, uint64_t len)
+{
+    off_t offset;
+
+    if (sink == NULL)
+        return DRPM_ERR_PROG;
+
+    if (sink->write_func == NULL && len > 0 &&
+        (offset = lseek(sink->filedesc, 0, SEEK_CUR)) != (off_t)-1)
+        fallocate(sink->filedesc, FALLOC_FL_KEEP_SIZE, offset + sink->buffer_len, len);
+
+    return DRPM_ERR_OK;
+}
+
+/* Writes <data> to file descriptor of <sink> without O_DIRECT. */
+int write_buffered(struct sink *sink, const void *data, size_t len)
+{
+    int error = DRPM_ERR_OK;
+    int flags;
+
+    if (!sink->direct_fd)
+        return (write(sink->filedesc, data, len) == (ssize_t)len) ? DRPM_ERR_OK : DRPM_ERR_IO;
+
+    if ((flags = fcntl(sink->filedesc, F_GETFL)) == -1 ||
+        fcntl(sink->filedesc, F_SETFL, flags & ~O_DIRECT) == -1)
+        return DRPM_ERR_IO;
+
+    if (write(sink->filedesc, data, len) != (ssize_t)len)
+        error = DRPM_ERR_IO;
+
+    if (fcntl(sink->filedesc, F_SETFL, flags) == -1 && error == DRPM_ERR_OK)
+        error = DRPM_ERR_IO;
+
+    return error;
+}
+
+int sink_flush(struct sink *sink)
 {
     int error;
-    unsigned char *data_tmp;
+    size_t aligned_len;
 
-    if (csw == NULL)
+    if (sink == NULL)
         return DRPM_ERR_PROG;
 
-    if ((error = compstrm_finish(csw->strm, data, data_len)) != DRPM_ERR_OK)
+    if (sink->buffer_len == 0)
+        return DRPM_ERR_OK;
+
+    if (sink->write_func != NULL) {
+        if (sink->write_func(sink->write_arg, sink->buffer, sink->buffer_len) != 0)
+            return DRPM_ERR_IO;
+    } else if (sink->direct) {
+        aligned_len = sink->buffer_len - sink->buffer_len % SINK_ALIGNMENT;
+        if (aligned_len > 0 &&
+            write(sink->filedesc, sink->buffer, aligned_len) != (ssize_t)aligned_len)
+            return DRPM_ERR_IO;
+        /* unaligned tail cannot be written with O_DIRECT (nor anything after it) */
+        if (aligned_len < sink->buffer_len) {
+            sink->direct = false;
+            if ((error = write_buffered(sink, sink->buffer + aligned_len,
+                                        sink->buffer_len - aligned_len)) != DRPM_ERR_OK)
+                return error;
+        }
+    } else if ((error = write_buffered(sink, sink->buffer, sink->buffer_len)) != DRPM_ERR_OK) {
         return error;
+    }
 
-    if ((data_tmp = realloc(*data, csw->uncomp_len + *data_len)) == NULL) {
-        free(*data);
-        return DRPM_ERR_MEMORY;
+    sink->buffer_len = 0;
+
+    return DRPM_ERR_OK;
+}
+
+int sink_write(struct sink *sink, const void *data, size_t len)
+{
+    const unsigned char *ptr = data;
+    size_t write_len;
+    int error;
+
+    if (sink == NULL || (data == NULL && len > 0))
+        return DRPM_ERR_PROG;
+
+    /* large writes to a file bypass the buffer (unless alignment matters) */
+    if (sink->write_func == NULL && !sink->direct &&
+        sink->buffer_len == 0 && len >= SINK_BUFFER_SIZE)
+        return write_buffered(sink, data, len);
+
+    while (len > 0) {
+        write_len = MIN(len, SINK_BUFFER_SIZE - sink->buffer_len);
+        memcpy(sink->buffer + sink->buffer_len, ptr, write_len);
+        sink->buffer_len += write_len;
+        ptr += write_len;
+        len -= write_len;
+
+        if (sink->buffer_len == SINK_BUFFER_SIZE &&
+            (error = sink_flush(sink)) != DRPM_ERR_OK)
+            return error;
     }
 
-    memmove(data_tmp + csw->uncomp_len, data_tmp, *data_len);
-    memcpy(data_tmp, csw->uncomp_data, csw->uncomp_len);
+    return DRPM_ERR_OK;
+}
+
+/* Hashes <len> bytes of file <filedesc> at <offset>, reading them into <buffer>. */
+int hash_range(int filedesc, off_t offset, size_t len, struct digest *dgst, unsigned char *buffer)
+{
+    int error;
+    ssize_t read_len;
 
-    *data = data_tmp;
-    *data_len += csw->uncomp_len;
+    while (len > 0) {
+        if ((read_len = pread(filedesc, buffer, MIN(len, SINK_COPY_BUFFER_SIZE), offset)) <= 0)
+            return DRPM_ERR_IO;
+        if ((error = digest_update(dgst, buffer, read_len)) != DRPM_ERR_OK)
+            return error;
+        offset += read_len;
+        len -= read_len;
+    }
 
     return DRPM_ERR_OK;
 }
+
+/* Copies <len> bytes from file <filedesc> at <offset> to sink.
+ * File descriptor sinks use copy_file_range() where possible (but not
+ * with O_DIRECT), which avoids copying data through user space (or shares
+ * extents altogether on filesystems supporting reflinks).
+ * Copied data is hashed with <dgst> (if not NULL) as it is written,
+ * so the digest covers the output even if the file changes meanwhile.
+ * Data copied with copy_file_range() is therefore read back from the
+ * output, which is only done if that has been opened for reading. */
+int sink_copy_range(struct sink *sink, int filedesc, off_t offset, size_t len, struct digest *dgst)
+{
+    int error = DRPM_ERR_OK;
+    unsigned char *buffer;
+    ssize_t read_len;
+#ifdef HAVE_COPY_FILE_RANGE
+    bool copy_range;
+    int flags;
+    off_t out_offset = 0;
+    ssize_t copied;
+#endif
+
+    if (sink == NULL || filedesc < 0)
+        return DRPM_ERR_PROG;
+
+    if ((buffer = malloc(SINK_COPY_BUFFER_SIZE)) == NULL)
+        return DRPM_ERR_MEMORY;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    copy_range = (sink->write_func == NULL && !sink->direct_fd &&
+                  (dgst == NULL ||
+                   ((flags = fcntl(sink->filedesc, F_GETFL)) != -1 && (flags & O_ACCMODE) == O_RDWR)));
+
+    if (copy_range && (error = sink_flush(sink)) != DRPM_ERR_OK)
+        goto cleanup;
+
+    if (copy_range && dgst != NULL &&
+        (out_offset = lseek(sink->filedesc, 0, SEEK_CUR)) == (off_t)-1)
+        copy_range = false;
+
+    while (copy_range && len > 0) {
+        if ((copied = copy_file_range(filedesc, &offset, sink->filedesc, NULL, len, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            /* not supported for these files, falling back to copying */
+            break;
+        }
+        if (copied == 0)
+            break;
+        if (dgst != NULL &&
+            (error = hash_range(sink->filedesc, out_offset, copied, dgst, buffer)) != DRPM_ERR_OK)
+            goto cleanup;
+        out_offset += copied;
+        len -= copied;
+    }
+#endif
+
+    while (len > 0) {
+        if ((read_len = pread(filedesc, buffer, MIN(len, SINK_COPY_BUFFER_SIZE), offset)) <= 0) {
+            error = (read_len < 0) ? DRPM_ERR_IO : DRPM_ERR_FORMAT;
+            goto cleanup;
+        }
+        if ((dgst != NULL && (error = digest_update(dgst, buffer, read_len)) != DRPM_ERR_OK) ||
+            (error = sink_write(sink, buffer, read_len)) != DRPM_ERR_OK)
+            goto cleanup;
+        offset += read_len;
+        len -= read_len;
+    }
+
+cleanup:
+    free(buffer);
+
+    return error;
+}
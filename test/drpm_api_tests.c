@@ -18,19 +18,28 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* O_DIRECT */
+#define _GNU_SOURCE
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
 #include "../src/drpm.h"
+#include "../src/drpm_private.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <openssl/md5.h>
+#include <openssl/sha.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -56,8 +65,27 @@
 #define RPMOUT_RPMONLY_NOADDBLK "rpmonly-noaddblk.rpm"
 #define RPMOUT_STANDARD_LZIP "standard-lzip.rpm"
 #define RPMOUT_STANDARD_ZSTD "standard-zstd.rpm"
+#define RPMOUT_STANDARD_OPTIONS "standard-options.rpm"
+#define RPMOUT_STANDARD_FD "standard-fd.rpm"
+#define RPMOUT_STANDARD_UNCOMP "standard-uncomp.rpm"
+#define RPMOUT_RPMONLY_UNCOMP "rpmonly-uncomp.rpm"
+#define RPMOUT_CONCURRENT_FORMAT "concurrent-%u.rpm"
+#define RPMOUT_COPY_RANGE "copy-range.bin"
+#define RPMOUT_DIRECT "direct.bin"
+#define DIRECT_LEN 10000
+#define COPY_RANGE_LEN 4000
+#define RPMOUT_BATCH_STANDARD "batch-standard.rpm"
+#define RPMOUT_BATCH_RPMONLY "batch-rpmonly.rpm"
+#define RPMOUT_BATCH_NOADDBLK "batch-noaddblk.rpm"
+
+#define CONCURRENT_APPLIES 8
 
 #define SEQFILE "seqfile.txt"
+#define DIGEST_CACHE "digest-cache.bin"
+#define PRELINK_UNDONE "prelink-undone.bin"
+#define PRELINK_UNDONE_BIG "prelink-undone-big.bin"
+#define DELTARPM_CHANGED "changed.drpm"
+#define DELTARPM_CHANGED_TMP "changed.drpm.tmp"
 
 // garbage collector for drpm_read tests
 struct read_deltas {
@@ -83,6 +111,21 @@ static off_t filesize(const char *path)
     return stats.st_size;
 }
 
+static void copy_file(const char *src, const char *dst)
+{
+    FILE *in;
+    FILE *out;
+    char buffer[BUFSIZ];
+    size_t len;
+
+    assert_non_null(in = fopen(src, "rb"));
+    assert_non_null(out = fopen(dst, "wb"));
+    while ((len = fread(buffer, 1, sizeof(buffer), in)) > 0)
+        assert_int_equal(len, fwrite(buffer, 1, len, out));
+    assert_int_equal(0, fclose(in));
+    assert_int_equal(0, fclose(out));
+}
+
 /***************************** drpm_make ******************************/
 
 static int make_setup(void **state)
@@ -912,6 +955,31 @@ static void read_standard_zstd(void **state)
 }
 #endif
 
+static void read_changed(void **state)
+{
+    (void)state;
+    drpm *delta = NULL;
+    char *src_nevr = NULL;
+    unsigned long *int_copies = NULL;
+    unsigned long int_copies_size;
+
+    copy_file(DELTARPM_RPMONLY, DELTARPM_CHANGED);
+    assert_int_equal(DRPM_ERR_OK, drpm_read(&delta, DELTARPM_CHANGED));
+
+    /* copies are read on demand, the file is a different DeltaRPM by now
+     * (of the same packages, so only the file itself tells them apart) */
+    copy_file(DELTARPM_RPMONLY_NOADDBLK, DELTARPM_CHANGED_TMP);
+    assert_int_equal(0, rename(DELTARPM_CHANGED_TMP, DELTARPM_CHANGED));
+    assert_int_equal(DRPM_ERR_OK, drpm_get_string(delta, DRPM_TAG_SRCNEVR, &src_nevr));
+    assert_non_null(src_nevr);
+    assert_int_equal(DRPM_ERR_MISMATCH, drpm_get_ulong_array(delta, DRPM_TAG_INTCOPIES, &int_copies, &int_copies_size));
+    assert_null(int_copies);
+
+    free(src_nevr);
+    assert_int_equal(DRPM_ERR_OK, drpm_destroy(&delta));
+    assert_int_equal(0, remove(DELTARPM_CHANGED));
+}
+
 /************************ drpm_check_sequence *************************/
 
 static int check_setup(void **state)
@@ -950,6 +1018,325 @@ static void check_sequence(void **state)
     assert_int_equal(DRPM_ERR_OK, drpm_check_sequence(OLDRPM_1, (const char *)*state, DRPM_CHECK_NONE));
 }
 
+static void check_sequence_batch(void **state)
+{
+    (void)state;
+    int errors[3];
+    const char *sequences[] = {
+        "garbage",
+        NULL,
+        "drpm-nonexistent-1.0-1-00000000000000000000000000000000"
+    };
+
+    assert_int_equal(DRPM_ERR_OK, drpm_check_sequence_batch(NULL, 0, DRPM_CHECK_FULL, NULL));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_check_sequence_batch(sequences, 3, -1, errors));
+
+    assert_int_equal(DRPM_ERR_FORMAT, drpm_check_sequence_batch(sequences, 3, DRPM_CHECK_FILESIZES, errors));
+    assert_int_equal(DRPM_ERR_FORMAT, errors[0]);
+    assert_int_equal(DRPM_ERR_ARGS, errors[1]);
+    assert_int_equal(DRPM_ERR_NOINSTALL, errors[2]);
+}
+
+struct concurrent_check {
+    bool prepare;
+    int error;
+};
+
+static void *check_concurrent_thread(void *arg)
+{
+    struct concurrent_check *job = arg;
+    drpm_prepared *prep = NULL;
+
+    /* both look up the source package in the rpm database */
+    if (job->prepare)
+        job->error = drpm_prepare(&prep, DELTARPM_STANDARD, DRPM_CHECK_FILESIZES);
+    else
+        job->error = drpm_check_sequence(NULL, "drpm-nonexistent-1.0-1-00000000000000000000000000000000",
+                                         DRPM_CHECK_FILESIZES);
+
+    if (prep != NULL)
+        drpm_prepared_destroy(&prep);
+
+    return NULL;
+}
+
+// filesystem data of uninstalled RPMs, from several threads at once
+static void check_concurrent(void **state)
+{
+    (void)state;
+    pthread_t threads[CONCURRENT_APPLIES];
+    struct concurrent_check jobs[CONCURRENT_APPLIES];
+
+    for (unsigned i = 0; i < CONCURRENT_APPLIES; i++) {
+        jobs[i].prepare = (i % 2 == 1);
+        jobs[i].error = -1;
+        assert_int_equal(0, pthread_create(&threads[i], NULL, check_concurrent_thread, &jobs[i]));
+    }
+
+    for (unsigned i = 0; i < CONCURRENT_APPLIES; i++) {
+        assert_int_equal(0, pthread_join(threads[i], NULL));
+        assert_int_equal(DRPM_ERR_NOINSTALL, jobs[i].error);
+    }
+}
+
+static void check_digest_cache(void **state)
+{
+    (void)state;
+    FILE *file;
+
+    /* malformed cache files are ignored */
+    assert_non_null(file = fopen(DIGEST_CACHE, "w"));
+    fputs("garbage", file);
+    fclose(file);
+
+    assert_int_equal(DRPM_ERR_OK, drpm_set_digest_cache(DIGEST_CACHE, 0));
+    assert_int_equal(DRPM_ERR_OK, drpm_set_digest_cache(DIGEST_CACHE, 16));
+    assert_int_equal(DRPM_ERR_OK, drpm_set_digest_cache(NULL, 0));
+}
+
+static void check_digest_cache_entries(void **state)
+{
+    (void)state;
+    struct stat stats;
+    struct stat changed;
+    const unsigned char digest[MD5_DIGEST_LENGTH] = "0123456789abcdef";
+    unsigned char cached[MD5_DIGEST_LENGTH];
+    bool found;
+
+    remove(DIGEST_CACHE);
+    assert_int_equal(0, stat(OLDRPM_1, &stats));
+    assert_int_equal(DRPM_ERR_OK, drpm_set_digest_cache(DIGEST_CACHE, 16));
+
+    digest_cache_lookup(&stats, DIGESTALGO_MD5, cached, &found);
+    assert_false(found);
+
+    /* stored digest is reused */
+    digest_cache_store(&stats, DIGESTALGO_MD5, digest);
+    digest_cache_lookup(&stats, DIGESTALGO_MD5, cached, &found);
+    assert_true(found);
+    assert_memory_equal(digest, cached, MD5_DIGEST_LENGTH);
+    digest_cache_lookup(&stats, DIGESTALGO_SHA256, cached, &found);
+    assert_false(found);
+
+    /* changed files are hashed again */
+    changed = stats;
+    changed.st_size++;
+    digest_cache_lookup(&changed, DIGESTALGO_MD5, cached, &found);
+    assert_false(found);
+    changed = stats;
+    changed.st_mtime++;
+    digest_cache_lookup(&changed, DIGESTALGO_MD5, cached, &found);
+    assert_false(found);
+    changed = stats;
+    changed.st_ctime++;
+    digest_cache_lookup(&changed, DIGESTALGO_MD5, cached, &found);
+    assert_false(found);
+
+    /* digests are kept across cache reloads */
+    assert_int_equal(DRPM_ERR_OK, digest_cache_flush());
+    assert_true(filesize(DIGEST_CACHE) > 0);
+    assert_int_equal(DRPM_ERR_OK, drpm_set_digest_cache(DIGEST_CACHE, 16));
+    digest_cache_lookup(&stats, DIGESTALGO_MD5, cached, &found);
+    assert_true(found);
+    assert_memory_equal(digest, cached, MD5_DIGEST_LENGTH);
+
+    /* cache is not rewritten if nothing has been added */
+    assert_int_equal(0, remove(DIGEST_CACHE));
+    digest_cache_lookup(&stats, DIGESTALGO_MD5, cached, &found);
+    assert_true(found);
+    assert_int_equal(DRPM_ERR_OK, digest_cache_flush());
+    assert_int_equal(-1, filesize(DIGEST_CACHE));
+
+    /* a lower limit keeps the most recently used digests of a saved cache */
+    assert_int_equal(DRPM_ERR_OK, drpm_set_digest_cache(DIGEST_CACHE, 16));
+    for (ino_t ino = 1; ino <= 4; ino++) {
+        changed = stats;
+        changed.st_ino = ino;
+        digest_cache_store(&changed, DIGESTALGO_MD5, digest);
+    }
+    changed.st_ino = 1;
+    digest_cache_lookup(&changed, DIGESTALGO_MD5, cached, &found);
+    assert_true(found);
+    assert_int_equal(DRPM_ERR_OK, digest_cache_flush());
+    assert_int_equal(DRPM_ERR_OK, drpm_set_digest_cache(DIGEST_CACHE, 2));
+    for (ino_t ino = 1; ino <= 4; ino++) {
+        changed.st_ino = ino;
+        digest_cache_lookup(&changed, DIGESTALGO_MD5, cached, &found);
+        assert_int_equal(ino == 1 || ino == 4, found);
+    }
+
+    assert_int_equal(DRPM_ERR_OK, drpm_set_digest_cache(NULL, 0));
+}
+
+// number of file descriptors open in this process
+static size_t open_fds(void)
+{
+    DIR *dir;
+    size_t count = 0;
+
+    assert_non_null(dir = opendir("/proc/self/fd"));
+    while (readdir(dir) != NULL)
+        count++;
+    closedir(dir);
+
+    return count;
+}
+
+// stats of a (fake) original file, only compared by the cache
+static struct stat prelink_stats(ino_t ino)
+{
+    struct stat stats;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.st_dev = 1;
+    stats.st_ino = ino;
+    stats.st_size = 1000;
+    stats.st_mtim.tv_sec = 1000;
+    stats.st_ctim.tv_sec = 2000;
+
+    return stats;
+}
+
+static void check_prelink_cache(void **state)
+{
+    (void)state;
+    struct stat stats;
+    struct stat changed;
+    char content[8];
+    size_t fds;
+    int undone;
+    int big;
+    int fd;
+
+    /* clearing is always possible, cache may be empty */
+    assert_int_equal(DRPM_ERR_OK, drpm_clear_prelink_cache());
+    assert_int_equal(DRPM_ERR_OK, drpm_clear_prelink_cache());
+
+    assert_true((undone = open(PRELINK_UNDONE, O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0);
+    assert_int_equal(7, write(undone, "undone\n", 7));
+    fds = open_fds();
+
+    /* hit, with its own offset */
+    stats = prelink_stats(1);
+    assert_int_equal(-1, prelink_cache_open(&stats));
+    prelink_cache_add(&stats, undone);
+    assert_int_equal(fds + 1, open_fds());
+    assert_true((fd = prelink_cache_open(&stats)) >= 0);
+    assert_int_equal(7, read(fd, content, sizeof(content)));
+    assert_memory_equal("undone\n", content, 7);
+    assert_int_equal(0, close(fd));
+
+    /* miss once the original file has changed */
+    changed = stats;
+    changed.st_size++;
+    assert_int_equal(-1, prelink_cache_open(&changed));
+    changed = stats;
+    changed.st_mtim.tv_nsec++;
+    assert_int_equal(-1, prelink_cache_open(&changed));
+    changed = stats;
+    changed.st_ctim.tv_sec++;
+    assert_int_equal(-1, prelink_cache_open(&changed));
+
+    /* clearing closes cached descriptors */
+    assert_int_equal(DRPM_ERR_OK, drpm_clear_prelink_cache());
+    assert_int_equal(fds, open_fds());
+    assert_int_equal(-1, prelink_cache_open(&stats));
+
+    /* least recently used entry is evicted when the cache is full */
+    for (ino_t ino = 1; ino <= PRELINK_CACHE_MAX; ino++) {
+        stats = prelink_stats(ino);
+        prelink_cache_add(&stats, undone);
+    }
+    assert_int_equal(fds + PRELINK_CACHE_MAX, open_fds());
+    stats = prelink_stats(1);
+    assert_true((fd = prelink_cache_open(&stats)) >= 0);
+    assert_int_equal(0, close(fd));
+    stats = prelink_stats(PRELINK_CACHE_MAX + 1);
+    prelink_cache_add(&stats, undone);
+    assert_int_equal(fds + PRELINK_CACHE_MAX, open_fds());
+    stats = prelink_stats(2);
+    assert_int_equal(-1, prelink_cache_open(&stats));
+    for (ino_t ino = 1; ino <= PRELINK_CACHE_MAX + 1; ino++) {
+        if (ino == 2)
+            continue;
+        stats = prelink_stats(ino);
+        assert_true((fd = prelink_cache_open(&stats)) >= 0);
+        assert_int_equal(0, close(fd));
+    }
+    assert_int_equal(DRPM_ERR_OK, drpm_clear_prelink_cache());
+    assert_int_equal(fds, open_fds());
+
+    /* ... or would exceed its size limit (sparse files take no space) */
+    assert_true((big = open(PRELINK_UNDONE_BIG, O_RDWR | O_CREAT | O_TRUNC, 0644)) >= 0);
+    assert_int_equal(0, ftruncate(big, PRELINK_CACHE_BYTES / 2 + 1));
+    stats = prelink_stats(1);
+    prelink_cache_add(&stats, undone);
+    stats = prelink_stats(2);
+    prelink_cache_add(&stats, big);
+    stats = prelink_stats(1);
+    assert_true((fd = prelink_cache_open(&stats)) >= 0);
+    assert_int_equal(0, close(fd));
+    stats = prelink_stats(3);
+    prelink_cache_add(&stats, big);
+    stats = prelink_stats(2);
+    assert_int_equal(-1, prelink_cache_open(&stats));
+    stats = prelink_stats(1);
+    assert_true((fd = prelink_cache_open(&stats)) >= 0);
+    assert_int_equal(0, close(fd));
+    stats = prelink_stats(3);
+    assert_true((fd = prelink_cache_open(&stats)) >= 0);
+    assert_int_equal(0, close(fd));
+
+    /* content larger than the limit is not cached at all */
+    assert_int_equal(0, ftruncate(big, PRELINK_CACHE_BYTES + 1));
+    stats = prelink_stats(4);
+    prelink_cache_add(&stats, big);
+    assert_int_equal(-1, prelink_cache_open(&stats));
+    stats = prelink_stats(3);
+    assert_true((fd = prelink_cache_open(&stats)) >= 0);
+    assert_int_equal(0, close(fd));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_clear_prelink_cache());
+    assert_int_equal(0, close(big));
+    assert_int_equal(0, close(undone));
+}
+
+static void check_digest_multi(void **state)
+{
+    unsigned char *data;
+    const size_t data_len = 300000;
+    unsigned char expected[SHA256_DIGEST_LENGTH];
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct digest dgst = {0};
+
+    (void)state;
+
+    assert_non_null(data = malloc(data_len));
+    for (size_t i = 0; i < data_len; i++)
+        data[i] = i * 7;
+
+    /* MD5 covers all data, SHA-256 only what is fed after it is started */
+    assert_int_equal(DRPM_ERR_OK, digest_init(&dgst, DIGEST_MASK(DIGESTALGO_MD5)));
+    assert_int_equal(DRPM_ERR_OK, digest_update(&dgst, data, 100));
+    assert_int_equal(DRPM_ERR_PROG, digest_init(&dgst, DIGEST_MASK(DIGESTALGO_MD5)));
+    assert_int_equal(DRPM_ERR_OK, digest_init(&dgst, DIGEST_MASK(DIGESTALGO_SHA256)));
+    assert_int_equal(DRPM_ERR_OK, digest_update(&dgst, data + 100, data_len - 100));
+
+    SHA256(data + 100, data_len - 100, expected);
+    assert_int_equal(DRPM_ERR_OK, digest_final(&dgst, DIGESTALGO_SHA256, digest));
+    assert_memory_equal(expected, digest, SHA256_DIGEST_LENGTH);
+    assert_int_equal(DRPM_ERR_PROG, digest_final(&dgst, DIGESTALGO_SHA256, digest));
+
+    /* finalized digests are no longer updated */
+    assert_int_equal(DRPM_ERR_OK, digest_update(&dgst, data, 0));
+    MD5(data, data_len, expected);
+    assert_int_equal(DRPM_ERR_OK, digest_final(&dgst, DIGESTALGO_MD5, digest));
+    assert_memory_equal(expected, digest, MD5_DIGEST_LENGTH);
+
+    digest_destroy(&dgst);
+    free(data);
+}
+
 /***************************** drpm_apply *****************************/
 
 static void apply_standard(void **state)
@@ -980,6 +1367,266 @@ static void apply_standard_zstd(void **state)
 }
 #endif
 
+static int count_output(void *arg, const void *data, size_t len)
+{
+    (void)data;
+    *(size_t *)arg += len;
+    return 0;
+}
+
+static int fail_output(void *arg, const void *data, size_t len)
+{
+    (void)arg;
+    (void)data;
+    (void)len;
+    return -1;
+}
+
+static void apply_standard_sink(void **state)
+{
+    (void)state;
+    FILE *file;
+    struct stat stats;
+    size_t cb_len = 0;
+
+    assert_non_null(file = fopen(RPMOUT_STANDARD_FD, "w"));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_fd(OLDRPM_1, DELTARPM_STANDARD, fileno(file), NULL));
+    assert_int_equal(0, fclose(file));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_cb(OLDRPM_1, DELTARPM_STANDARD, count_output, &cb_len, NULL));
+    assert_int_equal(DRPM_ERR_IO, drpm_apply_cb(OLDRPM_1, DELTARPM_STANDARD, fail_output, NULL, NULL));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_apply_cb(OLDRPM_1, DELTARPM_STANDARD, NULL, NULL, NULL));
+
+    assert_int_equal(0, stat(RPMOUT_STANDARD_FD, &stats));
+    assert_int_equal(stats.st_size, cb_len);
+}
+
+static void apply_copy_range(void **state)
+{
+    (void)state;
+    const int modes[] = {O_RDWR, O_WRONLY};
+    unsigned char data[COPY_RANGE_LEN];
+    unsigned char written[COPY_RANGE_LEN];
+    unsigned char expected[MD5_DIGEST_LENGTH];
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    struct sink *sink;
+    struct digest dgst = {0};
+    int in;
+    int out;
+
+    assert_true((in = open(OLDRPM_1, O_RDONLY)) >= 0);
+    assert_int_equal(COPY_RANGE_LEN, pread(in, data, COPY_RANGE_LEN, 100));
+    MD5(data, COPY_RANGE_LEN, expected);
+
+    /* digest covers written data, whether it is read back or not */
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        assert_true((out = open(RPMOUT_COPY_RANGE, modes[i] | O_CREAT | O_TRUNC, 0644)) >= 0);
+        assert_int_equal(DRPM_ERR_OK, sink_init_fd(&sink, out, false));
+        assert_int_equal(DRPM_ERR_OK, digest_init(&dgst, DIGEST_MASK(DIGESTALGO_MD5)));
+        assert_int_equal(DRPM_ERR_OK, sink_write(sink, "lead", 4));
+        assert_int_equal(DRPM_ERR_OK, sink_copy_range(sink, in, 100, COPY_RANGE_LEN, &dgst));
+        assert_int_equal(DRPM_ERR_OK, sink_flush(sink));
+        assert_int_equal(DRPM_ERR_OK, digest_final(&dgst, DIGESTALGO_MD5, md5));
+        assert_int_equal(DRPM_ERR_OK, sink_destroy(&sink));
+        assert_int_equal(0, close(out));
+
+        assert_memory_equal(expected, md5, MD5_DIGEST_LENGTH);
+        assert_true((out = open(RPMOUT_COPY_RANGE, O_RDONLY)) >= 0);
+        assert_int_equal(COPY_RANGE_LEN, pread(out, written, COPY_RANGE_LEN, 4));
+        assert_memory_equal(data, written, COPY_RANGE_LEN);
+        assert_int_equal(0, close(out));
+    }
+
+    assert_int_equal(0, close(in));
+}
+
+static void apply_direct_fd(void **state)
+{
+    (void)state;
+    unsigned char data[DIRECT_LEN];
+    unsigned char written[DIRECT_LEN];
+    struct sink *sink;
+    int flags;
+    int fd;
+
+    for (size_t i = 0; i < DIRECT_LEN; i++)
+        data[i] = i % 251;
+
+    /* not all filesystems support O_DIRECT */
+    if ((fd = open(RPMOUT_DIRECT, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644)) < 0)
+        return;
+    assert_true((flags = fcntl(fd, F_GETFL)) != -1);
+
+    /* aligned start, unaligned tail */
+    assert_int_equal(DRPM_ERR_OK, sink_init_fd(&sink, fd, true));
+    assert_int_equal(DRPM_ERR_OK, sink_write(sink, data, DIRECT_LEN));
+    assert_int_equal(DRPM_ERR_OK, sink_flush(sink));
+    assert_int_equal(DRPM_ERR_OK, sink_destroy(&sink));
+    assert_int_equal(flags, fcntl(fd, F_GETFL));
+
+    /* unaligned start */
+    assert_int_equal(DRPM_ERR_OK, sink_init_fd(&sink, fd, true));
+    assert_int_equal(DRPM_ERR_OK, sink_write(sink, data, DIRECT_LEN));
+    assert_int_equal(DRPM_ERR_OK, sink_flush(sink));
+    assert_int_equal(DRPM_ERR_OK, sink_destroy(&sink));
+    assert_int_equal(flags, fcntl(fd, F_GETFL));
+    assert_int_equal(0, close(fd));
+
+    assert_int_equal(2 * DIRECT_LEN, filesize(RPMOUT_DIRECT));
+    assert_true((fd = open(RPMOUT_DIRECT, O_RDONLY)) >= 0);
+    for (size_t i = 0; i < 2; i++) {
+        assert_int_equal(DIRECT_LEN, pread(fd, written, DIRECT_LEN, i * DIRECT_LEN));
+        assert_memory_equal(data, written, DIRECT_LEN);
+    }
+    assert_int_equal(0, close(fd));
+}
+
+static void apply_standard_options(void **state)
+{
+    (void)state;
+    drpm_apply_options *opts = NULL;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_spill_dir(opts, "."));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_set_spill_comp(opts, DRPM_COMP_GZIP));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_apply_options_set_spill_comp(opts, DRPM_COMP_BZIP2));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_plan_reads(opts));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_apply_options_plan_reads(NULL));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_use_pipeline(opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_use_direct_io(opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_with_options(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_OPTIONS, opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+    assert_null(opts);
+}
+
+static void apply_standard_uncompressed(void **state)
+{
+    (void)state;
+    drpm_apply_options *opts = NULL;
+    struct rpm *uncomp_rpm = NULL;
+    struct rpm *new_rpm = NULL;
+    unsigned short comp;
+    unsigned char *uncomp_archive = NULL;
+    unsigned char *new_archive = NULL;
+    size_t uncomp_archive_len;
+    size_t new_archive_len;
+    uint64_t sig_size;
+    bool has_size;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_uncompressed_payload(opts));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_apply_options_uncompressed_payload(NULL));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_with_options(OLDRPM_1, DELTARPM_STANDARD, RPMOUT_STANDARD_UNCOMP, opts));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_apply_with_options(OLDRPM_2, DELTARPM_RPMONLY, RPMOUT_RPMONLY_UNCOMP, opts));
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+
+    /* payload is the decompressed original, described as such */
+    assert_int_equal(DRPM_ERR_OK, rpm_read(&uncomp_rpm, RPMOUT_STANDARD_UNCOMP, RPM_ARCHIVE_READ_UNCOMP, NULL, NULL, NULL));
+    assert_int_equal(DRPM_ERR_OK, rpm_read(&new_rpm, NEWRPM_1, RPM_ARCHIVE_READ_DECOMP, &comp, NULL, NULL));
+    assert_int_equal(DRPM_ERR_FORMAT, rpm_get_comp(uncomp_rpm, &comp));
+    assert_int_equal(DRPM_ERR_OK, rpm_fetch_archive(uncomp_rpm, &uncomp_archive, &uncomp_archive_len));
+    assert_int_equal(DRPM_ERR_OK, rpm_fetch_archive(new_rpm, &new_archive, &new_archive_len));
+    assert_int_equal(new_archive_len, uncomp_archive_len);
+    assert_memory_equal(new_archive, uncomp_archive, new_archive_len);
+
+    /* signature size covers header and payload */
+    assert_int_equal(DRPM_ERR_OK, rpm_signature_get_size(uncomp_rpm, &sig_size, &has_size));
+    assert_true(has_size);
+    assert_int_equal(rpm_size_header(uncomp_rpm) + uncomp_archive_len, sig_size);
+    assert_int_equal(filesize(RPMOUT_STANDARD_UNCOMP), rpm_size_full(uncomp_rpm));
+
+    free(uncomp_archive);
+    free(new_archive);
+    assert_int_equal(DRPM_ERR_OK, rpm_destroy(&uncomp_rpm));
+    assert_int_equal(DRPM_ERR_OK, rpm_destroy(&new_rpm));
+}
+
+struct concurrent_apply {
+    char rpmout[32];
+    const drpm_apply_options *opts;
+    int error;
+};
+
+static void *apply_concurrent_thread(void *arg)
+{
+    struct concurrent_apply *job = arg;
+
+    job->error = drpm_apply_with_options(OLDRPM_1, DELTARPM_STANDARD, job->rpmout, job->opts);
+
+    return NULL;
+}
+
+static void apply_standard_concurrent(void **state)
+{
+    (void)state;
+    pthread_t threads[CONCURRENT_APPLIES];
+    struct concurrent_apply jobs[CONCURRENT_APPLIES];
+    drpm_apply_options *opts = NULL;
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_init(&opts));
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_use_pipeline(opts));
+
+    /* every other apply shares the same (pipelined) options */
+    for (unsigned i = 0; i < CONCURRENT_APPLIES; i++) {
+        snprintf(jobs[i].rpmout, sizeof(jobs[i].rpmout), RPMOUT_CONCURRENT_FORMAT, i);
+        jobs[i].opts = (i % 2 == 0) ? NULL : opts;
+        jobs[i].error = -1;
+        assert_int_equal(0, pthread_create(&threads[i], NULL, apply_concurrent_thread, &jobs[i]));
+    }
+
+    for (unsigned i = 0; i < CONCURRENT_APPLIES; i++) {
+        assert_int_equal(0, pthread_join(threads[i], NULL));
+        assert_int_equal(DRPM_ERR_OK, jobs[i].error);
+    }
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_options_destroy(&opts));
+}
+
+static void apply_batch(void **state)
+{
+    (void)state;
+    drpm_apply_job jobs[] = {
+        {OLDRPM_1, DELTARPM_STANDARD, RPMOUT_BATCH_STANDARD, -1},
+        {NULL, DELTARPM_RPMONLY, RPMOUT_BATCH_RPMONLY, -1},
+        {OLDRPM_2, DELTARPM_RPMONLY_NOADDBLK, RPMOUT_BATCH_NOADDBLK, -1},
+        {OLDRPM_1, NULL, RPMOUT_BATCH_STANDARD, -1}
+    };
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_batch(NULL, 0, 0, NULL));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_apply_batch(NULL, 1, 0, NULL));
+
+    /* rpm-only DeltaRPMs cannot be applied from filesystem */
+    assert_int_equal(DRPM_ERR_ARGS, drpm_apply_batch(jobs, 4, 2, NULL));
+    assert_int_equal(DRPM_ERR_OK, jobs[0].error);
+    assert_int_equal(DRPM_ERR_ARGS, jobs[1].error);
+    assert_int_equal(DRPM_ERR_OK, jobs[2].error);
+    assert_int_equal(DRPM_ERR_ARGS, jobs[3].error);
+
+    assert_int_equal(DRPM_ERR_OK, drpm_apply_batch(jobs, 1, 0, NULL));
+    assert_int_equal(DRPM_ERR_OK, jobs[0].error);
+}
+
+static void apply_prepared(void **state)
+{
+    (void)state;
+    drpm_prepared *prep = NULL;
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_prepare(NULL, DELTARPM_STANDARD, DRPM_CHECK_NONE));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_prepare(&prep, NULL, DRPM_CHECK_NONE));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_prepare(&prep, DELTARPM_STANDARD, -1));
+
+    /* rpm-only DeltaRPMs cannot be applied from filesystem */
+    assert_int_equal(DRPM_ERR_ARGS, drpm_prepare(&prep, DELTARPM_RPMONLY, DRPM_CHECK_NONE));
+    assert_null(prep);
+
+    assert_int_equal(DRPM_ERR_ARGS, drpm_apply_prepared(NULL, RPMOUT_STANDARD, NULL));
+    assert_int_equal(DRPM_ERR_ARGS, drpm_prepared_destroy(&prep));
+}
+
 /***************************** run tests ******************************/
 
 int main()
@@ -1004,6 +1651,7 @@ int main()
         cmocka_unit_test(read_rpmonly),
         cmocka_unit_test(read_standard),
         cmocka_unit_test(read_rpmonly_noaddblk),
+        cmocka_unit_test(read_changed),
 #ifdef HAVE_LZLIB_DEVEL
         cmocka_unit_test(read_standard_lzip)
 #endif
@@ -1012,11 +1660,25 @@ int main()
 #endif
     };
     const struct CMUnitTest check_tests[] = {
-        cmocka_unit_test(check_sequence)
+        cmocka_unit_test(check_sequence),
+        cmocka_unit_test(check_sequence_batch),
+        cmocka_unit_test(check_concurrent),
+        cmocka_unit_test(check_digest_cache),
+        cmocka_unit_test(check_digest_cache_entries),
+        cmocka_unit_test(check_prelink_cache),
+        cmocka_unit_test(check_digest_multi)
     };
     const struct CMUnitTest apply_tests[] = {
         cmocka_unit_test(apply_standard),
         cmocka_unit_test(apply_rpmonly_noaddblk),
+        cmocka_unit_test(apply_standard_options),
+        cmocka_unit_test(apply_standard_sink),
+        cmocka_unit_test(apply_copy_range),
+        cmocka_unit_test(apply_direct_fd),
+        cmocka_unit_test(apply_standard_uncompressed),
+        cmocka_unit_test(apply_standard_concurrent),
+        cmocka_unit_test(apply_batch),
+        cmocka_unit_test(apply_prepared),
 #ifdef HAVE_LZLIB_DEVEL
         cmocka_unit_test(apply_standard_lzip)
 #endif